@@ -0,0 +1,93 @@
+#ifndef BOOTLOADER_BUS_H
+#define BOOTLOADER_BUS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "TxScheduler.h"
+#include "BootloaderProtocol.h"
+
+class Can;
+class EventLoop;
+class BootloaderSession;
+struct CanRxFrame;
+
+/* A node that answered BootloaderBus::scan(). */
+struct NodeInfo {
+    uint8_t node;
+    uint32_t crc;           // application CRC (0x05)
+    bool valid;             // the CRC is not that of an erased application
+    bool caps;              // answered the capability probe (0x06)
+    uint8_t features;       // CAP_* bits, with caps
+    uint16_t pageSize;      // with caps, 0 when not reported
+};
+
+/*
+ * One SocketCAN interface with its TX scheduler and a session for every
+ * node ID. The socket is read from a shared RX loop that only drains it into
+ * the interface's RX ring; responses are demultiplexed by node ID and handed
+ * to the sessions on a dispatch loop, so a slow consumer cannot stall socket
+ * draining. Any number of interfaces can share the two loops.
+ *
+ * Only responses of running sessions and of the selected node reach user
+ * space; the kernel filters out everything else.
+ */
+class BootloaderBus
+{
+public:
+    BootloaderBus(const std::string &name);
+    ~BootloaderBus();
+
+    /* Opens the interface and attaches it to the loops. */
+    int open(EventLoop *rxLoop, EventLoop *dispatchLoop);
+
+    const std::string &name() const { return m_name; }
+    Can *can() { return m_can; }
+    BusStats &stats() { return m_stats; }
+    TxScheduler &tx() { return m_tx; }
+    BootloaderSession *session(uint8_t node) { return m_sessions[node & (NODE_COUNT - 1)]; }
+
+    /* Node that receives responses while idle (interactive use), -1 for
+     * none. Updates the filters. */
+    void setSelectedNode(int node);
+    void updateFilters();
+
+    /* Discovers the nodes in bootloader mode: sends 0x05 to every node
+     * whose session is not running, all at once, and collects the answers
+     * within one timeout, then probes the nodes found for capabilities the
+     * same way. The result replaces the inventory, except for the entries
+     * of running sessions. Returns the number of nodes that answered. */
+    int scan(int timeout_ms = SCAN_TIMEOUT_MS);
+    /* Nodes of the last scan, by node ID. */
+    std::vector<NodeInfo> inventory();
+
+    static const int SCAN_TIMEOUT_MS = 1000;
+
+    /* Log error frames. */
+    void setVerbose(bool enabled) { m_verbose = enabled; }
+
+private:
+    BootloaderBus(const BootloaderBus &);
+    BootloaderBus &operator=(const BootloaderBus &);
+
+    void handleFrame(const CanRxFrame &rx);
+    void drainRxRing();
+
+    std::string m_name;
+    Can *m_can;
+    BusStats m_stats;
+    TxScheduler m_tx;
+    BootloaderSession *m_sessions[NODE_COUNT];
+    EventLoop *m_rxLoop;
+    EventLoop *m_dispatchLoop;
+    std::mutex m_filterMtx;
+    std::atomic<int> m_selected;
+    std::atomic<bool> m_scanning;
+    std::mutex m_inventoryMtx;
+    std::vector<NodeInfo> m_inventory;
+    std::atomic<bool> m_verbose;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef BOOTLOADER_PROTOCOL_H
+#define BOOTLOADER_PROTOCOL_H
+
+/*
+ * Bootloader CAN protocol. Every frame uses an 11-bit ID made of a 4-bit
+ * node ID (bits 7-10) and a 7-bit command; responses are commands
+ * 0x10-0x1F.
+ */
+
+// Node IDs 0x00-0x0F, the 4 bits above the command in the CAN ID.
+#define NODE_COUNT  16
+
+// Application flash of the target. Write offsets (0x0C) and pages are
+// relative to APP_START.
+#define APP_START   0x08008000
+#define APP_END     0x080C0000
+
+// 0x11 confirmation: [status, cmd, 0]. status 0xFF = success; cmd is the
+// command being confirmed, or 0 from bootloaders that do not say, whose
+// answers are matched to the outstanding command by order alone.
+
+// Capability negotiation (0x06 -> 0x13). Legacy bootloaders never answer,
+// so queryCapabilities() times out and the uploader falls back to
+// stop-and-wait.
+#define CAP_WINDOWED_WRITE  0x01
+#define CAP_FULL_FRAME      0x02
+#define CAP_CANFD           0x04
+#define CAP_BLOCK_ACK       0x08
+#define CAP_PAGE_CRC        0x10
+#define CAP_ERASE_AHEAD     0x20
+#define CAP_COMPRESSED      0x40
+
+// 0x02 Start write arguments: [mode, window, chunk, block_hi, block_lo].
+// Sequenced frames carry `chunk` firmware bytes each, at offset seq * chunk;
+// the block size (in frames) is only sent in block-ack mode.
+#define WINDOW_MAX              255
+#define WRITE_MODE_LEGACY       0x00
+#define WRITE_MODE_WINDOWED     0x01
+#define WRITE_MODE_FULL_FRAME   0x02
+#define WRITE_MODE_FD           0x04
+#define WRITE_MODE_BLOCK_ACK    0x08
+// The target erases every page right before it programs the first byte of
+// it, and may already erase the next page while the current one arrives.
+// 0x13 data[5..6] gives the page erase time in ms.
+#define WRITE_MODE_ERASE        0x10
+// Sequenced frames carry an LZ4 record stream (see Lz4.h) instead of the
+// image; the target decompresses every record into its page buffer and
+// programs the result. 0x05 still covers the decompressed bytes.
+#define WRITE_MODE_LZ4          0x20
+
+// 0x15 block status: [status, block_hi, block_lo, part, bitmap (4 bytes)].
+// Each part covers 32 frames of the block, bit set = frame missing.
+#define BLOCK_PARTS_MAX         256
+#define BLOCK_COMPLETE          0xFF
+#define BLOCK_HOLES_MORE        0x01
+#define BLOCK_HOLES_LAST        0x02
+
+// Page commands (CAP_PAGE_CRC), all counted in pages of the size reported
+// by 0x13 and relative to the application start:
+//   0x0A [page_hi, page_lo, count_hi, count_lo] -> one 0x16 per page,
+//        [page_hi, page_lo, crc (4 bytes)], CRC-32 over the whole page
+//   0x0B [page_hi, page_lo, count_hi, count_lo] -> 0x11, erase the pages
+//   0x0C [offset (4 bytes)] -> 0x11, byte offset of the next 0x02 write
+#define PAGE_QUERY_MAX          64
+#define PAGE_CRC_RETRIES        3
+
+// Round-trip latency per command class, in microseconds, measured from the
+// TX call to the kernel receive timestamp of the response. LAT_HOST is the
+// time a response spent between the kernel and the session.
+enum LatencyKind {
+    LAT_ERASE = 0,
+    LAT_START,
+    LAT_WRITE,
+    LAT_END,
+    LAT_CRC,
+    LAT_CAPS,
+    LAT_BLOCK,
+    LAT_PAGE_CRC,
+    LAT_HOST,
+    LAT_COUNT
+};
+
+const char *latencyName(int kind);
+
+#endif
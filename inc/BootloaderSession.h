@@ -0,0 +1,287 @@
+#ifndef BOOTLOADER_SESSION_H
+#define BOOTLOADER_SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <linux/can.h>
+#include "BootloaderProtocol.h"
+#include "Completion.h"
+#include "FirmwareImage.h"
+#include "ImageCache.h"
+#include "Histogram.h"
+#include "RingBuffer.h"
+#include "RtoEstimator.h"
+
+class BootloaderBus;
+struct CanRxTimestamp;
+
+enum SessionState {
+    SESSION_IDLE = 0,
+    SESSION_RUNNING,
+    SESSION_DONE,
+    SESSION_FAILED
+};
+
+class BootloaderSession;
+
+/* Lifetime counters of a session, updated by the flashing thread and
+ * readable from any other. */
+struct SessionStats {
+    std::atomic<uint64_t> commands{0};      // command frames, resends included
+    std::atomic<uint64_t> frames{0};        // data frames, resends included
+    std::atomic<uint64_t> retransmits{0};   // resent commands and data frames
+    std::atomic<uint64_t> timeouts{0};      // answers that did not arrive in time
+};
+
+/* Called from the flashing thread with the bytes written so far;
+ * finished is set once when the write phase ends, successful or not. */
+typedef std::function<void (size_t done, size_t total, bool finished)> ProgressCallback;
+typedef std::function<void (BootloaderSession &session, bool ok)> CompletionCallback;
+
+/* How flashImage() erases the target before a full write. */
+enum EraseMode {
+    /* Whole application with 0x01. */
+    ERASE_FULL = 0,
+    /* Only the pages the image covers, with 0x0B (CAP_PAGE_CRC). */
+    ERASE_RANGE,
+    /* Pages are erased by the target during the write (CAP_ERASE_AHEAD),
+     * falling back to ERASE_RANGE and then ERASE_FULL. */
+    ERASE_OVERLAPPED
+};
+
+struct FlashOptions {
+    /* Pipelined write window, 1 = stop-and-wait. */
+    int window = 16;
+    /* Only rewrite the pages whose CRC differs (CAP_PAGE_CRC). */
+    bool delta = false;
+    /* Also compare every page CRC after a full write. */
+    bool verifyPages = false;
+    /* Skip pages that are all 0xFF after the erase (CAP_PAGE_CRC); the
+     * image is then verified page by page instead of with 0x05. */
+    bool sparse = true;
+    EraseMode erase = ERASE_OVERLAPPED;
+    /* Send LZ4 compressed pages when the target can decompress them
+     * (CAP_COMPRESSED) and the image shrinks. */
+    bool compress = true;
+    /* Encoded image from ImageCache; when set it is flashed instead of the
+     * image and CRC arguments, and its frames, page CRCs and LZ4 records
+     * are used instead of building them again. */
+    std::shared_ptr<const PreparedImage> prepared;
+    /* Only log failures, not the individual steps. */
+    bool quiet = false;
+    ProgressCallback progress;
+};
+
+/*
+ * Everything the protocol needs to talk to one node. The bus routes each
+ * response to the session of the node it came from, so sessions for
+ * different nodes (on one or several interfaces) can run at the same time
+ * without sharing any state. Sessions are owned by their BootloaderBus.
+ *
+ * The protocol operations block the calling thread; run one at a time per
+ * session. start() runs a whole flash on a thread of its own and reports
+ * through the returned future and the completion callback, so one process
+ * can drive many sessions at once. The image must stay valid until then.
+ */
+class BootloaderSession
+{
+public:
+    BootloaderSession(BootloaderBus *bus, uint8_t nodeId);
+    ~BootloaderSession();
+
+    BootloaderBus *bus() const { return m_bus; }
+    uint8_t nodeId() const { return m_nodeId; }
+
+    /* Sends a command and waits for its 0x11 (or 0x12 for 0x05). The wait
+     * adapts to the measured round trips of the command class; commands
+     * that can safely be repeated are resent a few times before giving up. */
+    bool sendCommand(uint8_t cmd, const uint8_t *data, size_t len, bool verbose = true);
+    bool sendCommand(uint8_t cmd, const std::vector<uint8_t> &data, bool verbose = true);
+    /* Sends a command without waiting for an answer. */
+    bool transmitCommand(uint8_t cmd, const uint8_t *data, size_t len);
+
+    bool queryCapabilities(int timeout_ms = 200);
+    /* readCrc() (0x05) or queryCapabilities() (0x06) in two halves, without
+     * retries, so many nodes can answer within one timeout: postQuery()
+     * sends the command, collectQuery() waits for its answer. Unlike
+     * readCrc() they leave result() and bytesDone() alone, so a scan does
+     * not hide the outcome of the last operation. */
+    bool postQuery(uint8_t cmd);
+    bool collectQuery(Deadline deadline);
+    bool erase();
+    bool readCrc(uint32_t &crc);
+    /* Reads the CRCs of pages [first, first + count). */
+    bool queryPageCrcs(size_t first, size_t count, std::vector<uint32_t> &crcs);
+
+    /* Erase (or compare pages), negotiate, write and verify the image.
+     * crc is the CRC-32 of the whole image. */
+    bool flash(const ImageView &image, uint32_t crc, const FlashOptions &opt);
+    std::shared_future<bool> start(const ImageView &image, uint32_t crc, const FlashOptions &opt,
+                                   CompletionCallback done = nullptr);
+    /* Waits for a flash started with start(). */
+    bool wait();
+
+    /* Logs every command and response. */
+    void setVerbose(bool enabled) { m_verbose = enabled; }
+    /* Spin up to us microseconds for every response before sleeping
+     * (0 = sleep at once). Only worth it with a core to spare. */
+    void setBusyPoll(uint32_t us) { m_busyPollUs = us; }
+
+    int state() const { return m_state; }
+    size_t bytesDone() const { return m_bytesDone; }
+    size_t bytesTotal() const { return m_bytesTotal; }
+    /* Outcome of the last operation, e.g. "OK" or "CRC mismatch". */
+    std::string result() const;
+    /* Duration of the last flash. */
+    double seconds() const;
+
+    uint32_t receivedCrc();
+    uint8_t features();
+    uint16_t pageSize();
+
+    /* Copies the latency histograms (LAT_COUNT entries). */
+    void latency(Histogram *out);
+    const SessionStats &stats() const { return m_stats; }
+
+    /* Called by the bus on its dispatch thread. */
+    void handleResponse(const struct can_frame &frame, const CanRxTimestamp &ts);
+
+    /* CRC-32 of every page of the image, the last one padded with 0xFF. */
+    static void localPageCrcs(const ImageView &buf, size_t page, std::vector<uint32_t> &crcs);
+
+private:
+    // Sequenced write acks (0x14), queued by handleResponse and drained by
+    // the windowed writer.
+    struct SeqAck {
+        uint16_t seq;
+        uint8_t status;
+        uint64_t rx_ns;
+    };
+
+    struct PageCrc {
+        uint16_t page;
+        uint32_t crc;
+        uint64_t rx_ns;
+    };
+
+    struct BlockAck {
+        uint8_t status;
+        uint16_t block;
+        uint8_t part;
+        uint32_t missing;
+        uint64_t rx_ns;
+    };
+
+    // Write parameters agreed with the target: command, payload bytes per
+    // frame, window and block size.
+    struct WritePlan {
+        uint8_t mode = WRITE_MODE_LEGACY;
+        uint8_t cmd = 0x03;
+        size_t chunk = 4;
+        int window = 1;
+        bool fd = false;
+        size_t block_frames = 0;
+    };
+
+    BootloaderSession(const BootloaderSession &);
+    BootloaderSession &operator=(const BootloaderSession &);
+
+    void begin(size_t total);
+    void finish(bool ok);
+    bool run(const ImageView &buf, uint32_t crc, const FlashOptions &opt);
+    bool flashImage(const ImageView &buf, uint32_t local_crc);
+    bool flashDelta(const ImageView &buf);
+    bool flashSparse(const ImageView &buf, const std::vector<std::pair<size_t, size_t>> &runs, const WritePlan &plan,
+                     bool erase);
+    bool useEraseAhead(WritePlan &plan);
+    bool eraseStalePages(const std::vector<std::pair<size_t, size_t>> &runs, size_t pages);
+    void setResult(const char *result);
+
+    int waitResponse(uint8_t cmd, uint64_t timeout_us);
+    template <typename Ready>
+    bool waitQueued(std::unique_lock<std::mutex> &lock, Deadline deadline, Ready ready);
+    uint64_t timeoutUs(int kind);
+    bool hasRtt(int kind);
+    void backoff(int kind);
+    void recordLatency(uint8_t cmd, uint64_t tx_ns, uint64_t rx_ns);
+    bool buildFrame(uint8_t cmd, const uint8_t *data, size_t len, bool fd, struct canfd_frame &tx);
+    bool buildChunk(const ImageView &buf, size_t i, uint8_t cmd, size_t chunk, bool fd, struct canfd_frame &tx);
+    bool transmitChunk(const ImageView &buf, size_t i, uint8_t cmd, size_t chunk, bool fd);
+
+    void updateProgress(size_t done, size_t total);
+    void endProgress();
+    bool writeStopAndWait(const ImageView &buf);
+    bool writeWindowed(const ImageView &buf, int window, uint8_t cmd, size_t chunk, bool fd);
+    bool queryBlock(uint16_t block, size_t count, std::vector<size_t> &missing, bool sample);
+    bool writeBlocks(const ImageView &buf, uint8_t cmd, size_t chunk, bool fd, size_t block_frames);
+    WritePlan planWrite(bool caps);
+    bool writeRegion(const ImageView &buf, const WritePlan &plan);
+    bool erasePages(size_t first, size_t count);
+    bool writePages(const ImageView &buf, size_t first, size_t count, const WritePlan &plan, bool erase);
+    bool verifyPages(size_t first, size_t count, const std::vector<uint32_t> &local);
+    void imagePageCrcs(const ImageView &buf, size_t page, std::vector<uint32_t> &crcs);
+
+    BootloaderBus *m_bus;
+    uint8_t m_nodeId;
+
+    mutable std::mutex m_mtx;
+    // The outstanding 0x01-0x06/0x0B/0x0C command; 0x14/0x15/0x16 answers
+    // are queued below and announced through the doorbell.
+    CompletionSlot m_reply;
+    Doorbell m_doorbell;
+    std::atomic<uint32_t> m_busyPollUs;
+    // Command and send time of the query between postQuery() and
+    // collectQuery().
+    uint8_t m_queryCmd;
+    uint64_t m_queryTxNs;
+    uint32_t m_receivedCrc;
+
+    uint8_t m_protoVersion;
+    uint8_t m_features;
+    uint8_t m_maxWindow;
+    uint16_t m_pageSize;
+    uint16_t m_pageEraseMs;
+    // Lower bound of the write and block timeouts while the target erases
+    // pages during the write.
+    uint64_t m_eraseFloorUs;
+    // Prepared frames of the running write, or null to build them.
+    const std::vector<struct canfd_frame> *m_frames;
+
+    // Filled by handleResponse on the dispatch thread, emptied by the
+    // writer; fixed size, so acks never allocate. Both sides hold m_mtx.
+    RingBuffer<SeqAck> m_seqAcks;
+    RingBuffer<BlockAck> m_blockAcks;
+    RingBuffer<PageCrc> m_pageCrcs;
+
+    // The latency histograms and the timeouts derived from them, guarded
+    // by m_mtx.
+    Histogram m_latency[LAT_COUNT];
+    RtoEstimator m_rto[LAT_COUNT];
+
+    // Options of the running flash.
+    FlashOptions m_opt;
+    std::atomic<bool> m_verbose;
+
+    // Progress/result report, readable while a flash runs. m_result is
+    // guarded by m_mtx.
+    std::atomic<int> m_state;
+    std::atomic<size_t> m_bytesDone;
+    std::atomic<size_t> m_bytesTotal;
+    SessionStats m_stats;
+    std::string m_result;
+    std::chrono::steady_clock::time_point m_started;
+    std::chrono::steady_clock::time_point m_finished;
+
+    std::thread m_worker;
+    std::shared_future<bool> m_future;
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef CAN_CAPTURE_H
+#define CAN_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <linux/can.h>
+#include "MThread.h"
+#include "RingBuffer.h"
+#include "Completion.h"
+#include "can.h"
+
+/*
+ * Capture file: a header, then records appended in the order they were
+ * written. Every record is a 16-byte header followed by `len` data bytes
+ * padded to a multiple of 8, so a classic frame takes 24 bytes and a file
+ * can be mapped and walked in place. All fields are host byte order.
+ *
+ * CAPTURE_CHANNEL records name a channel (an interface) in their data and
+ * come before the first frame of any channel. Records of different channels
+ * are interleaved in the order the writer drained them, so timestamps only
+ * grow within one channel.
+ */
+#define CAPTURE_MAGIC       0x50414343  // "CCAP"
+#define CAPTURE_VERSION     1
+
+#define CAPTURE_FRAME       0
+#define CAPTURE_CHANNEL     1
+
+struct CaptureFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_ns;      // CLOCK_REALTIME when the file was opened
+};
+
+struct CaptureRecordHeader {
+    uint64_t ts_ns;         // software receive time, CLOCK_REALTIME
+    uint32_t can_id;        // with the CAN_*_FLAG bits
+    uint8_t len;
+    uint8_t flags;          // canfd_frame flags, CANFD_FDF for FD frames
+    uint8_t channel;
+    uint8_t type;
+};
+
+/*
+ * Writes the frames of one or more Can instances to a capture file from a
+ * thread of its own. Each channel has an SPSC ring filled by its RX
+ * thread through record(), which never blocks or allocates; frames that do
+ * not fit are dropped and counted, as are the frames that arrive after a
+ * write error closed the file. Start the writer with start() once all
+ * channels are added.
+ */
+class CaptureWriter : public MThread
+{
+public:
+    CaptureWriter();
+    ~CaptureWriter();
+
+    /* Creates (truncates) path and writes the file header. */
+    int open(const std::string &path);
+    /* Stops the thread after writing out everything queued. */
+    void close();
+
+    /* Returns the channel number, or -1 when the file is not open or all
+     * 256 channels are taken. Not thread safe; call before start(). */
+    int addChannel(const std::string &name, size_t capacity = RING_SIZE);
+
+    /* Called from the channel's RX thread only. Frames without a software
+     * timestamp are stamped with the current time. */
+    void record(int channel, const struct canfd_frame *frames, const struct CanRxTimestamp *stamps, size_t count);
+
+    uint64_t frames() const { return m_frames.load(std::memory_order_relaxed); }
+    uint64_t bytes() const { return m_bytes.load(std::memory_order_relaxed); }
+    uint64_t drops() const;
+
+    virtual void run() override;
+
+    static const size_t RING_SIZE = 8192;
+    /* Written data reaches the file at least this often. */
+    static const int FLUSH_MS = 200;
+
+private:
+    struct Channel {
+        std::string name;
+        RingBuffer<struct CanRxFrame> *ring;
+    };
+
+    size_t drain();
+    void append(uint8_t type, uint8_t channel, uint64_t ts_ns, uint32_t can_id, uint8_t flags, const uint8_t *data,
+                uint8_t len);
+    bool writeOut();
+
+    FILE *m_file;
+    std::string m_path;
+    std::vector<Channel> m_channels;
+    std::vector<uint8_t> m_buf;
+    Doorbell m_doorbell;
+    std::atomic<bool> m_closing;
+    std::atomic<uint64_t> m_frames;
+    std::atomic<uint64_t> m_bytes;
+    std::atomic<uint64_t> m_lost;
+};
+
+/* A frame read back from a capture file. */
+struct CaptureFrame {
+    uint64_t ts_ns;
+    int channel;
+    struct canfd_frame frame;
+};
+
+/*
+ * Reads a capture file through a read-only mapping, one frame at a time.
+ * A record cut short at the end, as in a file that is still being
+ * written, ends the capture.
+ */
+class CaptureReader
+{
+public:
+    CaptureReader();
+    ~CaptureReader();
+
+    int open(const std::string &path);
+    void close();
+
+    /* False at the end of the capture. */
+    bool next(CaptureFrame &frame);
+    void rewind();
+
+    uint64_t startNs() const { return m_startNs; }
+    /* Channel names from the start of the file ("" for unknown ones). */
+    std::string channelName(int channel) const;
+    int findChannel(const std::string &name) const;
+
+private:
+    CaptureReader(const CaptureReader &);
+    CaptureReader &operator=(const CaptureReader &);
+
+    const uint8_t *m_map;
+    size_t m_size;
+    size_t m_pos;
+    uint64_t m_startNs;
+    std::vector<std::string> m_channels;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+/*
+ * Futex based wake-ups between the dispatch thread, which handles the
+ * responses, and the thread waiting for them. Nothing is locked and the
+ * wake system call is skipped when nobody sleeps. A waiter may spin for a
+ * while before it sleeps (busy-poll), which saves the scheduler wake-up on
+ * a dedicated core.
+ */
+typedef std::chrono::steady_clock::time_point Deadline;
+
+/* Counts events; a waiter sleeps until the count moves past the value it
+ * last saw. Used for responses that are queued. */
+class Doorbell
+{
+public:
+    Doorbell();
+
+    uint32_t value() const { return m_seq.load(std::memory_order_acquire); }
+    void ring();
+    /* Returns false when the deadline passed with the count still at seen. */
+    bool wait(uint32_t seen, Deadline deadline, uint32_t spin_us);
+
+private:
+    std::atomic<uint32_t> m_seq;
+    std::atomic<uint32_t> m_waiters;
+};
+
+/*
+ * The one outstanding request of a session. arm() opens the slot for the
+ * response to a command; complete() only fills it when it is armed for that
+ * response, so an answer that arrives after its request timed out, or that
+ * names another command, is dropped instead of being taken for the next
+ * request's. Every arm() starts a new generation, so a responder that
+ * raced with a timeout cannot fill the next request's slot either.
+ */
+class CompletionSlot
+{
+public:
+    CompletionSlot();
+
+    /* Opens the slot for `response` to `cmd`, dropping earlier answers. */
+    void arm(uint8_t cmd, uint8_t response);
+    /* Responder side. echoed is the command the response names, or 0 when
+     * it does not say. Returns false when the slot was not waiting for it. */
+    bool complete(uint8_t response, uint8_t echoed, uint8_t status, uint32_t value, uint64_t rx_ns);
+    /* Returns true once completed; on timeout the slot is closed. */
+    bool wait(Deadline deadline, uint32_t spin_us);
+
+    /* Payload of the completed response. */
+    uint8_t status() const { return m_status; }
+    uint32_t value() const { return m_value; }
+    uint64_t rxNs() const { return m_rxNs; }
+
+private:
+    // Generation in bits 2-31, phase in bits 0-1.
+    std::atomic<uint32_t> m_state;
+    std::atomic<uint32_t> m_waiters;
+    std::atomic<uint8_t> m_cmd;
+    std::atomic<uint8_t> m_response;
+    uint8_t m_status;
+    uint32_t m_value;
+    uint64_t m_rxNs;
+};
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320, init and final XOR
+ * 0xFFFFFFFF), the same CRC the bootloader reports with command 0x05.
+ *
+ * The engine is chosen once at runtime: the ARMv8 CRC32 instructions or
+ * x86 PCLMULQDQ folding when the CPU has them, table-driven slice-by-8
+ * otherwise. update() may be called any number of times on consecutive
+ * pieces of the data; the result does not depend on how it was split.
+ */
+class Crc32
+{
+public:
+    Crc32() : m_state(0xFFFFFFFF) {}
+
+    void update(const void *data, size_t len);
+    uint32_t value() const { return ~m_state; }
+    void reset() { m_state = 0xFFFFFFFF; }
+
+    static uint32_t compute(const void *data, size_t len);
+
+    /* Name of the engine in use: "armv8", "pclmul" or "slice-by-8". */
+    static const char *engine();
+
+private:
+    uint32_t m_state;
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <sys/epoll.h>
+#include "MThread.h"
+
+/*
+ * Single-threaded reactor built on epoll. Any number of file descriptors
+ * (CAN sockets, ...) and timerfd based timers can be registered; their
+ * callbacks all run on the loop thread. An eventfd is used to wake the loop
+ * so quit() returns immediately instead of waiting for a poll timeout.
+ *
+ * Registration is thread safe. Callbacks must not call quit() or stop().
+ */
+class EventLoop : public MThread
+{
+public:
+    typedef std::function<void (uint32_t events)> FdCallback;
+    typedef std::function<void ()> TimerCallback;
+
+    EventLoop();
+    ~EventLoop();
+
+    int init();
+
+    int addFd(int fd, uint32_t events, FdCallback callback);
+    int removeFd(int fd);
+
+    /* Returns a timer id (>= 0) that can be passed to cancelTimer(),
+     * or -1 on error. One-shot timers are removed after they fire. */
+    int addTimer(int timeout_ms, bool periodic, TimerCallback callback);
+    int cancelTimer(int id);
+
+    void wakeup();
+    void quit();
+
+    virtual void run() override;
+
+private:
+    struct Handler {
+        FdCallback callback;
+        bool timer;
+        bool periodic;
+    };
+
+    int m_epfd;
+    int m_wakefd;
+    std::atomic<bool> m_quit;
+    std::mutex m_mtx;
+    std::map<int, std::shared_ptr<Handler>> m_handlers;
+};
+
+#endif
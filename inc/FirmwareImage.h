@@ -0,0 +1,88 @@
+#ifndef FIRMWARE_IMAGE_H
+#define FIRMWARE_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* Non-owning view of image bytes. Cheap to copy and slice. */
+struct ImageView {
+    const uint8_t *data;
+    size_t length;
+
+    ImageView() : data(nullptr), length(0) {}
+    ImageView(const uint8_t *d, size_t n) : data(d), length(n) {}
+
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    uint8_t operator[](size_t i) const { return data[i]; }
+
+    /* Bytes [offset, offset + len), clamped to the view. */
+    ImageView slice(size_t offset, size_t len) const
+    {
+        if (offset > length)
+            offset = length;
+        if (len > length - offset)
+            len = length - offset;
+        return ImageView(data + offset, len);
+    }
+};
+
+/* Populated byte range of an image, relative to its first byte. */
+struct ImageSegment {
+    size_t offset;
+    size_t length;
+};
+
+enum ImageFormat {
+    IMAGE_BINARY = 0,
+    IMAGE_IHEX,
+    IMAGE_SREC,
+    IMAGE_ELF
+};
+
+/*
+ * Read-only firmware image file. The file is mapped with mmap() so the CRC
+ * engine and the frame builder read the page cache directly. Regular
+ * files that cannot be mapped (some special file systems) are read into
+ * one heap buffer with a single bulk read instead; pipes, devices and
+ * files that report no size are read into a heap buffer until EOF.
+ *
+ * Intel HEX (.hex, .ihex), Motorola S-record (.srec, .s19, .s28, .s37,
+ * .mot) and ELF files (by their magic) are flattened into a heap buffer
+ * that starts at the application start address, with the gaps between
+ * their records filled with 0xFF; segments() lists the populated ranges.
+ * Data outside the application flash is rejected.
+ */
+class FirmwareImage
+{
+public:
+    FirmwareImage();
+    ~FirmwareImage();
+
+    int open(const char *path);
+    void close();
+
+    const uint8_t *data() const { return m_data; }
+    size_t size() const { return m_size; }
+    bool isMapped() const { return m_mapped; }
+    ImageView view() const { return ImageView(m_data, m_size); }
+
+    ImageFormat format() const { return m_format; }
+    const char *formatName() const;
+    const std::vector<ImageSegment> &segments() const { return m_segments; }
+
+private:
+    FirmwareImage(const FirmwareImage &);
+    FirmwareImage &operator=(const FirmwareImage &);
+
+    int flatten(const char *path);
+
+    uint8_t *m_data;
+    size_t m_size;
+    bool m_mapped;
+    ImageFormat m_format;
+    std::vector<ImageSegment> m_segments;
+};
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Log-linear latency histogram. Values below 16 get a bucket each, larger
+ * ones are split into 16 buckets per power of two, so percentiles are
+ * accurate to about 6% over the whole range. Values are unitless; the
+ * uploader records microseconds. Values above 2^32 are clamped.
+ *
+ * Not thread safe: record from one thread or under a lock.
+ */
+class Histogram
+{
+public:
+    Histogram();
+
+    void record(uint64_t value);
+    void merge(const Histogram &other);
+    void reset();
+
+    uint64_t count() const { return m_count; }
+    uint64_t max() const { return m_max; }
+    uint64_t min() const { return m_count ? m_min : 0; }
+    double mean() const { return m_count ? (double)m_sum / m_count : 0; }
+
+    /* Upper bound of the bucket holding the p-th percentile, p in 0..100. */
+    uint64_t percentile(double p) const;
+
+private:
+    static size_t bucketOf(uint64_t value);
+    static uint64_t bucketLimit(size_t bucket);
+
+    std::vector<uint64_t> m_buckets;
+    uint64_t m_count;
+    uint64_t m_sum;
+    uint64_t m_min;
+    uint64_t m_max;
+};
+
+#endif
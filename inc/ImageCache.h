@@ -0,0 +1,101 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <linux/can.h>
+#include "FirmwareImage.h"
+
+/* LZ4 record stream of a whole image (see Lz4.h) and the stream offset of
+ * every page's record, with one extra entry for the end of the stream. */
+struct Lz4Stream {
+    std::vector<uint8_t> data;
+    std::vector<size_t> offsets;
+};
+
+/*
+ * An image encoded once for any number of flashes: the loaded file (still
+ * mapped, the bytes are not copied), its CRC-32, and, built on first use
+ * and kept, the page CRCs, the
+ * LZ4 stream and the sequenced write frames for each frame layout. The
+ * frames carry node ID 0; sessions copy them and set their own CAN ID.
+ *
+ * All accessors are thread safe and the returned references stay valid for
+ * the life of the object, so parallel sessions share one copy.
+ */
+class PreparedImage
+{
+public:
+    explicit PreparedImage(const std::shared_ptr<const FirmwareImage> &image);
+
+    ImageView view() const { return m_image->view(); }
+    size_t size() const { return m_image->size(); }
+    uint64_t hash() const { return m_hash; }
+
+    /* The CRC, page CRCs, LZ4 stream and frames are loaded from and saved
+     * to the cache directory when ImageCache has one. */
+    uint32_t crc() const;
+    const std::vector<uint32_t> &pageCrcs(size_t page) const;
+    const Lz4Stream &lz4(size_t page) const;
+
+    /* Frames of a sequenced write (0x07/0x08, `chunk` bytes after the
+     * sequence number) of the whole image, or of its LZ4 stream when
+     * lz4Page is not 0. */
+    const std::vector<struct canfd_frame> &frames(uint8_t cmd, size_t chunk, bool fd, size_t lz4Page) const;
+
+    /* Frame `i` of a sequenced write of buf, with node ID 0. */
+    static bool encodeFrame(const ImageView &buf, size_t i, uint8_t cmd, size_t chunk, bool fd,
+                            struct canfd_frame &tx);
+
+private:
+    PreparedImage(const PreparedImage &);
+    PreparedImage &operator=(const PreparedImage &);
+
+    const Lz4Stream &lz4Stream(size_t page) const;
+    std::string cachePath(const char *kind, size_t param) const;
+    bool loadBlob(const std::string &path, std::vector<uint8_t> &blob) const;
+    void saveBlob(const std::string &path, const uint8_t *data, size_t len) const;
+    bool loadFrames(const std::string &path, std::vector<struct canfd_frame> &frames, uint8_t cmd, size_t chunk,
+                    bool fd, size_t lz4Page) const;
+    void saveFrames(const std::string &path, const std::vector<struct canfd_frame> &frames, uint8_t cmd,
+                    size_t chunk, bool fd, size_t lz4Page) const;
+
+    std::shared_ptr<const FirmwareImage> m_image;
+    uint64_t m_hash;
+
+    mutable std::mutex m_mtx;
+    mutable bool m_haveCrc;
+    mutable uint32_t m_crc;
+    mutable std::map<size_t, std::unique_ptr<std::vector<uint32_t>>> m_pageCrcs;
+    mutable std::map<size_t, std::unique_ptr<Lz4Stream>> m_lz4;
+    mutable std::map<uint64_t, std::unique_ptr<std::vector<struct canfd_frame>>> m_frames;
+};
+
+/*
+ * Process-wide cache of prepared images, keyed by a 64-bit hash of the
+ * contents and the size. With a directory set, everything derived from an
+ * image also survives the process, one file per image and item, so later
+ * runs only hash the image.
+ */
+class ImageCache
+{
+public:
+    /* The prepared image keeps a reference to image. */
+    static std::shared_ptr<const PreparedImage> prepare(const std::shared_ptr<const FirmwareImage> &image);
+
+    static void setDirectory(const std::string &dir);
+    static std::string directory();
+
+    /* Drops the RAM cache; images still referenced stay valid. */
+    static void clear();
+
+    /* FNV-1a, 64 bit. */
+    static uint64_t hash(const ImageView &image);
+};
+
+#endif
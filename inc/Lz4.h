@@ -0,0 +1,39 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * LZ4 block format (no frame header), small enough for a bootloader to
+ * decompress with a few dozen lines of C: a token byte with the literal and
+ * match lengths, the literals, and a 16-bit little-endian match offset.
+ * The compressor is a greedy single-probe hash matcher, so it trades some
+ * ratio for speed like the reference "fast" mode.
+ *
+ * The compressed write stream (WRITE_MODE_LZ4) is a sequence of records,
+ * one per page: a big-endian 16-bit header with the length of the payload
+ * in bits 0-14 and bit 15 set when the page is stored uncompressed,
+ * followed by the payload. Pages larger than LZ4_RECORD_MAX cannot be
+ * sent compressed.
+ */
+class Lz4
+{
+public:
+    /* Returns the compressed size, or 0 when it would exceed cap. */
+    static size_t compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+    /* Returns the decompressed size, or -1 on malformed input or when the
+     * output would exceed cap. */
+    static long decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+    /* Appends the record stream of `len` bytes split into `block`-sized
+     * pieces to out. */
+    static void compressStream(const uint8_t *src, size_t len, size_t block, std::vector<uint8_t> &out);
+};
+
+#define LZ4_STORED      0x8000
+#define LZ4_RECORD_MAX  0x7FFF
+
+#endif
@@ -4,6 +4,25 @@
 #include <thread>
 #include <chrono>
 #include <atomic>
+#include <string>
+#include <vector>
+#include <sched.h>
+
+/*
+ * Scheduling attributes applied by a thread to itself as it starts. Setting
+ * a real-time policy needs CAP_SYS_NICE (or an RLIMIT_RTPRIO) and locking
+ * memory CAP_IPC_LOCK; when the kernel refuses, a warning is logged and the
+ * thread runs with the defaults.
+ */
+struct ThreadAttributes {
+    std::string name;       // pthread_setname_np(), at most 15 characters
+    std::vector<int> cpus;  // affinity, empty = any CPU
+    int policy;             // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+    int priority;           // 1-99 for SCHED_FIFO and SCHED_RR
+    bool lockMemory;        // mlockall(MCL_CURRENT | MCL_FUTURE), process wide
+
+    ThreadAttributes() : policy(SCHED_OTHER), priority(0), lockMemory(false) {}
+};
 
 class MThread
 {
@@ -13,6 +32,9 @@ public:
 
     std::thread::id getId();
 
+    void setAttributes(const ThreadAttributes &attr);
+    const ThreadAttributes &attributes() const;
+
     void start();
     void detach();
     void stop();
@@ -22,9 +44,15 @@ public:
 
     virtual void run() = 0;
 
+    /* Applies attr to the calling thread; false if any part failed. */
+    static bool applyAttributes(const ThreadAttributes &attr);
+
 private:
+    void entry();
+
     std::atomic<bool> stopState;
     std::thread th;
+    ThreadAttributes threadAttr;
 };
 
 #endif
\ No newline at end of file
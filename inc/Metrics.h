@@ -0,0 +1,96 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "BootloaderProtocol.h"
+
+class BootloaderBus;
+class EventLoop;
+
+// Bits of a classic 11-bit data frame besides the payload: SOF, ID, RTR,
+// IDE, r0, DLC, CRC, delimiters, ACK, EOF and interframe space. Bit stuffing
+// is not counted, so utilizations derived from it are lower bounds.
+#define FRAME_OVERHEAD_BITS 47
+
+/* Live counters of every registered bus and of its active sessions (those
+ * that have sent anything), exported as JSON or in the Prometheus text
+ * format. The counters are the lock-free atomics kept by BusStats, Can and
+ * SessionStats; sample() derives frame, byte and bus load rates from their
+ * change since the previous call, so call it periodically, e.g. from an
+ * EventLoop timer. Thread safe. */
+class Metrics
+{
+public:
+    /* bitrate is the nominal bus bitrate the load is computed against. */
+    explicit Metrics(uint32_t bitrate);
+
+    void addBus(BootloaderBus *bus);
+    void sample();
+
+    std::string json();
+    std::string prometheus();
+
+    /* Bits on the wire for frames carrying bytes in total, without stuff
+     * bits. */
+    static double busBits(uint64_t frames, uint64_t bytes);
+
+private:
+    struct Rates {
+        double tx_frames = 0;
+        double rx_frames = 0;
+        double tx_bytes = 0;
+        double rx_bytes = 0;
+        double load = 0;
+        double node_bytes[NODE_COUNT] = {};
+    };
+
+    struct Entry {
+        BootloaderBus *bus;
+        uint64_t tx_frames;
+        uint64_t tx_bytes;
+        uint64_t rx_frames;
+        uint64_t rx_bytes;
+        size_t node_done[NODE_COUNT];
+        Rates rates;
+    };
+
+    uint32_t m_bitrate;
+    std::mutex m_mtx;
+    std::vector<Entry> m_buses;
+    std::chrono::steady_clock::time_point m_sampled;
+};
+
+/* Minimal HTTP endpoint on an EventLoop: GET /metrics answers with the
+ * Prometheus text and GET /stats with the JSON, one request per
+ * connection. Requests are served on the loop thread, so give it a loop
+ * that does not carry CAN traffic. */
+class MetricsServer
+{
+public:
+    explicit MetricsServer(Metrics *metrics);
+    ~MetricsServer();
+
+    /* Listens on port on all addresses. */
+    int open(EventLoop *loop, int port);
+
+private:
+    MetricsServer(const MetricsServer &);
+    MetricsServer &operator=(const MetricsServer &);
+
+    void acceptClients();
+    void serve(int fd);
+    void drop(int fd);
+
+    Metrics *m_metrics;
+    EventLoop *m_loop;
+    int m_fd;
+    std::map<int, int> m_clients;   // fd -> idle timer, loop thread only
+};
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+/*
+ * Bounded lock-free single-producer/single-consumer ring. One thread may
+ * push, one other thread may pop; neither ever blocks. A push into a full
+ * ring drops the item and counts it in overflows(). The capacity is rounded
+ * up to a power of two.
+ */
+template <typename T>
+class RingBuffer
+{
+public:
+    explicit RingBuffer(size_t capacity) :
+        m_head(0),
+        m_tail(0),
+        m_overflows(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        m_buf.resize(size);
+        m_mask = size - 1;
+    }
+
+    /* Producer side. Returns the number of items stored. */
+    size_t push(const T *items, size_t count)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        size_t space = m_buf.size() - (head - tail);
+        size_t n = count < space ? count : space;
+
+        for (size_t i = 0; i < n; i++)
+            m_buf[(head + i) & m_mask] = items[i];
+        m_head.store(head + n, std::memory_order_release);
+
+        if (n < count)
+            m_overflows.fetch_add(count - n, std::memory_order_relaxed);
+        return n;
+    }
+
+    bool push(const T &item)
+    {
+        return push(&item, 1) == 1;
+    }
+
+    /* Consumer side. Returns the number of items copied to out. */
+    size_t pop(T *out, size_t max)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_acquire);
+        size_t avail = head - tail;
+        size_t n = max < avail ? max : avail;
+
+        for (size_t i = 0; i < n; i++)
+            out[i] = m_buf[(tail + i) & m_mask];
+        m_tail.store(tail + n, std::memory_order_release);
+        return n;
+    }
+
+    bool pop(T &out)
+    {
+        return pop(&out, 1) == 1;
+    }
+
+    /* Consumer side. Drops everything queued. */
+    void clear()
+    {
+        m_tail.store(m_head.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    size_t size() const
+    {
+        return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const
+    {
+        return m_buf.size();
+    }
+
+    uint64_t overflows() const
+    {
+        return m_overflows.load(std::memory_order_relaxed);
+    }
+
+private:
+    /* Producer and consumer indices live on separate cache lines. The
+     * padding does that without alignas(64), which C++11 operator new does
+     * not honour for heap allocated rings. */
+    static const size_t CACHE_LINE = 64;
+
+    std::vector<T> m_buf;
+    size_t m_mask;
+    char m_pad0[CACHE_LINE];
+    std::atomic<size_t> m_head;
+    char m_pad1[CACHE_LINE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_tail;
+    char m_pad2[CACHE_LINE - sizeof(std::atomic<size_t>)];
+    std::atomic<uint64_t> m_overflows;
+    char m_pad3[CACHE_LINE - sizeof(std::atomic<uint64_t>)];
+};
+
+#endif
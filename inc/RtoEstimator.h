@@ -0,0 +1,39 @@
+#ifndef RTO_ESTIMATOR_H
+#define RTO_ESTIMATOR_H
+
+#include <stdint.h>
+
+/*
+ * Retransmission timeout from measured round trips, as TCP computes it
+ * (RFC 6298): a smoothed RTT plus four times its mean deviation, clamped to
+ * [min, max]. Until the first sample the initial timeout is used. backoff()
+ * doubles the timeout after a loss; the next sample recomputes it. Only
+ * feed round trips of frames that were sent once (Karn's algorithm).
+ *
+ * All values are in microseconds. Not thread safe.
+ */
+class RtoEstimator
+{
+public:
+    RtoEstimator();
+
+    void configure(uint64_t initial, uint64_t min, uint64_t max);
+    void sample(uint64_t rtt);
+    void backoff();
+    void reset();
+
+    uint64_t timeout() const { return m_rto; }
+    uint64_t srtt() const { return m_srtt; }
+    bool hasSamples() const { return m_samples > 0; }
+
+private:
+    uint64_t m_initial;
+    uint64_t m_min;
+    uint64_t m_max;
+    uint64_t m_srtt;
+    uint64_t m_rttvar;
+    uint64_t m_rto;
+    uint64_t m_samples;
+};
+
+#endif
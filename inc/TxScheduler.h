@@ -0,0 +1,81 @@
+#ifndef TX_SCHEDULER_H
+#define TX_SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <linux/can.h>
+#include "MThread.h"
+#include "RingBuffer.h"
+#include "BootloaderProtocol.h"
+
+class Can;
+
+// Per-interface traffic counters, updated from the TX scheduler and the RX
+// path of that interface.
+struct BusStats {
+    std::atomic<uint64_t> tx_frames{0};
+    std::atomic<uint64_t> tx_bytes{0};
+    std::atomic<uint64_t> tx_errors{0};
+    std::atomic<uint64_t> rx_frames{0};
+    std::atomic<uint64_t> rx_bytes{0};
+    std::atomic<uint64_t> error_frames{0};
+};
+
+/*
+ * Round-robin transmit scheduler shared by every session on the bus. With a
+ * single session frames go straight to the socket; while scheduling, each
+ * session queues its frames and the scheduler thread takes one frame per
+ * node in turn, so a node streaming a whole block cannot starve the others.
+ * Frames are handed to the socket in batches of up to Can::TX_BATCH with one
+ * sendmmsg() each. When the socket or the interface queue is full the
+ * sender waits for room (Can::waitTxRoom()), so a saturated bus slows the
+ * sessions down instead of losing their frames. The per-node queues have a
+ * fixed capacity, so queueing a frame never allocates; a session that
+ * fills its queue waits for the scheduler to make room.
+ */
+class TxScheduler : public MThread
+{
+public:
+    TxScheduler();
+    ~TxScheduler();
+
+    void attach(Can *can, BusStats *stats);
+
+    bool submit(uint8_t node, const struct canfd_frame &frame, bool fd);
+
+    /* Classic frames are passed in canfd_frame slots, which share the
+     * can_frame layout. */
+    bool submitBatch(uint8_t node, const struct canfd_frame *frames, size_t count, bool fd);
+
+    void startScheduling();
+    void stopScheduling();
+
+    virtual void run() override;
+
+    /* Frames queued per node while scheduling. */
+    static const size_t QUEUE_SIZE = 128;
+
+private:
+    struct TxEntry {
+        struct canfd_frame frame;
+        bool fd;
+    };
+
+    size_t sendBatch(const struct canfd_frame *frames, size_t count, bool fd);
+    int transmitSome(const struct canfd_frame *frames, size_t count, bool fd);
+
+    Can *m_can;
+    BusStats *m_stats;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    std::condition_variable m_room;
+    RingBuffer<TxEntry> *m_queues[NODE_COUNT];
+    bool m_active;
+    size_t m_queued;
+    int m_cursor;
+};
+
+#endif
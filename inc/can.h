@@ -3,6 +3,7 @@
 
 #include <bits/stdint-uintn.h>
 #include <stdint.h>
+#include <atomic>
 #include <functional>
 #include <string>
 #include <linux/can.h>
@@ -10,9 +11,41 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <linux/can/raw.h>
+#include <linux/can/error.h>
 #include <vector>
 #include "MThread.h"
+#include "RingBuffer.h"
 
+#ifndef CANFD_FDF
+#define CANFD_FDF 0x04
+#endif
+
+class EventLoop;
+class CaptureWriter;
+
+/* Transmit backpressure of a socket: how often it was full and how long
+ * senders waited for room. */
+struct CanTxPressure {
+	std::atomic<uint64_t> full{0};		// EAGAIN, socket buffer full
+	std::atomic<uint64_t> nobufs{0};	// ENOBUFS, interface queue full
+	std::atomic<uint64_t> wait_us{0};	// time spent waiting for room
+	std::atomic<uint64_t> stalls{0};	// waits that gave up after TX_STALL_MS
+};
+
+/* Receive time of a frame in nanoseconds: software is the kernel receive
+ * time (CLOCK_REALTIME), hardware the controller clock when the driver
+ * provides one. Both are 0 when timestamping is not enabled. */
+struct CanRxTimestamp {
+	uint64_t software;
+	uint64_t hardware;
+};
+
+/* A received classic or FD frame (FD frames have CANFD_FDF set in flags)
+ * together with its timestamps. */
+struct CanRxFrame {
+	struct canfd_frame frame;
+	struct CanRxTimestamp timestamp;
+};
 
 class Can : public MThread
 {
@@ -23,20 +56,131 @@ public:
 	int init();
 	int destroy();
 
-	void startAutoRead();
+	/* Reads on a thread of its own, started with attr (name, affinity,
+	 * real-time priority; see MThread.h). */
+	void startAutoRead(const ThreadAttributes &attr = ThreadAttributes());
 	void stopAutoRead();
 	virtual void run() override;
+
+	/* Alternative to startAutoRead(): let a shared EventLoop drive the
+	 * socket, so many interfaces only need one RX thread. */
+	int attachLoop(EventLoop *loop);
+	int detachLoop(EventLoop *loop);
+
 	void setOnCanReceiveDataCallback(std::function<void (struct can_frame &&)> callback);
+	void setOnCanFdReceiveDataCallback(std::function<void (struct canfd_frame &&)> callback);
+
+	/* Batch receive: every wakeup drains up to RX_BATCH queued frames with
+	 * one recvmmsg() and hands classic and FD frames to these callbacks as
+	 * arrays. Without a batch callback the per-frame callbacks above are
+	 * invoked for each frame instead. */
+	void setOnCanReceiveBatchCallback(std::function<void (const struct can_frame *frames, size_t count)> callback);
+	void setOnCanFdReceiveBatchCallback(std::function<void (const struct canfd_frame *frames, size_t count)> callback);
+
+	/* Receive timestamps (SO_TIMESTAMPING, falling back to SO_TIMESTAMPNS).
+	 * They are delivered through the timestamped frame callback, which
+	 * takes precedence over all callbacks above, and through the RX ring. */
+	int enableTimestamps();
+	void setOnCanReceiveFrameCallback(std::function<void (const struct CanRxFrame &frame)> callback);
+
+	/* Frames the kernel dropped because the socket receive queue was full
+	 * (SO_RXQ_OVFL), as of the last batch read. */
+	int enableDropCounter();
+	uint64_t kernelDrops();
+
+	/* Hands every received frame to a capture channel (see CanCapture.h)
+	 * before it is dispatched. Set it before the RX thread starts. */
+	void setCapture(CaptureWriter *writer, int channel);
 	
+	/* The socket is non-blocking. transmit() and transmitFd() wait for
+	 * room themselves (see waitTxRoom()) and return -1 only when a frame
+	 * could not be queued at all. */
 	int transmit(struct can_frame *frame);
 
+	/* Send many frames with sendmmsg(). Returns the number of frames queued
+	 * to the socket (less than count when its buffer fills up), or -1 with
+	 * errno set if none could be sent. */
+	int transmitBatch(const struct can_frame *frames, size_t count);
+	int transmitFdBatch(const struct canfd_frame *frames, size_t count);
+
+	/* After a transmit failed with errno err, waits until the socket may
+	 * take frames again: for POLLOUT after EAGAIN (socket buffer full), or
+	 * backoff_us, doubled on each call, after ENOBUFS (interface queue
+	 * full, which poll() does not report). Start with backoff_us = 0.
+	 * Returns false for any other error and once deadline_us (from
+	 * txDeadline()) has passed. */
+	bool waitTxRoom(int err, unsigned &backoff_us, uint64_t deadline_us);
+	static uint64_t txDeadline();
+	const CanTxPressure &txPressure() const { return m_txPressure; }
+
+	/* A send buffer smaller than the interface queue makes a full queue
+	 * show up as EAGAIN, which poll() reports, instead of ENOBUFS. */
+	int setSendBuffer(int bytes);
+
+	/* Kernel-side filtering (CAN_RAW_FILTER): only frames matching one of
+	 * the filters are copied to this socket. clearFilters() accepts every
+	 * frame again. Error frames are controlled separately by the error
+	 * mask (CAN_ERR_* classes, 0 = none) and arrive with CAN_ERR_FLAG set
+	 * in can_id. */
+	int setFilters(const std::vector<struct can_filter> &filters);
+	int clearFilters();
+	int setErrorFilter(can_err_mask_t mask);
+
+	/* Optional SPSC ring between the RX thread and one consumer thread.
+	 * Once enabled, received frames are pushed into the ring instead of
+	 * being passed to the callbacks, and rxRingEventFd() becomes readable
+	 * whenever new frames were pushed. Frames are stored as CanRxFrame;
+	 * FD frames have CANFD_FDF set in flags, classic ones have flags == 0.
+	 * Frames that do not fit are dropped and counted. Enable it before
+	 * starting the RX thread, and keep popping until popRxFrames() returns
+	 * 0 before waiting on the eventfd again. */
+	int enableRxRing(size_t capacity);
+	int rxRingEventFd();
+	size_t popRxFrames(struct CanRxFrame *frames, size_t max);
+	uint64_t rxRingOverflows();
+
+	/* CAN FD: only succeeds when the interface MTU is CANFD_MTU. Once
+	 * enabled, FD frames are delivered to the FD callback and classic
+	 * frames keep going to the classic one. */
+	int enableFdFrames();
+	bool isFdEnabled();
+	int transmitFd(struct canfd_frame *frame);
+
+	/* Round a payload length up to the next valid CAN FD data length. */
+	static uint8_t fdLength(uint8_t len);
+
+	static const size_t RX_BATCH = 32;
+	static const size_t TX_BATCH = 32;
+	/* A socket that takes no frame for this long is considered dead (bus
+	 * off, no other node acking) and the frames are dropped. */
+	static const int TX_STALL_MS = 500;
+	static const unsigned TX_BACKOFF_MIN_US = 50;
+	static const unsigned TX_BACKOFF_MAX_US = 2000;
+
 private:
+	void readFrames();
+
     int m_sd;
 	std::string m_deviceName;
 	struct ifreq ifr;
 	struct sockaddr_can addr;
 	bool isAutoRead;
+	bool m_fdEnabled;
+	EventLoop *m_loop;
+	RingBuffer<struct CanRxFrame> *m_rxRing;
+	int m_rxRingFd;
+	bool m_timestamps;
+	bool m_dropCounter;
+	uint32_t m_lastDrops;
+	std::atomic<uint64_t> m_kernelDrops;
+	CaptureWriter *m_capture;
+	int m_captureChannel;
+	CanTxPressure m_txPressure;
 	std::function<void (struct can_frame &&)> onCanReceiveDataCallback;
+	std::function<void (struct canfd_frame &&)> onCanFdReceiveDataCallback;
+	std::function<void (const struct can_frame *, size_t)> onCanReceiveBatchCallback;
+	std::function<void (const struct canfd_frame *, size_t)> onCanFdReceiveBatchCallback;
+	std::function<void (const struct CanRxFrame &)> onCanReceiveFrameCallback;
 };
 
 #endif
@@ -1,8 +1,22 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <stddef.h>
+
+/* Least severe level that is compiled in, set with the LOG_MIN_LEVEL CMake
+ * option. Calls below it are dead code and removed by the compiler, but
+ * their format strings are still checked. */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL NOTSET
+#endif
+
+/* The level is checked before the call, so filtered messages cost no
+ * formatting and their arguments are not evaluated. */
 #define LOG(level, fmt, ...) \
-	log (level, __FILE__, __LINE__, fmt, ##__VA_ARGS__)
+	do { \
+		if ((level) <= LOG_MIN_LEVEL && (level) <= LogLevel) \
+			log (level, __FILE__, __LINE__, fmt, ##__VA_ARGS__); \
+	} while (0)
 
 #define COL(x)  "\033[;" #x "m"
 #define RED     COL(31)
@@ -26,9 +40,33 @@ typedef enum {
     NOTSET
 } PriorityLevel;
 
+#define LOG_SINK_STDOUT 0x01
+#define LOG_SINK_FILE   0x02
+#define LOG_SINK_SYSLOG 0x04
+
 extern int LogLevel;
 
-void log (PriorityLevel level, const char* file, const int line, const char *fmt, ...);
+void log (PriorityLevel level, const char* file, const int line, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
 void initLogger(PriorityLevel level);
 
+/* Output goes to stdout unless changed; the file sink appends to path. */
+void logSetSinks(int sinks);
+int logOpenFile(const char *path);
+
+/*
+ * Async mode: log() only copies the record into a lock-free queue of
+ * `capacity` entries and a background thread writes it out. Records that
+ * find the queue full are dropped and counted. With `deferred` the
+ * arguments are stored as they are and formatting happens on the writer
+ * thread too; the format must then be a string literal, as it is with LOG.
+ */
+int logStartAsync(size_t capacity, bool deferred);
+/* Writes what is left and returns to synchronous output. Other threads
+ * must have stopped logging. Also run at exit. */
+void logStopAsync();
+/* Blocks until everything logged so far has been written. */
+void logFlush();
+unsigned long long logDropped();
+
 #endif
\ No newline at end of file
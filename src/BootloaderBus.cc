@@ -0,0 +1,203 @@
+#include "BootloaderBus.h"
+#include "BootloaderSession.h"
+#include "EventLoop.h"
+#include "can.h"
+#include "log.h"
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#define RX_RING_SIZE 4096
+// Same as BootloaderSession::queryCapabilities().
+#define SCAN_CAPS_TIMEOUT_MS 200
+
+// Only responses (commands 0x10-0x1F) from the nodes we are talking to
+// need to reach user space; the kernel drops everything else, which on a
+// shared production bus is most of the traffic.
+#define RESPONSE_CMD_BASE   0x10
+#define RESPONSE_CMD_MASK   0x70
+#define RX_ERROR_MASK       (CAN_ERR_TX_TIMEOUT | CAN_ERR_CRTL | CAN_ERR_BUSOFF | CAN_ERR_RESTARTED)
+
+BootloaderBus::BootloaderBus(const std::string &name) :
+    m_name(name),
+    m_can(nullptr),
+    m_rxLoop(nullptr),
+    m_dispatchLoop(nullptr),
+    m_selected(-1),
+    m_scanning(false),
+    m_verbose(true)
+{
+    for (int i = 0; i < NODE_COUNT; i++)
+        m_sessions[i] = new BootloaderSession(this, i);
+}
+
+BootloaderBus::~BootloaderBus()
+{
+    if (m_can && m_dispatchLoop)
+        m_dispatchLoop->removeFd(m_can->rxRingEventFd());
+    for (int i = 0; i < NODE_COUNT; i++)
+        delete m_sessions[i];
+    delete m_can;
+}
+
+int BootloaderBus::open(EventLoop *rxLoop, EventLoop *dispatchLoop)
+{
+    m_can = new Can((char*)m_name.c_str());
+    if (m_can->init()) {
+        LOG(ERROR, "Failed to initialize CAN interface %s!", m_name.c_str());
+        return -1;
+    }
+    m_tx.attach(m_can, &m_stats);
+    m_can->setErrorFilter(RX_ERROR_MASK);
+    updateFilters();
+    if (m_can->enableTimestamps())
+        LOG(WARN, "%s: no receive timestamps, latency includes host delay", m_name.c_str());
+    if (m_can->enableDropCounter())
+        LOG(WARN, "%s: kernel receive drops are not counted", m_name.c_str());
+    m_can->setOnCanReceiveFrameCallback([this](const CanRxFrame &frame) {
+        handleFrame(frame);
+    });
+    m_can->enableFdFrames();
+    if (m_can->enableRxRing(RX_RING_SIZE) == 0) {
+        m_dispatchLoop = dispatchLoop;
+        m_dispatchLoop->addFd(m_can->rxRingEventFd(), EPOLLIN, [this](uint32_t) {
+            drainRxRing();
+        });
+    }
+    if (m_can->attachLoop(rxLoop)) {
+        LOG(ERROR, "Failed to register CAN interface %s!", m_name.c_str());
+        return -1;
+    }
+    m_rxLoop = rxLoop;
+    return 0;
+}
+
+void BootloaderBus::setSelectedNode(int node)
+{
+    m_selected = node;
+    updateFilters();
+}
+
+void BootloaderBus::updateFilters()
+{
+    if (!m_can)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_filterMtx);
+    std::vector<struct can_filter> filters;
+    for (int id = 0; id < NODE_COUNT; id++) {
+        bool active = m_scanning || m_sessions[id]->state() == SESSION_RUNNING || id == m_selected;
+        if (!active)
+            continue;
+
+        struct can_filter filter;
+        filter.can_id = ((id << 7) | RESPONSE_CMD_BASE) & CAN_SFF_MASK;
+        filter.can_mask = ((NODE_COUNT - 1) << 7 | RESPONSE_CMD_MASK) & CAN_SFF_MASK;
+        filter.can_mask |= CAN_EFF_FLAG | CAN_RTR_FLAG;
+        filters.push_back(filter);
+    }
+    m_can->setFilters(filters);
+}
+
+// The answers complete each session's slot on the dispatch thread as they
+// arrive; collecting them one after the other against the same deadline
+// bounds the whole round by one timeout.
+int BootloaderBus::scan(int timeout_ms)
+{
+    std::vector<BootloaderSession *> posted;
+    m_scanning = true;
+    updateFilters();
+    for (int id = 0; id < NODE_COUNT; id++) {
+        BootloaderSession *s = m_sessions[id];
+        if (s->state() != SESSION_RUNNING && s->postQuery(0x05))
+            posted.push_back(s);
+    }
+
+    std::vector<BootloaderSession *> found;
+    Deadline deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    for (BootloaderSession *s : posted) {
+        if (s->collectQuery(deadline))
+            found.push_back(s);
+    }
+
+    std::vector<NodeInfo> nodes;
+    for (BootloaderSession *s : found) {
+        NodeInfo info;
+        memset(&info, 0, sizeof(info));
+        info.node = s->nodeId();
+        info.crc = s->receivedCrc();
+        info.valid = info.crc != 0xFFFFFFFF;
+        nodes.push_back(info);
+    }
+
+    std::vector<bool> asked(found.size());
+    for (size_t i = 0; i < found.size(); i++)
+        asked[i] = found[i]->postQuery(0x06);
+    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SCAN_CAPS_TIMEOUT_MS);
+    for (size_t i = 0; i < found.size(); i++) {
+        if (asked[i] && found[i]->collectQuery(deadline)) {
+            nodes[i].caps = true;
+            nodes[i].features = found[i]->features();
+            nodes[i].pageSize = found[i]->pageSize();
+        }
+    }
+    m_scanning = false;
+    updateFilters();
+
+    std::lock_guard<std::mutex> lock(m_inventoryMtx);
+    for (const NodeInfo &info : m_inventory) {
+        if (m_sessions[info.node]->state() == SESSION_RUNNING)
+            nodes.push_back(info);
+    }
+    std::sort(nodes.begin(), nodes.end(), [](const NodeInfo &a, const NodeInfo &b) { return a.node < b.node; });
+    m_inventory = nodes;
+    return found.size();
+}
+
+std::vector<NodeInfo> BootloaderBus::inventory()
+{
+    std::lock_guard<std::mutex> lock(m_inventoryMtx);
+    return m_inventory;
+}
+
+void BootloaderBus::handleFrame(const CanRxFrame &rx)
+{
+    struct can_frame frame;
+    if (rx.frame.flags & CANFD_FDF) {
+        // Responses are short; treat FD frames that fit a classic payload
+        // the same way as classic ones.
+        if (rx.frame.len > CAN_MAX_DLEN) {
+            m_stats.rx_frames++;
+            m_stats.rx_bytes += rx.frame.len;
+            if (m_verbose)
+                LOG(NOTICE, "Ignoring FD frame id=0x%X, len=%d", rx.frame.can_id, rx.frame.len);
+            return;
+        }
+        frame.can_id = rx.frame.can_id;
+        frame.can_dlc = rx.frame.len;
+        memcpy(frame.data, rx.frame.data, rx.frame.len);
+    } else {
+        memcpy(&frame, &rx.frame, CAN_MTU);
+    }
+
+    if (frame.can_id & CAN_ERR_FLAG) {
+        m_stats.error_frames++;
+        if (m_verbose)
+            LOG(WARN, "%s: error frame, class 0x%X", m_name.c_str(), frame.can_id & CAN_ERR_MASK);
+        return;
+    }
+
+    m_stats.rx_frames++;
+    m_stats.rx_bytes += frame.can_dlc;
+    m_sessions[(frame.can_id >> 7) & (NODE_COUNT - 1)]->handleResponse(frame, rx.timestamp);
+}
+
+void BootloaderBus::drainRxRing()
+{
+    struct CanRxFrame frames[Can::RX_BATCH];
+    size_t n;
+    while ((n = m_can->popRxFrames(frames, Can::RX_BATCH)) > 0) {
+        for (size_t i = 0; i < n; i++)
+            handleFrame(frames[i]);
+    }
+}
@@ -0,0 +1,1469 @@
+#include "BootloaderSession.h"
+#include "BootloaderBus.h"
+#include "Crc32.h"
+#include "ImageCache.h"
+#include "Lz4.h"
+#include "can.h"
+#include "log.h"
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <memory>
+
+// Pipelined write: keeps up to `window` sequenced frames in flight and
+// retransmits only the frames whose 0x14 ack has not arrived within the
+// write timeout. Each frame is a 16-bit sequence number followed by `chunk`
+// firmware bytes; 0x07 carries 4-byte words, 0x08 fills the whole classic or
+// FD payload. Sequence numbers are the chunk index modulo 2^16; the window
+// is far smaller than that, so both ends can unwrap them unambiguously.
+#define WINDOW_MAX_RETRIES  5
+
+// Block-ack write: streams a whole block of frames without per-frame acks,
+// then asks for its status with 0x09. The target answers with one 0x15
+// frame when the block is complete, or with bitmap parts listing the
+// missing frames, which are the only ones sent again.
+#define BLOCK_MAX_RETRIES       5
+
+// Reply timeouts follow the measured round trips of each command class
+// (see RtoEstimator), between RTO_MIN_MS and the class's upper bound.
+// Commands that cannot be resent fail on their first timeout, so they keep
+// the class's former fixed timeout until a round trip has been measured and
+// then wait at least RTO_FINAL_MIN_MS; resendable ones get CMD_MAX_RETRIES
+// more tries.
+#define RTO_MIN_MS          20
+#define RTO_FINAL_MIN_MS    200
+#define CMD_MAX_RETRIES     3
+
+// Initial and upper timeout per command class, in ms. The upper bounds are
+// the former fixed timeouts. Erase time depends on the flash size and the
+// capability probe tells legacy targets apart, so neither adapts.
+static const struct {
+    int initial;
+    int min;
+    int max;
+} rto_limits[LAT_COUNT] = {
+    { 10000,    10000,      10000 },    // erase
+    { 1000,     RTO_MIN_MS, 10000 },    // start write, set offset
+    { 1000,     RTO_MIN_MS, 10000 },    // write data
+    { 1000,     RTO_MIN_MS, 10000 },    // end write
+    { 1000,     RTO_MIN_MS, 1000 },     // crc
+    { 200,      200,        200 },      // capabilities
+    { 500,      RTO_MIN_MS, 2000 },     // block query
+    { 500,      RTO_MIN_MS, 2000 },     // page crc
+    { 0,        0,          0 },        // host delay
+};
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char *latencyName(int kind)
+{
+    static const char *names[LAT_COUNT] = {
+        "erase", "start write", "write data", "end write", "crc", "capabilities", "block query", "page crc", "host delay"
+    };
+    return names[kind];
+}
+
+static int latencyKind(uint8_t cmd)
+{
+    switch(cmd) {
+        case 0x01:
+        case 0x0B: return LAT_ERASE;
+        case 0x02:
+        case 0x0C: return LAT_START;
+        case 0x03:
+        case 0x07:
+        case 0x08: return LAT_WRITE;
+        case 0x04: return LAT_END;
+        case 0x05: return LAT_CRC;
+        case 0x06: return LAT_CAPS;
+        case 0x09: return LAT_BLOCK;
+        case 0x0A: return LAT_PAGE_CRC;
+        default:   return -1;
+    }
+}
+
+static const char *getCommandDescription(uint8_t cmd)
+{
+    static const char *descriptions[] = {
+        "Unknown command",
+        "Erase flash",
+        "Start write",
+        "Write data",
+        "End write",
+        "Request CRC",
+        "Query capabilities",
+        "Write data (sequenced)",
+        "Write data (full frame)",
+        "Query block status",
+        "Query page CRCs",
+        "Erase pages",
+        "Set write offset"
+    };
+    if(cmd >= sizeof(descriptions) / sizeof(descriptions[0]))
+        return descriptions[0];
+    return descriptions[cmd];
+}
+
+// Commands that leave the target in the same state however often they
+// arrive, so they can be resent when they or their answer got lost. Start
+// and end write change the write state and 0x03 words carry no sequence
+// number, so a resent copy could be written twice.
+static bool isIdempotent(uint8_t cmd)
+{
+    return cmd == 0x05 || cmd == 0x0C;
+}
+
+BootloaderSession::BootloaderSession(BootloaderBus *bus, uint8_t nodeId) :
+    m_bus(bus),
+    m_nodeId(nodeId),
+    m_busyPollUs(0),
+    m_queryCmd(0),
+    m_queryTxNs(0),
+    m_receivedCrc(0),
+    m_protoVersion(0),
+    m_features(0),
+    m_maxWindow(0),
+    m_pageSize(0),
+    m_pageEraseMs(0),
+    m_eraseFloorUs(0),
+    m_frames(nullptr),
+    // Duplicate acks of resent frames may queue up to a second window.
+    m_seqAcks(2 * WINDOW_MAX),
+    m_blockAcks(BLOCK_PARTS_MAX),
+    m_pageCrcs(PAGE_QUERY_MAX),
+    m_verbose(true),
+    m_state(SESSION_IDLE),
+    m_bytesDone(0),
+    m_bytesTotal(0)
+{
+    for(int kind = 0; kind < LAT_COUNT; kind++) {
+        m_rto[kind].configure(rto_limits[kind].initial * 1000ULL, rto_limits[kind].min * 1000ULL,
+                              rto_limits[kind].max * 1000ULL);
+    }
+}
+
+BootloaderSession::~BootloaderSession()
+{
+    if(m_worker.joinable())
+        m_worker.join();
+}
+
+std::string BootloaderSession::result() const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_result;
+}
+
+void BootloaderSession::setResult(const char *result)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_result = result;
+}
+
+double BootloaderSession::seconds() const
+{
+    return std::chrono::duration<double>(m_finished - m_started).count();
+}
+
+uint32_t BootloaderSession::receivedCrc()
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_receivedCrc;
+}
+
+uint8_t BootloaderSession::features()
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_features;
+}
+
+uint16_t BootloaderSession::pageSize()
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_pageSize;
+}
+
+void BootloaderSession::latency(Histogram *out)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    for(int kind = 0; kind < LAT_COUNT; kind++)
+        out[kind] = m_latency[kind];
+}
+
+// Records a round trip that started at tx_ns and whose response was
+// received at rx_ns, in the histogram and the timeout estimate. Without
+// kernel timestamps (or if the clock stepped) the time the response was
+// processed is used instead. Call with m_mtx held, and only for commands
+// that were sent once.
+void BootloaderSession::recordLatency(uint8_t cmd, uint64_t tx_ns, uint64_t rx_ns)
+{
+    int kind = latencyKind(cmd);
+    if(kind < 0)
+        return;
+    if(rx_ns < tx_ns)
+        rx_ns = nowNs();
+    if(rx_ns >= tx_ns) {
+        m_latency[kind].record((rx_ns - tx_ns) / 1000);
+        m_rto[kind].sample((rx_ns - tx_ns) / 1000);
+    }
+}
+
+uint64_t BootloaderSession::timeoutUs(int kind)
+{
+    if(kind < 0)
+        return rto_limits[LAT_START].max * 1000ULL;
+    std::lock_guard<std::mutex> lock(m_mtx);
+    uint64_t timeout = m_rto[kind].timeout();
+    if((kind == LAT_WRITE || kind == LAT_BLOCK) && timeout < m_eraseFloorUs)
+        timeout = m_eraseFloorUs;
+    return timeout;
+}
+
+bool BootloaderSession::hasRtt(int kind)
+{
+    if(kind < 0)
+        return false;
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_rto[kind].hasSamples();
+}
+
+void BootloaderSession::backoff(int kind)
+{
+    m_stats.timeouts++;
+    if(kind < 0)
+        return;
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_rto[kind].backoff();
+}
+
+void BootloaderSession::handleResponse(const struct can_frame &rx_frame, const CanRxTimestamp &ts)
+{
+    uint8_t cmd = rx_frame.can_id & 0x7F;
+
+    std::lock_guard<std::mutex> lock(m_mtx);
+
+    uint64_t now = nowNs();
+    uint64_t rx_ns = ts.software ? ts.software : now;
+    if(ts.software && now >= ts.software)
+        m_latency[LAT_HOST].record((now - ts.software) / 1000);
+
+    if (m_verbose) {
+        LOG(INFO, "Node: %d, Cmd: 0x%02X, DLC: %d", m_nodeId, cmd, rx_frame.can_dlc);
+    }
+
+    if(cmd == 0x12 && rx_frame.can_dlc >= 4) {
+        uint32_t crc = ((uint32_t)rx_frame.data[0] << 24) | (rx_frame.data[1] << 16) |
+                       (rx_frame.data[2] << 8) | rx_frame.data[3];
+        if(!m_reply.complete(0x12, 0x05, 0xFF, crc, rx_ns)) {
+            if (m_verbose) {
+                LOG(INFO, "Node 0x%02X: Dropping CRC 0x%08X nobody waits for", m_nodeId, crc);
+            }
+            return;
+        }
+        m_receivedCrc = crc;
+        if (m_verbose) {
+            LOG(NOTICE, "CRC received: 0x%08X", m_receivedCrc);
+        }
+        return;
+    }
+
+    // Capabilities only change when a probe waits for them: a late 0x13,
+    // e.g. to a scan during a write, must not move the page size or window.
+    if(cmd == 0x13 && rx_frame.can_dlc >= 3) {
+        if(!m_reply.complete(0x13, 0x06, 0xFF, 0, rx_ns)) {
+            if (m_verbose) {
+                LOG(INFO, "Node 0x%02X: Dropping capabilities nobody waits for", m_nodeId);
+            }
+            return;
+        }
+        m_protoVersion = rx_frame.data[0];
+        m_features = rx_frame.data[1];
+        m_maxWindow = rx_frame.data[2];
+        m_pageSize = rx_frame.can_dlc >= 5 ? ((rx_frame.data[3] << 8) | rx_frame.data[4]) : 0;
+        m_pageEraseMs = rx_frame.can_dlc >= 7 ? ((rx_frame.data[5] << 8) | rx_frame.data[6]) : 0;
+        return;
+    }
+
+    if(cmd == 0x14 && rx_frame.can_dlc >= 3) {
+        SeqAck ack;
+        ack.status = rx_frame.data[0];
+        ack.seq = (rx_frame.data[1] << 8) | rx_frame.data[2];
+        ack.rx_ns = rx_ns;
+        m_seqAcks.push(ack);
+        m_doorbell.ring();
+        return;
+    }
+
+    if(cmd == 0x15 && rx_frame.can_dlc >= 3) {
+        BlockAck ack;
+        ack.status = rx_frame.data[0];
+        ack.block = (rx_frame.data[1] << 8) | rx_frame.data[2];
+        ack.part = rx_frame.can_dlc >= 4 ? rx_frame.data[3] : 0;
+        ack.missing = 0;
+        ack.rx_ns = rx_ns;
+        if (rx_frame.can_dlc >= 8) {
+            ack.missing = ((uint32_t)rx_frame.data[4] << 24) | (rx_frame.data[5] << 16) |
+                          (rx_frame.data[6] << 8) | rx_frame.data[7];
+        }
+        m_blockAcks.push(ack);
+        m_doorbell.ring();
+        return;
+    }
+
+    if(cmd == 0x16 && rx_frame.can_dlc >= 6) {
+        PageCrc page;
+        page.page = (rx_frame.data[0] << 8) | rx_frame.data[1];
+        page.crc = ((uint32_t)rx_frame.data[2] << 24) | (rx_frame.data[3] << 16) |
+                   (rx_frame.data[4] << 8) | rx_frame.data[5];
+        page.rx_ns = rx_ns;
+        m_pageCrcs.push(page);
+        m_doorbell.ring();
+        return;
+    }
+
+    if(cmd == 0x11 && rx_frame.can_dlc >= 3) {
+        uint8_t status = rx_frame.data[0];
+        uint8_t echoed = rx_frame.data[1];
+        if(!m_reply.complete(0x11, echoed, status, 0, rx_ns)) {
+            // Late answer to a command that timed out, or to another one.
+            if (m_verbose) {
+                LOG(INFO, "Node 0x%02X: Dropping confirmation of 0x%02X nobody waits for", m_nodeId, echoed);
+            }
+            return;
+        }
+
+        if (m_verbose) {
+            if(status == 0xFF) {
+                LOG(NOTICE, "Operation confirmed");
+            } else {
+                LOG(ERROR, "Operation failed, status: 0x%02X", status);
+            }
+        }
+        return;
+    }
+
+    if (m_verbose) {
+        LOG(NOTICE, "Response from node 0x%X, cmd=0x%X, DLC=%d", m_nodeId, cmd, rx_frame.can_dlc);
+    }
+}
+
+// Returns 1 when the command was confirmed (0x05: the CRC arrived), 0 when
+// the target rejected it and -1 on timeout.
+int BootloaderSession::waitResponse(uint8_t cmd, uint64_t timeout_us)
+{
+    Deadline deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_us);
+    if(!m_reply.wait(deadline, m_busyPollUs))
+        return -1;
+    if(cmd == 0x05)
+        return 1;
+    return m_reply.status() == 0xFF ? 1 : 0;
+}
+
+// Waits until ready() holds, checked with m_mtx held through lock, or the
+// deadline passes. The lock is dropped while waiting for the doorbell.
+template <typename Ready>
+bool BootloaderSession::waitQueued(std::unique_lock<std::mutex> &lock, Deadline deadline, Ready ready)
+{
+    while(!ready()) {
+        uint32_t seen = m_doorbell.value();
+        lock.unlock();
+        bool rung = m_doorbell.wait(seen, deadline, m_busyPollUs);
+        lock.lock();
+        if(!rung)
+            return ready();
+    }
+    return true;
+}
+
+// Builds a command frame for the session's node. Classic frames are built
+// in a canfd_frame slot, which shares the can_frame layout.
+bool BootloaderSession::buildFrame(uint8_t cmd, const uint8_t *data, size_t len, bool fd, struct canfd_frame &tx)
+{
+    if(cmd > 0x7F) {
+        LOG(ERROR, "Command > 0x7F not allowed for 11-bit CAN ID");
+        return false;
+    }
+
+    if(len > (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN)) {
+        LOG(ERROR, "Payload of %zu bytes does not fit a CAN%s frame", len, fd ? " FD" : "");
+        return false;
+    }
+
+    memset(&tx, 0, sizeof(tx));
+    tx.can_id = (m_nodeId << 7) | cmd;
+    if(fd) {
+        tx.len = Can::fdLength(len);
+        tx.flags = CANFD_BRS;
+        memset(tx.data, 0xFF, tx.len);
+    } else {
+        tx.len = len;
+    }
+    if(len > 0)
+        memcpy(tx.data, data, len);
+    return true;
+}
+
+bool BootloaderSession::transmitCommand(uint8_t cmd, const uint8_t *data, size_t len)
+{
+    struct canfd_frame tx;
+    if(!buildFrame(cmd, data, len, false, tx))
+        return false;
+    m_stats.commands++;
+    return m_bus->tx().submit(m_nodeId, tx, false);
+}
+
+// The frame is built in place from data/len, so nothing is allocated per
+// call.
+bool BootloaderSession::sendCommand(uint8_t cmd, const uint8_t *data, size_t len, bool verbose)
+{
+    int kind = latencyKind(cmd);
+    int attempts = isIdempotent(cmd) ? CMD_MAX_RETRIES + 1 : 1;
+
+    for(int attempt = 0; attempt < attempts; attempt++) {
+        uint64_t timeout = timeoutUs(kind);
+        if(attempts == 1 && kind >= 0 && !hasRtt(kind))
+            timeout = rto_limits[kind].max * 1000ULL;
+        else if(attempts == 1)
+            timeout = std::max<uint64_t>(timeout, RTO_FINAL_MIN_MS * 1000ULL);
+
+        // Armed before the frame goes out, so even an instant answer finds
+        // its slot; every attempt starts a new generation.
+        m_reply.arm(cmd, cmd == 0x05 ? 0x12 : 0x11);
+        if(attempt > 0)
+            m_stats.retransmits++;
+        uint64_t tx_ns = nowNs();
+        if(!transmitCommand(cmd, data, len))
+            return false;
+
+        if(attempt == 0 && verbose && m_verbose) {
+            const char *cmd_desc = getCommandDescription(cmd);
+            if(len == 0) {
+                LOG(NOTICE, "Sent: %s to node 0x%02X", cmd_desc, m_nodeId);
+            } else {
+                if (cmd == 0x03) {
+                    LOG(NOTICE, "Sent: %s to node 0x%02X", cmd_desc, m_nodeId);
+                } else {
+                    LOG(NOTICE, "Sent: %s to node 0x%02X, Data length: %zu", cmd_desc, m_nodeId, len);
+                }
+            }
+        }
+
+        int ret = waitResponse(cmd, timeout);
+        if(ret >= 0) {
+            // A late answer to an earlier copy says nothing about the
+            // round trip, so only first attempts are measured.
+            if(ret > 0 && attempt == 0) {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                recordLatency(cmd, tx_ns, m_reply.rxNs());
+            }
+            return ret > 0;
+        }
+
+        backoff(kind);
+        if(attempt + 1 < attempts) {
+            LOG(WARN, "%s node 0x%02X: No answer to %s within %llu ms, resending", m_bus->name().c_str(), m_nodeId,
+                getCommandDescription(cmd), (unsigned long long)(timeout / 1000));
+        }
+    }
+
+    LOG(ERROR, "Timeout waiting for %s from %s node 0x%02X!", cmd == 0x05 ? "CRC" : "confirmation",
+        m_bus->name().c_str(), m_nodeId);
+    return false;
+}
+
+bool BootloaderSession::sendCommand(uint8_t cmd, const std::vector<uint8_t> &data, bool verbose)
+{
+    return sendCommand(cmd, data.data(), data.size(), verbose);
+}
+
+// Old bootloaders may answer the unknown command with a failed 0x11; the
+// slot only waits for 0x13, so that is dropped and not taken as the ack of
+// the next command.
+bool BootloaderSession::queryCapabilities(int timeout_ms)
+{
+    if(!postQuery(0x06))
+        return false;
+    return collectQuery(std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms));
+}
+
+bool BootloaderSession::postQuery(uint8_t cmd)
+{
+    if(cmd != 0x05 && cmd != 0x06) {
+        LOG(ERROR, "Command 0x%02X cannot be queried", cmd);
+        return false;
+    }
+    m_queryCmd = cmd;
+    m_reply.arm(cmd, cmd == 0x05 ? 0x12 : 0x13);
+    m_queryTxNs = nowNs();
+    return transmitCommand(cmd, nullptr, 0);
+}
+
+bool BootloaderSession::collectQuery(Deadline deadline)
+{
+    bool ok = m_reply.wait(deadline, m_busyPollUs);
+    if(ok) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        recordLatency(m_queryCmd, m_queryTxNs, m_reply.rxNs());
+    }
+    return ok;
+}
+
+bool BootloaderSession::erase()
+{
+    m_bytesDone = 0;
+    bool ok = sendCommand(0x01, {});
+    setResult(ok ? "OK" : "Erase failed");
+    return ok;
+}
+
+bool BootloaderSession::readCrc(uint32_t &crc)
+{
+    m_bytesDone = 0;
+    bool ok = sendCommand(0x05, {});
+    if(ok)
+        crc = receivedCrc();
+    setResult(ok ? "OK" : "No CRC response");
+    return ok;
+}
+
+void BootloaderSession::updateProgress(size_t done, size_t total)
+{
+    m_bytesDone = done;
+    if(m_opt.progress)
+        m_opt.progress(done, total, false);
+}
+
+void BootloaderSession::endProgress()
+{
+    if(m_opt.progress)
+        m_opt.progress(m_bytesDone, m_bytesTotal, true);
+}
+
+bool BootloaderSession::writeStopAndWait(const ImageView &buf)
+{
+    size_t idx = 0;
+    size_t success_count = 0;
+    size_t fail_count = 0;
+
+    bool old_verbose = m_verbose;
+    m_verbose = false;
+
+    while(idx < buf.size())
+    {
+        uint8_t word[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+        for(int i=0; i<4 && idx<buf.size(); i++)
+            word[i] = buf[idx++];
+
+        if(sendCommand(0x03, word, sizeof(word), false)) {
+            success_count++;
+        } else {
+            fail_count++;
+            m_verbose = old_verbose;
+            endProgress();
+            LOG(ERROR, "%s node 0x%02X: Write word failed at idx=%zu", m_bus->name().c_str(), m_nodeId, idx-4);
+            LOG(NOTICE, "Successful writes: %zu, Failed writes: %zu", success_count, fail_count);
+            return false;
+        }
+
+        if(idx % 1024 == 0 || idx == buf.size())
+            updateProgress(idx, buf.size());
+    }
+
+    m_verbose = old_verbose;
+    endProgress();
+
+    if(!m_opt.quiet)
+        LOG(NOTICE, "Download completed! Successful writes: %zu", success_count);
+    return true;
+}
+
+// Builds frame `i` of the image: a 16-bit sequence number followed by
+// `chunk` firmware bytes, copied straight from the image into the frame, or
+// taken from the prepared frames when the whole image is being written.
+bool BootloaderSession::buildChunk(const ImageView &buf, size_t i, uint8_t cmd, size_t chunk, bool fd,
+                                   struct canfd_frame &tx)
+{
+    if(m_frames && i < m_frames->size())
+        tx = (*m_frames)[i];
+    else if(!PreparedImage::encodeFrame(buf, i, cmd, chunk, fd, tx))
+        return false;
+    tx.can_id = (m_nodeId << 7) | cmd;
+    return true;
+}
+
+bool BootloaderSession::transmitChunk(const ImageView &buf, size_t i, uint8_t cmd, size_t chunk, bool fd)
+{
+    struct canfd_frame tx;
+    if(!buildChunk(buf, i, cmd, chunk, fd, tx))
+        return false;
+    m_stats.frames++;
+    return m_bus->tx().submit(m_nodeId, tx, fd);
+}
+
+bool BootloaderSession::writeWindowed(const ImageView &buf, int window, uint8_t cmd, size_t chunk, bool fd)
+{
+    typedef std::chrono::steady_clock clock;
+
+    const size_t total = (buf.size() + chunk - 1) / chunk;
+    const int kind = latencyKind(cmd);
+    std::vector<bool> acked(total, false);
+    std::vector<uint8_t> retries(total, 0);
+    std::vector<clock::time_point> sent_at(total);
+    std::vector<uint64_t> sent_ns(total);
+    size_t base = 0;
+    size_t next = 0;
+    size_t retransmits = 0;
+    size_t reported = 0;
+    std::vector<SeqAck> acks(m_seqAcks.capacity());
+    size_t n_acks = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_seqAcks.clear();
+    }
+
+    auto sendFrame = [&](size_t i) {
+        sent_at[i] = clock::now();
+        sent_ns[i] = nowNs();
+        return transmitChunk(buf, i, cmd, chunk, fd);
+    };
+
+    while(base < total) {
+        std::chrono::microseconds rto(timeoutUs(kind));
+        while(next < total && next - base < (size_t)window) {
+            if(!sendFrame(next)) {
+                endProgress();
+                LOG(ERROR, "%s node 0x%02X: Transmit failed at idx=%zu", m_bus->name().c_str(), m_nodeId, next * chunk);
+                return false;
+            }
+            next++;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(m_mtx);
+            waitQueued(lock, clock::now() + rto, [this]{ return m_seqAcks.size() > 0; });
+            n_acks = m_seqAcks.pop(acks.data(), acks.size());
+
+            // Retransmitted frames are ambiguous (which copy was acked?)
+            // and are left out of the latency histogram.
+            for(size_t a = 0; a < n_acks; a++) {
+                const SeqAck &ack = acks[a];
+                size_t idx = base + (uint16_t)(ack.seq - (uint16_t)base);
+                if(idx < next && !acked[idx] && retries[idx] == 0)
+                    recordLatency(cmd, sent_ns[idx], ack.rx_ns);
+            }
+        }
+
+        for(size_t a = 0; a < n_acks; a++) {
+            const SeqAck &ack = acks[a];
+            size_t idx = base + (uint16_t)(ack.seq - (uint16_t)base);
+            if(idx >= next)
+                continue;
+            if(ack.status != 0xFF) {
+                endProgress();
+                LOG(ERROR, "%s node 0x%02X: Write rejected at idx=%zu, status: 0x%02X", m_bus->name().c_str(), m_nodeId, idx * chunk, ack.status);
+                return false;
+            }
+            acked[idx] = true;
+        }
+
+        while(base < next && acked[base])
+            base++;
+
+        clock::time_point now = clock::now();
+        bool lost = false;
+        for(size_t i = base; i < next; i++) {
+            if(acked[i] || now - sent_at[i] < rto)
+                continue;
+            if(retries[i] >= WINDOW_MAX_RETRIES) {
+                endProgress();
+                LOG(ERROR, "%s node 0x%02X: Write frame lost at idx=%zu after %d retransmits", m_bus->name().c_str(), m_nodeId, i * chunk, WINDOW_MAX_RETRIES);
+                return false;
+            }
+            if(!sendFrame(i)) {
+                endProgress();
+                LOG(ERROR, "%s node 0x%02X: Transmit failed at idx=%zu", m_bus->name().c_str(), m_nodeId, i * chunk);
+                return false;
+            }
+            retries[i]++;
+            retransmits++;
+            m_stats.retransmits++;
+            lost = true;
+        }
+        // One back-off per round, however many frames of the window were
+        // lost; the next first-time ack recomputes the timeout.
+        if(lost)
+            backoff(kind);
+
+        size_t done = base * chunk < buf.size() ? base * chunk : buf.size();
+        if(done - reported >= 1024 || done == buf.size()) {
+            updateProgress(done, buf.size());
+            reported = done;
+        }
+    }
+
+    endProgress();
+    if(!m_opt.quiet)
+        LOG(NOTICE, "Download completed! Frames: %zu, Retransmits: %zu", total, retransmits);
+    return true;
+}
+
+// sample is false when the previous query went unanswered, since its late
+// answer could be taken for this one's.
+bool BootloaderSession::queryBlock(uint16_t block, size_t count, std::vector<size_t> &missing, bool sample)
+{
+    typedef std::chrono::steady_clock clock;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_blockAcks.clear();
+    }
+
+    missing.clear();
+    uint8_t args[4] = {
+        (uint8_t)(block >> 8), (uint8_t)(block & 0xFF),
+        (uint8_t)(count >> 8), (uint8_t)(count & 0xFF)
+    };
+    uint64_t tx_ns = nowNs();
+    if(!transmitCommand(0x09, args, sizeof(args)))
+        return false;
+
+    clock::time_point deadline = clock::now() + std::chrono::microseconds(timeoutUs(LAT_BLOCK));
+    std::unique_lock<std::mutex> lock(m_mtx);
+    while(true) {
+        if(!waitQueued(lock, deadline, [this]{ return m_blockAcks.size() > 0; })) {
+            m_rto[LAT_BLOCK].backoff();
+            m_stats.timeouts++;
+            return false;
+        }
+
+        BlockAck ack;
+        while(m_blockAcks.pop(ack)) {
+            if(ack.block != block)
+                continue;
+            if(ack.part == 0 && sample)
+                recordLatency(0x09, tx_ns, ack.rx_ns);
+
+            if(ack.status == BLOCK_COMPLETE)
+                return true;
+            if(ack.status != BLOCK_HOLES_MORE && ack.status != BLOCK_HOLES_LAST) {
+                LOG(ERROR, "%s node 0x%02X: Block %u rejected, status: 0x%02X", m_bus->name().c_str(), m_nodeId, block, ack.status);
+                return false;
+            }
+
+            for(int bit = 0; bit < 32; bit++) {
+                size_t idx = ack.part * 32 + bit;
+                if((ack.missing & (1u << bit)) && idx < count)
+                    missing.push_back(idx);
+            }
+            if(ack.status == BLOCK_HOLES_LAST)
+                return true;
+        }
+    }
+}
+
+bool BootloaderSession::writeBlocks(const ImageView &buf, uint8_t cmd, size_t chunk, bool fd, size_t block_frames)
+{
+    const size_t total = (buf.size() + chunk - 1) / chunk;
+    std::vector<struct canfd_frame> frames;
+    std::vector<size_t> pending;
+    std::vector<size_t> missing;
+    bool requery = false;
+    size_t resent = 0;
+    size_t reported = 0;
+
+    for(size_t first = 0; first < total; first += block_frames) {
+        size_t count = std::min(block_frames, total - first);
+        uint16_t block = first / block_frames;
+
+        pending.resize(count);
+        for(size_t i = 0; i < count; i++)
+            pending[i] = i;
+
+        for(int attempt = 0; ; attempt++) {
+            if(attempt > BLOCK_MAX_RETRIES) {
+                endProgress();
+                LOG(ERROR, "%s node 0x%02X: Block %u failed at idx=%zu after %d retries", m_bus->name().c_str(), m_nodeId, block, first * chunk, BLOCK_MAX_RETRIES);
+                return false;
+            }
+
+            // A frame that could not be queued shows up as a hole in the
+            // block status, so it is simply resent with the others.
+            frames.resize(pending.size());
+            for(size_t k = 0; k < pending.size(); k++)
+                buildChunk(buf, first + pending[k], cmd, chunk, fd, frames[k]);
+            m_bus->tx().submitBatch(m_nodeId, frames.data(), frames.size(), fd);
+            m_stats.frames += frames.size();
+            if(attempt > 0) {
+                resent += pending.size();
+                m_stats.retransmits += pending.size();
+            }
+
+            if(!queryBlock(block, count, missing, !requery)) {
+                // Lost query or status: ask again without resending data.
+                pending.clear();
+                requery = true;
+                continue;
+            }
+            requery = false;
+            if(missing.empty())
+                break;
+            pending.swap(missing);
+        }
+
+        size_t done = std::min((first + count) * chunk, buf.size());
+        if(done - reported >= 1024 || done == buf.size()) {
+            updateProgress(done, buf.size());
+            reported = done;
+        }
+    }
+
+    endProgress();
+    if(!m_opt.quiet)
+        LOG(NOTICE, "Download completed! Frames: %zu, Resent: %zu", total, resent);
+    return true;
+}
+
+// Picks the fastest write mode both ends support. caps tells whether the
+// target answered queryCapabilities().
+BootloaderSession::WritePlan BootloaderSession::planWrite(bool caps)
+{
+    WritePlan plan;
+    bool full_frame = caps && (m_features & CAP_FULL_FRAME);
+    bool block_ack = full_frame && (m_features & CAP_BLOCK_ACK);
+    bool windowed = false;
+    plan.fd = full_frame && (m_features & CAP_CANFD) && m_bus->can()->isFdEnabled();
+    if(caps && m_opt.window > 1 && (m_features & CAP_WINDOWED_WRITE)) {
+        plan.window = m_opt.window;
+        if(m_maxWindow > 0 && plan.window > m_maxWindow)
+            plan.window = m_maxWindow;
+        windowed = plan.window > 1;
+    }
+
+    if(windowed) {
+        plan.mode |= WRITE_MODE_WINDOWED;
+        plan.cmd = 0x07;
+    }
+    if(full_frame) {
+        plan.mode |= WRITE_MODE_FULL_FRAME;
+        plan.cmd = 0x08;
+        plan.chunk = CAN_MAX_DLEN - 2;
+    }
+    if(plan.fd) {
+        plan.mode |= WRITE_MODE_FD;
+        plan.chunk = CANFD_MAX_DLEN - 2;
+    }
+    // A record holds one page, and its length field ends at LZ4_RECORD_MAX.
+    if(m_opt.compress && (m_features & CAP_COMPRESSED) && m_pageSize && (windowed || full_frame)) {
+        if(m_pageSize <= LZ4_RECORD_MAX)
+            plan.mode |= WRITE_MODE_LZ4;
+        else if(!m_opt.quiet)
+            LOG(NOTICE, "Pages of %u bytes do not fit an LZ4 record, writing uncompressed", (unsigned)m_pageSize);
+    }
+    if(block_ack) {
+        plan.mode |= WRITE_MODE_BLOCK_ACK;
+        size_t page = m_pageSize ? m_pageSize : 1024;
+        plan.block_frames = std::max<size_t>(1, page / plan.chunk);
+    }
+
+    if(!m_opt.quiet) {
+        if(block_ack) {
+            LOG(NOTICE, "Target protocol v%d, %s block write%s, %zu bytes per frame, %zu frames per block",
+                m_protoVersion, plan.fd ? "CAN FD" : "classic", plan.mode & WRITE_MODE_LZ4 ? " (LZ4)" : "",
+                plan.chunk, plan.block_frames);
+        } else if(plan.mode != WRITE_MODE_LEGACY) {
+            LOG(NOTICE, "Target protocol v%d, %s write%s, %zu bytes per frame, window %d",
+                m_protoVersion, plan.fd ? "CAN FD" : "classic", plan.mode & WRITE_MODE_LZ4 ? " (LZ4)" : "",
+                plan.chunk, plan.window);
+        } else {
+            LOG(NOTICE, "Using stop-and-wait write");
+        }
+    }
+    return plan;
+}
+
+// Start write, data and end write for one contiguous region. Compressed
+// writes stream the LZ4 records of the region, one per page, instead of its
+// bytes; a region that would not shrink is sent as it is.
+bool BootloaderSession::writeRegion(const ImageView &region, const WritePlan &plan)
+{
+    bool chatty = !m_opt.quiet;
+    uint8_t mode = plan.mode;
+    ImageView buf = region;
+    std::vector<uint8_t> packed;
+
+    // Page-aligned regions of a prepared image use its records and, for the
+    // whole image, its frames.
+    const PreparedImage *prepared = m_opt.prepared.get();
+    ImageView image = prepared ? prepared->view() : ImageView();
+    bool inside = prepared && region.data >= image.data && region.data + region.size() <= image.data + image.size();
+    size_t region_offset = inside ? region.data - image.data : 0;
+    bool whole = inside && region_offset == 0 && region.size() == image.size();
+
+    if(mode & WRITE_MODE_LZ4) {
+        if(inside && region_offset % m_pageSize == 0) {
+            const Lz4Stream &stream = prepared->lz4(m_pageSize);
+            size_t first = region_offset / m_pageSize;
+            size_t last = (region_offset + region.size() + m_pageSize - 1) / m_pageSize;
+            packed.assign(stream.data.begin() + stream.offsets[first], stream.data.begin() + stream.offsets[last]);
+        } else {
+            Lz4::compressStream(region.data, region.size(), m_pageSize, packed);
+        }
+        if(packed.size() < region.size()) {
+            buf = ImageView(packed.data(), packed.size());
+            if(chatty)
+                LOG(NOTICE, "LZ4: %zu -> %zu bytes (%.0f%%)", region.size(), packed.size(),
+                    100.0 * packed.size() / region.size());
+        } else {
+            mode &= ~WRITE_MODE_LZ4;
+        }
+    }
+
+    if(chatty)
+        LOG(NOTICE, "Sending start write command...");
+    std::vector<uint8_t> start_args;
+    if(mode != WRITE_MODE_LEGACY)
+        start_args = { mode, (uint8_t)plan.window, (uint8_t)plan.chunk };
+    if(plan.mode & WRITE_MODE_BLOCK_ACK) {
+        start_args.push_back((plan.block_frames >> 8) & 0xFF);
+        start_args.push_back(plan.block_frames & 0xFF);
+    }
+    if(!sendCommand(0x02, start_args)) {
+        LOG(ERROR, "%s node 0x%02X: Begin write failed!", m_bus->name().c_str(), m_nodeId);
+        setResult("Begin write failed");
+        return false;
+    }
+
+    if(chatty)
+        LOG(NOTICE, "Writing data...");
+    bool sequenced = plan.mode & (WRITE_MODE_WINDOWED | WRITE_MODE_FULL_FRAME);
+    if(whole && sequenced)
+        m_frames = &prepared->frames(plan.cmd, plan.chunk, plan.fd, (mode & WRITE_MODE_LZ4) ? m_pageSize : 0);
+    bool written;
+    if(plan.mode & WRITE_MODE_BLOCK_ACK)
+        written = writeBlocks(buf, plan.cmd, plan.chunk, plan.fd, plan.block_frames);
+    else if(sequenced)
+        written = writeWindowed(buf, plan.window, plan.cmd, plan.chunk, plan.fd);
+    else
+        written = writeStopAndWait(buf);
+    m_frames = nullptr;
+    if(!written) {
+        setResult("Write failed");
+        return false;
+    }
+
+    if(chatty)
+        LOG(NOTICE, "Sending end write command...");
+    if(!sendCommand(0x04, {})) {
+        LOG(ERROR, "%s node 0x%02X: End write failed!", m_bus->name().c_str(), m_nodeId);
+        setResult("End write failed");
+        return false;
+    }
+    if(mode & WRITE_MODE_LZ4)
+        m_bytesDone = region.size();
+    return true;
+}
+
+// Reads the CRCs of pages [first, first + count) with 0x0A, at most
+// PAGE_QUERY_MAX per query. Pages whose 0x16 got lost are asked for again.
+bool BootloaderSession::queryPageCrcs(size_t first, size_t count, std::vector<uint32_t> &crcs)
+{
+    typedef std::chrono::steady_clock clock;
+
+    crcs.assign(count, 0);
+    std::vector<bool> have(count, false);
+    size_t missing = count;
+
+    for(int attempt = 0; missing > 0; attempt++) {
+        if(attempt > PAGE_CRC_RETRIES) {
+            LOG(ERROR, "%s node 0x%02X: No CRC for %zu pages", m_bus->name().c_str(), m_nodeId, missing);
+            return false;
+        }
+
+        for(size_t i = 0; i < count; ) {
+            if(have[i]) {
+                i++;
+                continue;
+            }
+            size_t n = 0;
+            while(i + n < count && n < PAGE_QUERY_MAX && !have[i + n])
+                n++;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                m_pageCrcs.clear();
+            }
+            size_t page = first + i;
+            uint8_t args[4] = {
+                (uint8_t)(page >> 8), (uint8_t)(page & 0xFF),
+                (uint8_t)(n >> 8), (uint8_t)(n & 0xFF)
+            };
+            uint64_t tx_ns = nowNs();
+            if(!transmitCommand(0x0A, args, sizeof(args)))
+                return false;
+
+            // The deadline moves with every answer, so long queries on a
+            // slow target are not cut short.
+            size_t got = 0;
+            std::chrono::microseconds timeout(timeoutUs(LAT_PAGE_CRC));
+            clock::time_point deadline = clock::now() + timeout;
+            std::unique_lock<std::mutex> lock(m_mtx);
+            while(got < n && waitQueued(lock, deadline, [this]{ return m_pageCrcs.size() > 0; })) {
+                PageCrc crc;
+                while(m_pageCrcs.pop(crc)) {
+                    if(crc.page < first || crc.page >= first + count || have[crc.page - first])
+                        continue;
+                    if(got == 0 && attempt == 0)
+                        recordLatency(0x0A, tx_ns, crc.rx_ns);
+                    have[crc.page - first] = true;
+                    crcs[crc.page - first] = crc.crc;
+                    missing--;
+                    got++;
+                }
+                deadline = clock::now() + timeout;
+            }
+            if(got < n) {
+                m_rto[LAT_PAGE_CRC].backoff();
+                m_stats.timeouts++;
+            }
+            i += n;
+        }
+    }
+    return true;
+}
+
+// The last page is padded with 0xFF, the erased value, as the target
+// computes its CRC over the whole page.
+void BootloaderSession::localPageCrcs(const ImageView &buf, size_t page, std::vector<uint32_t> &crcs)
+{
+    const size_t pages = (buf.size() + page - 1) / page;
+    std::vector<uint8_t> padded(page);
+    crcs.resize(pages);
+    for(size_t i = 0; i < pages; i++) {
+        size_t len = std::min(page, buf.size() - i * page);
+        if(len == page) {
+            crcs[i] = Crc32::compute(buf.data + i * page, page);
+        } else {
+            memset(padded.data(), 0xFF, page);
+            memcpy(padded.data(), buf.data + i * page, len);
+            crcs[i] = Crc32::compute(padded.data(), page);
+        }
+    }
+}
+
+// Page CRCs of the image being flashed, from the prepared image if any.
+void BootloaderSession::imagePageCrcs(const ImageView &buf, size_t page, std::vector<uint32_t> &crcs)
+{
+    if(m_opt.prepared && buf.data == m_opt.prepared->view().data)
+        crcs = m_opt.prepared->pageCrcs(page);
+    else
+        localPageCrcs(buf, page, crcs);
+}
+
+// Reads back pages [first, first + count) and compares them with `local`,
+// which holds the CRCs of all pages of the image.
+bool BootloaderSession::verifyPages(size_t first, size_t count, const std::vector<uint32_t> &local)
+{
+    std::vector<uint32_t> check;
+    if(!queryPageCrcs(first, count, check)) {
+        setResult("Page CRC query failed");
+        return false;
+    }
+    for(size_t i = 0; i < count; i++) {
+        if(check[i] != local[first + i]) {
+            LOG(ERROR, "%s node 0x%02X: Page %zu CRC mismatch! Device 0x%08X, local 0x%08X",
+                m_bus->name().c_str(), m_nodeId, first + i, check[i], local[first + i]);
+            setResult("CRC mismatch");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BootloaderSession::erasePages(size_t first, size_t count)
+{
+    uint8_t args[4] = {
+        (uint8_t)(first >> 8), (uint8_t)(first & 0xFF),
+        (uint8_t)(count >> 8), (uint8_t)(count & 0xFF)
+    };
+    if(!sendCommand(0x0B, args, sizeof(args))) {
+        LOG(ERROR, "%s node 0x%02X: Page erase failed!", m_bus->name().c_str(), m_nodeId);
+        setResult("Page erase failed");
+        return false;
+    }
+    return true;
+}
+
+// Erases pages [first, first + count) with 0x0B when asked to, points the
+// next write at them with 0x0C and writes that part of the image.
+bool BootloaderSession::writePages(const ImageView &buf, size_t first, size_t count, const WritePlan &plan, bool erase)
+{
+    const size_t page = m_pageSize;
+    size_t offset = first * page;
+    size_t len = std::min(count * page, buf.size() - offset);
+
+    if(erase && !erasePages(first, count))
+        return false;
+    uint8_t offset_args[4] = {
+        (uint8_t)(offset >> 24), (uint8_t)(offset >> 16),
+        (uint8_t)(offset >> 8), (uint8_t)(offset & 0xFF)
+    };
+    if(!sendCommand(0x0C, offset_args, sizeof(offset_args))) {
+        LOG(ERROR, "%s node 0x%02X: Set write offset failed!", m_bus->name().c_str(), m_nodeId);
+        setResult("Set offset failed");
+        return false;
+    }
+
+    return writeRegion(buf.slice(offset, len), plan);
+}
+
+// Runs of pages that hold anything but 0xFF. Returns the number of such
+// pages; the others are already in the erased state after 0x01.
+static size_t populatedRuns(const ImageView &buf, size_t page, std::vector<std::pair<size_t, size_t>> &runs)
+{
+    const size_t pages = (buf.size() + page - 1) / page;
+    size_t populated = 0;
+    runs.clear();
+    for(size_t i = 0; i < pages; i++) {
+        size_t len = std::min(page, buf.size() - i * page);
+        const uint8_t *p = buf.data + i * page;
+        if(p[0] == 0xFF && memcmp(p, p + 1, len - 1) == 0)
+            continue;
+        if(!runs.empty() && runs.back().first + runs.back().second == i)
+            runs.back().second++;
+        else
+            runs.push_back(std::make_pair(i, (size_t)1));
+        populated++;
+    }
+    return populated;
+}
+
+// Lets the target erase every page right before programming it
+// (CAP_ERASE_AHEAD), so the erase of page N + 1 overlaps the transfer of
+// page N. Only for sequenced writes, whose frames may be sent again while
+// the target is busy; their timeouts stay above twice the page erase time.
+bool BootloaderSession::useEraseAhead(WritePlan &plan)
+{
+    if(m_opt.erase != ERASE_OVERLAPPED || !(m_features & CAP_ERASE_AHEAD) ||
+       !(plan.mode & (WRITE_MODE_WINDOWED | WRITE_MODE_FULL_FRAME)))
+        return false;
+    plan.mode |= WRITE_MODE_ERASE;
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_eraseFloorUs = 2ULL * m_pageEraseMs * 1000;
+    return true;
+}
+
+// With a range erase the pages between the populated runs of a sparse
+// image must read as erased as well. Their CRCs are read first and only the
+// pages that are not blank are erased.
+bool BootloaderSession::eraseStalePages(const std::vector<std::pair<size_t, size_t>> &runs, size_t pages)
+{
+    std::vector<uint8_t> blank(m_pageSize, 0xFF);
+    uint32_t blank_crc = Crc32::compute(blank.data(), blank.size());
+
+    std::vector<std::pair<size_t, size_t>> stale;
+    size_t next = 0;
+    for(size_t r = 0; r <= runs.size(); r++) {
+        size_t end = r < runs.size() ? runs[r].first : pages;
+        if(end > next) {
+            std::vector<uint32_t> crcs;
+            if(!queryPageCrcs(next, end - next, crcs)) {
+                setResult("Page CRC query failed");
+                return false;
+            }
+            for(size_t i = 0; i < crcs.size(); i++) {
+                if(crcs[i] == blank_crc)
+                    continue;
+                if(!stale.empty() && stale.back().first + stale.back().second == next + i)
+                    stale.back().second++;
+                else
+                    stale.push_back(std::make_pair(next + i, (size_t)1));
+            }
+        }
+        if(r < runs.size())
+            next = runs[r].first + runs[r].second;
+    }
+
+    for(const std::pair<size_t, size_t> &run : stale) {
+        if(!m_opt.quiet)
+            LOG(NOTICE, "Erasing stale pages %zu-%zu...", run.first, run.first + run.second - 1);
+        if(!erasePages(run.first, run.second))
+            return false;
+    }
+    return true;
+}
+
+// Sparse write: only the populated runs are written, each erased first when
+// asked to, and the CRC of every page of the image is compared afterwards,
+// as the 0x05 CRC of a target that never saw the gaps cannot be predicted.
+bool BootloaderSession::flashSparse(const ImageView &buf, const std::vector<std::pair<size_t, size_t>> &runs,
+                                    const WritePlan &plan, bool erase)
+{
+    bool chatty = !m_opt.quiet;
+
+    for(const std::pair<size_t, size_t> &run : runs) {
+        if(chatty)
+            LOG(NOTICE, "Writing pages %zu-%zu...", run.first, run.first + run.second - 1);
+        if(!writePages(buf, run.first, run.second, plan, erase))
+            return false;
+    }
+
+    if(chatty)
+        LOG(NOTICE, "Write completed, verifying page CRCs...");
+    std::vector<uint32_t> local;
+    imagePageCrcs(buf, m_pageSize, local);
+    if(!verifyPages(0, local.size(), local))
+        return false;
+
+    m_bytesDone = buf.size();
+    if(chatty)
+        LOG(NOTICE, "Page CRC verification passed!");
+    setResult("OK");
+    return true;
+}
+
+// Negotiate, erase, write and verify. Step notices are only logged when not
+// quiet; failures always are, and the reason is kept in the result.
+//
+// Targets with page commands only get the pages of the image erased (0x0B)
+// instead of the whole application (0x01), or erase them on the fly during
+// the write with CAP_ERASE_AHEAD.
+bool BootloaderSession::flashImage(const ImageView &buf, uint32_t local_crc)
+{
+    bool chatty = !m_opt.quiet;
+
+    bool caps = queryCapabilities();
+    WritePlan plan = planWrite(caps);
+    bool page_cmds = caps && (m_features & CAP_PAGE_CRC) && m_pageSize;
+    bool range = page_cmds && m_opt.erase != ERASE_FULL;
+    bool ahead = range && useEraseAhead(plan);
+
+    std::vector<std::pair<size_t, size_t>> runs;
+    size_t pages = page_cmds ? (buf.size() + m_pageSize - 1) / m_pageSize : 0;
+    size_t populated = pages;
+    if(page_cmds && m_opt.sparse)
+        populated = populatedRuns(buf, m_pageSize, runs);
+    bool sparse = populated < pages;
+    if(sparse && chatty)
+        LOG(NOTICE, "Sparse write: %zu of %zu pages hold data, %zu region%s", populated, pages,
+            runs.size(), runs.size() == 1 ? "" : "s");
+
+    if(range) {
+        if(chatty)
+            LOG(NOTICE, "Erasing %zu of %zu pages%s", populated, (size_t)(APP_END - APP_START) / m_pageSize,
+                ahead ? " while writing" : "");
+        if(sparse && !eraseStalePages(runs, pages))
+            return false;
+    } else {
+        if(chatty)
+            LOG(NOTICE, "Sending erase command...");
+        if(!sendCommand(0x01, {})) {
+            LOG(ERROR, "%s node 0x%02X: Erase failed!", m_bus->name().c_str(), m_nodeId);
+            setResult("Erase failed");
+            return false;
+        }
+    }
+
+    if(sparse)
+        return flashSparse(buf, runs, plan, range && !ahead);
+    if(range) {
+        if(!writePages(buf, 0, pages, plan, !ahead))
+            return false;
+    } else if(!writeRegion(buf, plan)) {
+        return false;
+    }
+
+    if(chatty)
+        LOG(NOTICE, "Write completed, verifying CRC...");
+
+    if(!sendCommand(0x05, {})) {
+        LOG(ERROR, "%s node 0x%02X: Failed to get device CRC", m_bus->name().c_str(), m_nodeId);
+        setResult("No CRC response");
+        return false;
+    }
+
+    uint32_t device_crc = receivedCrc();
+    if(chatty) {
+        LOG(NOTICE, "Device CRC: 0x%08X", device_crc);
+        LOG(NOTICE, "Local CRC:  0x%08X", local_crc);
+    }
+    if(device_crc != local_crc) {
+        LOG(ERROR, "%s node 0x%02X: CRC verification failed! Device 0x%08X, local 0x%08X",
+            m_bus->name().c_str(), m_nodeId, device_crc, local_crc);
+        setResult("CRC mismatch");
+        return false;
+    }
+
+    if(chatty)
+        LOG(NOTICE, "CRC verification passed!");
+    if(m_opt.verifyPages && (m_features & CAP_PAGE_CRC) && m_pageSize) {
+        std::vector<uint32_t> local;
+        imagePageCrcs(buf, m_pageSize, local);
+        if(!verifyPages(0, local.size(), local))
+            return false;
+        if(chatty)
+            LOG(NOTICE, "Page CRC verification passed!");
+    }
+    setResult("OK");
+    return true;
+}
+
+// Delta write: compares the CRC of every page with the local image and
+// erases and rewrites only the runs of pages that differ, then reads their
+// CRCs back.
+bool BootloaderSession::flashDelta(const ImageView &buf)
+{
+    bool chatty = !m_opt.quiet;
+
+    if(!queryCapabilities() || !(m_features & CAP_PAGE_CRC) || m_pageSize == 0) {
+        LOG(ERROR, "%s node 0x%02X: Target has no page CRC support, use a full write", m_bus->name().c_str(), m_nodeId);
+        setResult("No page CRC support");
+        return false;
+    }
+
+    const size_t page = m_pageSize;
+    const size_t pages = (buf.size() + page - 1) / page;
+    std::vector<uint32_t> local;
+    imagePageCrcs(buf, page, local);
+
+    if(chatty)
+        LOG(NOTICE, "Reading %zu page CRCs (%zu bytes per page)...", pages, page);
+    std::vector<uint32_t> remote;
+    if(!queryPageCrcs(0, pages, remote)) {
+        setResult("Page CRC query failed");
+        return false;
+    }
+
+    std::vector<std::pair<size_t, size_t>> runs;
+    size_t changed = 0;
+    for(size_t i = 0; i < pages; i++) {
+        if(local[i] == remote[i])
+            continue;
+        if(!runs.empty() && runs.back().first + runs.back().second == i)
+            runs.back().second++;
+        else
+            runs.push_back(std::make_pair(i, (size_t)1));
+        changed++;
+    }
+
+    if(chatty)
+        LOG(NOTICE, "%zu of %zu pages differ, %zu region%s to rewrite", changed, pages, runs.size(), runs.size() == 1 ? "" : "s");
+    if(runs.empty()) {
+        m_bytesDone = buf.size();
+        setResult("OK (unchanged)");
+        return true;
+    }
+
+    WritePlan plan = planWrite(true);
+    bool ahead = useEraseAhead(plan);
+    for(const std::pair<size_t, size_t> &run : runs) {
+        if(chatty)
+            LOG(NOTICE, "Rewriting pages %zu-%zu...", run.first, run.first + run.second - 1);
+        if(!writePages(buf, run.first, run.second, plan, !ahead))
+            return false;
+    }
+
+    if(chatty)
+        LOG(NOTICE, "Verifying rewritten pages...");
+    for(const std::pair<size_t, size_t> &run : runs) {
+        if(!verifyPages(run.first, run.second, local))
+            return false;
+    }
+
+    m_bytesDone = buf.size();
+    if(chatty)
+        LOG(NOTICE, "Delta write completed, %zu of %zu pages rewritten", changed, pages);
+    setResult("OK");
+    return true;
+}
+
+// Marks the session running and lets its responses through the filters
+// before the first command goes out.
+void BootloaderSession::begin(size_t total)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_result.clear();
+        m_eraseFloorUs = 0;
+        for(Histogram &h : m_latency)
+            h.reset();
+    }
+    m_bytesTotal = total;
+    m_bytesDone = 0;
+    m_started = std::chrono::steady_clock::now();
+    m_state = SESSION_RUNNING;
+    m_bus->updateFilters();
+}
+
+void BootloaderSession::finish(bool ok)
+{
+    m_finished = std::chrono::steady_clock::now();
+    m_state = ok ? SESSION_DONE : SESSION_FAILED;
+    m_bus->updateFilters();
+}
+
+bool BootloaderSession::run(const ImageView &image, uint32_t image_crc, const FlashOptions &opt)
+{
+    m_opt = opt;
+    ImageView buf = opt.prepared ? opt.prepared->view() : image;
+    uint32_t crc = opt.prepared ? opt.prepared->crc() : image_crc;
+    bool old_verbose = m_verbose;
+    if(opt.quiet)
+        m_verbose = false;
+
+    bool ok = opt.delta ? flashDelta(buf) : flashImage(buf, crc);
+
+    m_verbose = old_verbose;
+    m_opt.progress = nullptr;
+    m_opt.prepared.reset();
+    return ok;
+}
+
+bool BootloaderSession::flash(const ImageView &image, uint32_t crc, const FlashOptions &opt)
+{
+    if(m_state == SESSION_RUNNING) {
+        LOG(ERROR, "%s node 0x%02X: Session is busy", m_bus->name().c_str(), m_nodeId);
+        return false;
+    }
+
+    begin(image.size());
+    bool ok = run(image, crc, opt);
+    finish(ok);
+    return ok;
+}
+
+std::shared_future<bool> BootloaderSession::start(const ImageView &image, uint32_t crc, const FlashOptions &opt,
+                                                  CompletionCallback done)
+{
+    std::shared_ptr<std::promise<bool>> promise = std::make_shared<std::promise<bool>>();
+    if(m_state == SESSION_RUNNING) {
+        LOG(ERROR, "%s node 0x%02X: Session is busy", m_bus->name().c_str(), m_nodeId);
+        promise->set_value(false);
+        return promise->get_future().share();
+    }
+    if(m_worker.joinable())
+        m_worker.join();
+
+    m_future = promise->get_future().share();
+    begin(image.size());
+    m_worker = std::thread([this, image, crc, opt, done, promise] {
+        bool ok = run(image, crc, opt);
+        finish(ok);
+        if(done)
+            done(*this, ok);
+        promise->set_value(ok);
+    });
+    return m_future;
+}
+
+bool BootloaderSession::wait()
+{
+    if(m_worker.joinable())
+        m_worker.join();
+    return m_future.valid() ? m_future.get() : m_state == SESSION_DONE;
+}
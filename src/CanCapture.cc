@@ -0,0 +1,341 @@
+#include "CanCapture.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CAPTURE_CHANNELS    256
+#define DRAIN_BATCH         256
+
+static size_t recordSize(uint8_t len)
+{
+    return sizeof(CaptureRecordHeader) + ((len + 7) & ~7);
+}
+
+static uint64_t realtimeNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+CaptureWriter::CaptureWriter() :
+    m_file(nullptr),
+    m_closing(false),
+    m_frames(0),
+    m_bytes(0),
+    m_lost(0)
+{
+
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    close();
+    for (Channel &channel : m_channels)
+        delete channel.ring;
+}
+
+int CaptureWriter::open(const std::string &path)
+{
+    m_file = fopen(path.c_str(), "wb");
+    if (!m_file) {
+        LOG(ERROR, "Cannot create capture %s: %s", path.c_str(), strerror(errno));
+        return -1;
+    }
+    m_path = path;
+    setvbuf(m_file, nullptr, _IOFBF, 1 << 16);
+
+    CaptureFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CAPTURE_MAGIC;
+    hdr.version = CAPTURE_VERSION;
+    hdr.start_ns = realtimeNs();
+    if (fwrite(&hdr, sizeof(hdr), 1, m_file) != 1) {
+        LOG(ERROR, "Cannot write capture %s: %s", path.c_str(), strerror(errno));
+        fclose(m_file);
+        m_file = nullptr;
+        return -1;
+    }
+    m_bytes = sizeof(hdr);
+    return 0;
+}
+
+// The thread may never have been started; stop() only joins a running one.
+void CaptureWriter::close()
+{
+    m_closing = true;
+    m_doorbell.ring();
+    this->stop();
+
+    drain();
+    if (!m_file)
+        return;
+    if (fclose(m_file) != 0)
+        LOG(ERROR, "Cannot write capture %s: %s", m_path.c_str(), strerror(errno));
+    m_file = nullptr;
+}
+
+int CaptureWriter::addChannel(const std::string &name, size_t capacity)
+{
+    if (!m_file || m_channels.size() >= CAPTURE_CHANNELS)
+        return -1;
+
+    Channel channel;
+    channel.name = name.substr(0, CANFD_MAX_DLEN);
+    channel.ring = new RingBuffer<struct CanRxFrame>(capacity);
+    m_channels.push_back(channel);
+
+    uint8_t number = m_channels.size() - 1;
+    append(CAPTURE_CHANNEL, number, realtimeNs(), 0, 0, (const uint8_t *)channel.name.data(), channel.name.size());
+    return writeOut() ? number : -1;
+}
+
+void CaptureWriter::record(int channel, const struct canfd_frame *frames, const struct CanRxTimestamp *stamps,
+                           size_t count)
+{
+    struct CanRxFrame entries[Can::RX_BATCH];
+    uint64_t now = 0;
+    while (count > 0) {
+        size_t n = count < Can::RX_BATCH ? count : Can::RX_BATCH;
+        for (size_t i = 0; i < n; i++) {
+            entries[i].frame = frames[i];
+            entries[i].timestamp = stamps[i];
+            if (entries[i].timestamp.software == 0) {
+                if (now == 0)
+                    now = realtimeNs();
+                entries[i].timestamp.software = now;
+            }
+        }
+        m_channels[channel].ring->push(entries, n);
+        frames += n;
+        stamps += n;
+        count -= n;
+    }
+    m_doorbell.ring();
+}
+
+uint64_t CaptureWriter::drops() const
+{
+    uint64_t drops = m_lost.load(std::memory_order_relaxed);
+    for (const Channel &channel : m_channels)
+        drops += channel.ring->overflows();
+    return drops;
+}
+
+void CaptureWriter::run()
+{
+    Deadline flush = std::chrono::steady_clock::now() + std::chrono::milliseconds(FLUSH_MS);
+    bool dirty = false;
+    while (!m_closing) {
+        uint32_t seen = m_doorbell.value();
+        if (drain() > 0)
+            dirty = true;
+
+        Deadline now = std::chrono::steady_clock::now();
+        if (dirty && now >= flush) {
+            if (m_file && fflush(m_file) != 0) {
+                LOG(ERROR, "Cannot write capture %s: %s", m_path.c_str(), strerror(errno));
+                fclose(m_file);
+                m_file = nullptr;
+            }
+            dirty = false;
+        }
+        if (now >= flush)
+            flush = now + std::chrono::milliseconds(FLUSH_MS);
+        m_doorbell.wait(seen, flush, 0);
+    }
+}
+
+// Returns the number of frames written. Once the file is closed the rings
+// are still emptied, and their frames counted as lost.
+size_t CaptureWriter::drain()
+{
+    struct CanRxFrame frames[DRAIN_BATCH];
+    size_t total = 0;
+    bool more = true;
+    while (more) {
+        more = false;
+        size_t batch = 0;
+        for (size_t c = 0; c < m_channels.size(); c++) {
+            size_t n = m_channels[c].ring->pop(frames, DRAIN_BATCH);
+            for (size_t i = 0; i < n; i++) {
+                const struct canfd_frame &f = frames[i].frame;
+                append(CAPTURE_FRAME, c, frames[i].timestamp.software, f.can_id, f.flags, f.data, f.len);
+            }
+            more = more || n == DRAIN_BATCH;
+            batch += n;
+        }
+        if (writeOut())
+            total += batch;
+        else
+            m_lost.fetch_add(batch, std::memory_order_relaxed);
+    }
+    m_frames.fetch_add(total, std::memory_order_relaxed);
+    return total;
+}
+
+void CaptureWriter::append(uint8_t type, uint8_t channel, uint64_t ts_ns, uint32_t can_id, uint8_t flags,
+                           const uint8_t *data, uint8_t len)
+{
+    CaptureRecordHeader hdr;
+    hdr.ts_ns = ts_ns;
+    hdr.can_id = can_id;
+    hdr.len = len;
+    hdr.flags = flags;
+    hdr.channel = channel;
+    hdr.type = type;
+
+    size_t pos = m_buf.size();
+    m_buf.resize(pos + recordSize(len), 0);
+    memcpy(&m_buf[pos], &hdr, sizeof(hdr));
+    memcpy(&m_buf[pos + sizeof(hdr)], data, len);
+}
+
+// A capture that cannot be written any more is closed with an error; what
+// is drained after that is counted as lost.
+bool CaptureWriter::writeOut()
+{
+    if (m_buf.empty())
+        return true;
+
+    bool ok = m_file && fwrite(m_buf.data(), 1, m_buf.size(), m_file) == m_buf.size();
+    if (ok) {
+        m_bytes.fetch_add(m_buf.size(), std::memory_order_relaxed);
+    } else if (m_file) {
+        LOG(ERROR, "Cannot write capture %s: %s", m_path.c_str(), strerror(errno));
+        fclose(m_file);
+        m_file = nullptr;
+    }
+    m_buf.clear();
+    return ok;
+}
+
+CaptureReader::CaptureReader() :
+    m_map(nullptr),
+    m_size(0),
+    m_pos(0),
+    m_startNs(0)
+{
+
+}
+
+CaptureReader::~CaptureReader()
+{
+    close();
+}
+
+int CaptureReader::open(const std::string &path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        LOG(ERROR, "Cannot open capture %s: %s", path.c_str(), strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(CaptureFileHeader)) {
+        LOG(ERROR, "%s is not a capture file", path.c_str());
+        ::close(fd);
+        return -1;
+    }
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        LOG(ERROR, "Cannot map capture %s: %s", path.c_str(), strerror(errno));
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const CaptureFileHeader *hdr = (const CaptureFileHeader *)map;
+    if (hdr->magic != CAPTURE_MAGIC || hdr->version != CAPTURE_VERSION) {
+        LOG(ERROR, "%s is not a capture file of version %d", path.c_str(), CAPTURE_VERSION);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    m_map = (const uint8_t *)map;
+    m_size = st.st_size;
+    m_startNs = hdr->start_ns;
+
+    // All channel records precede the frames.
+    rewind();
+    CaptureRecordHeader rec;
+    while (m_size - m_pos >= sizeof(rec)) {
+        memcpy(&rec, m_map + m_pos, sizeof(rec));
+        if (rec.type != CAPTURE_CHANNEL || recordSize(rec.len) > m_size - m_pos)
+            break;
+        if (m_channels.size() <= rec.channel)
+            m_channels.resize(rec.channel + 1);
+        m_channels[rec.channel].assign((const char *)m_map + m_pos + sizeof(rec), rec.len);
+        m_pos += recordSize(rec.len);
+    }
+    rewind();
+    return 0;
+}
+
+void CaptureReader::close()
+{
+    if (m_map)
+        munmap((void *)m_map, m_size);
+    m_map = nullptr;
+    m_size = 0;
+    m_pos = 0;
+    m_channels.clear();
+}
+
+bool CaptureReader::next(CaptureFrame &frame)
+{
+    while (m_map && m_size - m_pos >= sizeof(CaptureRecordHeader)) {
+        CaptureRecordHeader hdr;
+        memcpy(&hdr, m_map + m_pos, sizeof(hdr));
+        if (hdr.len > CANFD_MAX_DLEN || recordSize(hdr.len) > m_size - m_pos)
+            return false;
+        const uint8_t *data = m_map + m_pos + sizeof(hdr);
+        m_pos += recordSize(hdr.len);
+
+        if (hdr.type == CAPTURE_CHANNEL) {
+            if (m_channels.size() <= hdr.channel)
+                m_channels.resize(hdr.channel + 1);
+            m_channels[hdr.channel].assign((const char *)data, hdr.len);
+            continue;
+        }
+        if (hdr.type != CAPTURE_FRAME)
+            continue;
+
+        memset(&frame, 0, sizeof(frame));
+        frame.ts_ns = hdr.ts_ns;
+        frame.channel = hdr.channel;
+        frame.frame.can_id = hdr.can_id;
+        frame.frame.len = hdr.len;
+        frame.frame.flags = hdr.flags;
+        memcpy(frame.frame.data, data, hdr.len);
+        return true;
+    }
+    return false;
+}
+
+void CaptureReader::rewind()
+{
+    m_pos = m_map ? sizeof(CaptureFileHeader) : 0;
+}
+
+std::string CaptureReader::channelName(int channel) const
+{
+    if (channel < 0 || (size_t)channel >= m_channels.size())
+        return std::string();
+    return m_channels[channel];
+}
+
+int CaptureReader::findChannel(const std::string &name) const
+{
+    for (size_t i = 0; i < m_channels.size(); i++) {
+        if (m_channels[i] == name)
+            return i;
+    }
+    return -1;
+}
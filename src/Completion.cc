@@ -0,0 +1,178 @@
+#include "Completion.h"
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+typedef std::chrono::steady_clock clock_type;
+
+#define PHASE_MASK  3u
+#define PHASE_IDLE  0u
+#define PHASE_ARMED 1u
+#define PHASE_FILL  2u  // a responder is writing the payload
+#define PHASE_DONE  3u
+#define GEN_STEP    4u
+
+static uint32_t *futexWord(std::atomic<uint32_t> &word)
+{
+    return reinterpret_cast<uint32_t *>(&word);
+}
+
+// Sleeps while the word holds `expected`, at most until the deadline.
+// Spurious returns are fine, the callers check again.
+static void futexWait(std::atomic<uint32_t> &word, uint32_t expected, Deadline deadline)
+{
+    clock_type::duration left = deadline - clock_type::now();
+    if (left <= clock_type::duration::zero())
+        return;
+    long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    syscall(SYS_futex, futexWord(word), FUTEX_WAIT_PRIVATE, expected, &ts, nullptr, 0);
+}
+
+static void futexWake(std::atomic<uint32_t> &word)
+{
+    syscall(SYS_futex, futexWord(word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Busy-waits for done() for up to spin_us, but not past the deadline.
+template <typename Done>
+static bool spinUntil(Done done, uint32_t spin_us, Deadline deadline)
+{
+    if (spin_us == 0)
+        return done();
+    Deadline end = clock_type::now() + std::chrono::microseconds(spin_us);
+    if (end > deadline)
+        end = deadline;
+    do {
+        if (done())
+            return true;
+        cpuRelax();
+    } while (clock_type::now() < end);
+    return done();
+}
+
+Doorbell::Doorbell() :
+    m_seq(0),
+    m_waiters(0)
+{
+
+}
+
+// The waiter count is read after the increment and the waiter reads the
+// count after announcing itself (both sequentially consistent), so one of
+// the two always sees the other and no wake-up is lost.
+void Doorbell::ring()
+{
+    m_seq.fetch_add(1);
+    if (m_waiters.load())
+        futexWake(m_seq);
+}
+
+bool Doorbell::wait(uint32_t seen, Deadline deadline, uint32_t spin_us)
+{
+    if (spinUntil([&]{ return m_seq.load(std::memory_order_acquire) != seen; }, spin_us, deadline))
+        return true;
+
+    m_waiters.fetch_add(1);
+    bool rung;
+    while (!(rung = m_seq.load() != seen) && clock_type::now() < deadline)
+        futexWait(m_seq, seen, deadline);
+    m_waiters.fetch_sub(1);
+    return rung;
+}
+
+CompletionSlot::CompletionSlot() :
+    m_state(PHASE_IDLE),
+    m_waiters(0),
+    m_cmd(0),
+    m_response(0),
+    m_status(0),
+    m_value(0),
+    m_rxNs(0)
+{
+
+}
+
+void CompletionSlot::arm(uint8_t cmd, uint8_t response)
+{
+    m_cmd.store(cmd, std::memory_order_relaxed);
+    m_response.store(response, std::memory_order_relaxed);
+
+    // A responder still filling an abandoned request finishes first, so it
+    // never writes over the payload of this one.
+    uint32_t state = m_state.load(std::memory_order_acquire);
+    while (true) {
+        if ((state & PHASE_MASK) == PHASE_FILL) {
+            cpuRelax();
+            state = m_state.load(std::memory_order_acquire);
+            continue;
+        }
+        uint32_t armed = ((state & ~PHASE_MASK) + GEN_STEP) | PHASE_ARMED;
+        if (m_state.compare_exchange_weak(state, armed, std::memory_order_acq_rel))
+            return;
+    }
+}
+
+bool CompletionSlot::complete(uint8_t response, uint8_t echoed, uint8_t status, uint32_t value, uint64_t rx_ns)
+{
+    uint32_t state = m_state.load(std::memory_order_acquire);
+    if ((state & PHASE_MASK) != PHASE_ARMED)
+        return false;
+    if (m_response.load(std::memory_order_relaxed) != response)
+        return false;
+    if (echoed != 0 && echoed != m_cmd.load(std::memory_order_relaxed))
+        return false;
+    if (!m_state.compare_exchange_strong(state, (state & ~PHASE_MASK) | PHASE_FILL, std::memory_order_acq_rel))
+        return false;
+
+    m_status = status;
+    m_value = value;
+    m_rxNs = rx_ns;
+    m_state.store((state & ~PHASE_MASK) | PHASE_DONE);
+    if (m_waiters.load())
+        futexWake(m_state);
+    return true;
+}
+
+bool CompletionSlot::wait(Deadline deadline, uint32_t spin_us)
+{
+    const uint32_t gen = m_state.load(std::memory_order_acquire) & ~PHASE_MASK;
+    const uint32_t done = gen | PHASE_DONE;
+    if (spinUntil([&]{ return m_state.load(std::memory_order_acquire) == done; }, spin_us, deadline))
+        return true;
+
+    m_waiters.fetch_add(1);
+    bool ok = false;
+    while (true) {
+        uint32_t state = m_state.load();
+        if (state == done) {
+            ok = true;
+            break;
+        }
+        if (clock_type::now() >= deadline) {
+            // Closing fails only when a responder got in first; its payload
+            // is then waited for.
+            uint32_t armed = gen | PHASE_ARMED;
+            if (m_state.compare_exchange_strong(armed, gen | PHASE_IDLE))
+                break;
+            cpuRelax();
+            continue;
+        }
+        futexWait(m_state, state, deadline);
+    }
+    m_waiters.fetch_sub(1);
+    return ok;
+}
@@ -0,0 +1,226 @@
+#include "Crc32.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_PCLMUL
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32_HAVE_ARMV8
+#endif
+
+#define POLY 0xEDB88320
+
+typedef uint32_t (*UpdateFn)(uint32_t state, const uint8_t *p, size_t len);
+
+static uint32_t s_table[8][256];
+
+static void initTables()
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (POLY & (0 - (crc & 1)));
+        s_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++)
+            s_table[t][i] = (s_table[t - 1][i] >> 8) ^ s_table[0][s_table[t - 1][i] & 0xFF];
+    }
+}
+
+static uint32_t updateBytes(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len--)
+        crc = (crc >> 8) ^ s_table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+static uint32_t updateSlice8(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = s_table[7][lo & 0xFF] ^ s_table[6][(lo >> 8) & 0xFF] ^
+              s_table[5][(lo >> 16) & 0xFF] ^ s_table[4][lo >> 24] ^
+              s_table[3][hi & 0xFF] ^ s_table[2][(hi >> 8) & 0xFF] ^
+              s_table[1][(hi >> 16) & 0xFF] ^ s_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    return updateBytes(crc, p, len);
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+/*
+ * Carry-less multiplication folding, after Intel's "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction". Folds 64 bytes per
+ * iteration, then reduces to 32 bits with Barrett reduction. Needs at
+ * least 64 bytes; the tail below 16 bytes is left to slice-by-8.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t foldPclmul(uint32_t crc, const uint8_t *p, size_t len)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    p += 64;
+    len -= 64;
+
+    x0 = k1k2;
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+
+        p += 64;
+        len -= 64;
+    }
+
+    /* Fold the four lanes into one. */
+    x0 = k3k4;
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
+        p += 16;
+        len -= 16;
+    }
+
+    /* 128 -> 64 bits. */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x0 = k5k0;
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits. */
+    x0 = poly;
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t updatePclmul(uint32_t crc, const uint8_t *p, size_t len)
+{
+    if (len >= 64) {
+        size_t bulk = len & ~(size_t)15;
+        crc = foldPclmul(crc, p, bulk);
+        p += bulk;
+        len -= bulk;
+    }
+    return updateSlice8(crc, p, len);
+}
+#endif
+
+#ifdef CRC32_HAVE_ARMV8
+__attribute__((target("+crc")))
+static uint32_t updateArmv8(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len && ((uintptr_t)p & 7)) {
+        crc = __crc32b(crc, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32d(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32b(crc, *p++);
+    return crc;
+}
+#endif
+
+static const char *s_engine = "slice-by-8";
+
+static UpdateFn selectEngine()
+{
+    initTables();
+#ifdef CRC32_HAVE_PCLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        s_engine = "pclmul";
+        return updatePclmul;
+    }
+#endif
+#ifdef CRC32_HAVE_ARMV8
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        s_engine = "armv8";
+        return updateArmv8;
+    }
+#endif
+    return updateSlice8;
+}
+
+static UpdateFn engineFn()
+{
+    static const UpdateFn fn = selectEngine();
+    return fn;
+}
+
+void Crc32::update(const void *data, size_t len)
+{
+    m_state = engineFn()(m_state, (const uint8_t *)data, len);
+}
+
+uint32_t Crc32::compute(const void *data, size_t len)
+{
+    return ~engineFn()(0xFFFFFFFF, (const uint8_t *)data, len);
+}
+
+const char *Crc32::engine()
+{
+    engineFn();
+    return s_engine;
+}
@@ -0,0 +1,206 @@
+#include "EventLoop.h"
+#include "log.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 32
+
+EventLoop::EventLoop() :
+    m_epfd(-1),
+    m_wakefd(-1),
+    m_quit(false)
+{
+
+}
+
+EventLoop::~EventLoop()
+{
+    if (m_wakefd != -1 && !this->isStoped())
+        quit();
+
+    std::lock_guard<std::mutex> lock(m_mtx);
+    for (auto &it : m_handlers) {
+        if (it.second->timer)
+            close(it.first);
+    }
+    m_handlers.clear();
+
+    if (m_wakefd != -1)
+        close(m_wakefd);
+    if (m_epfd != -1)
+        close(m_epfd);
+}
+
+int EventLoop::init()
+{
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd == -1) {
+        LOG(ERROR, "epoll_create1 failed: %s", strerror(errno));
+        return -1;
+    }
+
+    m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakefd == -1) {
+        LOG(ERROR, "eventfd failed: %s", strerror(errno));
+        return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = m_wakefd;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev) == -1) {
+        LOG(ERROR, "epoll_ctl wakeup fd failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int EventLoop::addFd(int fd, uint32_t events, FdCallback callback)
+{
+    std::shared_ptr<Handler> handler(new Handler());
+    handler->callback = std::move(callback);
+    handler->timer = false;
+    handler->periodic = false;
+
+    std::lock_guard<std::mutex> lock(m_mtx);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        LOG(ERROR, "epoll_ctl add fd %d failed: %s", fd, strerror(errno));
+        return -1;
+    }
+    m_handlers[fd] = handler;
+    return 0;
+}
+
+int EventLoop::removeFd(int fd)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_handlers.erase(fd) == 0)
+        return -1;
+    return epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int EventLoop::addTimer(int timeout_ms, bool periodic, TimerCallback callback)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        LOG(ERROR, "timerfd_create failed: %s", strerror(errno));
+        return -1;
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = timeout_ms / 1000;
+    spec.it_value.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+        spec.it_value.tv_nsec = 1;
+    if (periodic)
+        spec.it_interval = spec.it_value;
+
+    if (timerfd_settime(fd, 0, &spec, nullptr) == -1) {
+        LOG(ERROR, "timerfd_settime failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    std::shared_ptr<Handler> handler(new Handler());
+    handler->callback = [fd, callback](uint32_t) {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+            callback();
+    };
+    handler->timer = true;
+    handler->periodic = periodic;
+
+    std::lock_guard<std::mutex> lock(m_mtx);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        LOG(ERROR, "epoll_ctl add timer failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    m_handlers[fd] = handler;
+    return fd;
+}
+
+int EventLoop::cancelTimer(int id)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto it = m_handlers.find(id);
+    if (it == m_handlers.end() || !it->second->timer)
+        return -1;
+
+    m_handlers.erase(it);
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, id, nullptr);
+    return close(id);
+}
+
+void EventLoop::wakeup()
+{
+    uint64_t one = 1;
+    if (write(m_wakefd, &one, sizeof(one)) != sizeof(one))
+        LOG(ERROR, "eventfd write failed: %s", strerror(errno));
+}
+
+void EventLoop::quit()
+{
+    m_quit = true;
+    wakeup();
+    this->stop();
+}
+
+void EventLoop::run()
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!m_quit && !this->isStoped()) {
+        int n = epoll_wait(m_epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            LOG(ERROR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n && !m_quit; i++) {
+            int fd = events[i].data.fd;
+            if (fd == m_wakefd) {
+                uint64_t count;
+                while (read(m_wakefd, &count, sizeof(count)) == sizeof(count));
+                continue;
+            }
+
+            std::shared_ptr<Handler> handler;
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                auto it = m_handlers.find(fd);
+                if (it == m_handlers.end())
+                    continue;
+                handler = it->second;
+            }
+
+            handler->callback(events[i].events);
+
+            if (handler->timer && !handler->periodic) {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                auto it = m_handlers.find(fd);
+                if (it != m_handlers.end() && it->second == handler) {
+                    m_handlers.erase(it);
+                    epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, nullptr);
+                    close(fd);
+                }
+            }
+        }
+    }
+}
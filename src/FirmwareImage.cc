@@ -0,0 +1,449 @@
+#include "FirmwareImage.h"
+#include "BootloaderProtocol.h"
+#include "log.h"
+#include <algorithm>
+#include <string>
+#include <elf.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+FirmwareImage::FirmwareImage() :
+    m_data(nullptr),
+    m_size(0),
+    m_mapped(false),
+    m_format(IMAGE_BINARY)
+{
+
+}
+
+FirmwareImage::~FirmwareImage()
+{
+    close();
+}
+
+static bool readAll(int fd, uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, buf + done, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// For files without a usable size: reads until EOF.
+static bool readToEnd(int fd, std::vector<uint8_t> &out)
+{
+    size_t done = 0;
+    while (true) {
+        if (out.size() - done < 4096)
+            out.resize(std::max<size_t>(out.size() * 2, 1 << 16));
+        ssize_t n = read(fd, out.data() + done, out.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    out.resize(done);
+    return true;
+}
+
+static bool hasExtension(const char *path, const char *const *exts)
+{
+    const char *dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/'))
+        return false;
+    for (; *exts; exts++) {
+        if (strcasecmp(dot + 1, *exts) == 0)
+            return true;
+    }
+    return false;
+}
+
+static ImageFormat detectFormat(const char *path, const uint8_t *data, size_t size)
+{
+    static const char *const ihex[] = { "hex", "ihex", "ihx", nullptr };
+    static const char *const srec[] = { "srec", "s19", "s28", "s37", "mot", nullptr };
+
+    if (size >= SELFMAG && memcmp(data, ELFMAG, SELFMAG) == 0)
+        return IMAGE_ELF;
+    if (hasExtension(path, ihex))
+        return IMAGE_IHEX;
+    if (hasExtension(path, srec))
+        return IMAGE_SREC;
+    return IMAGE_BINARY;
+}
+
+// Data of one HEX/S-record line or ELF segment at its absolute address.
+struct LoadRecord {
+    uint64_t address;
+    std::vector<uint8_t> bytes;
+};
+
+static int hexNibble(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+// Decodes the hex digits of one text line into bytes.
+static bool decodeHexLine(const uint8_t *p, size_t len, std::vector<uint8_t> &out)
+{
+    out.clear();
+    if (len % 2)
+        return false;
+    for (size_t i = 0; i < len; i += 2) {
+        int hi = hexNibble(p[i]);
+        int lo = hexNibble(p[i + 1]);
+        if (hi < 0 || lo < 0)
+            return false;
+        out.push_back((hi << 4) | lo);
+    }
+    return true;
+}
+
+// Calls line(text, len, lineno) for every non-empty line without its
+// line ending; stops at the first line that returns false.
+template <typename F>
+static bool forEachLine(const uint8_t *data, size_t size, F line)
+{
+    int lineno = 0;
+    size_t pos = 0;
+    while (pos < size) {
+        size_t end = pos;
+        while (end < size && data[end] != '\n')
+            end++;
+        size_t len = end - pos;
+        while (len > 0 && (data[pos + len - 1] == '\r' || data[pos + len - 1] == ' ' || data[pos + len - 1] == '\t'))
+            len--;
+        lineno++;
+        if (len > 0 && !line(data + pos, len, lineno))
+            return false;
+        pos = end + 1;
+    }
+    return true;
+}
+
+// Intel HEX: data (00), end of file (01), extended segment (02) and linear
+// (04) address records; start address records (03, 05) are ignored.
+static bool parseIhex(const char *path, const uint8_t *data, size_t size, std::vector<LoadRecord> &records)
+{
+    uint64_t base = 0;
+    bool eof = false;
+    std::vector<uint8_t> rec;
+
+    bool ok = forEachLine(data, size, [&](const uint8_t *p, size_t len, int lineno) {
+        if (eof)
+            return true;
+        if (p[0] != ':' || !decodeHexLine(p + 1, len - 1, rec) || rec.size() < 5 || rec.size() != rec[0] + 5u) {
+            LOG(ERROR, "%s:%d: malformed Intel HEX record", path, lineno);
+            return false;
+        }
+        uint8_t sum = 0;
+        for (uint8_t b : rec)
+            sum += b;
+        if (sum != 0) {
+            LOG(ERROR, "%s:%d: Intel HEX checksum error", path, lineno);
+            return false;
+        }
+
+        uint16_t offset = (rec[1] << 8) | rec[2];
+        switch (rec[3]) {
+            case 0x00:
+                records.push_back(LoadRecord{base + offset, std::vector<uint8_t>(rec.begin() + 4, rec.end() - 1)});
+                break;
+            case 0x01:
+                eof = true;
+                break;
+            case 0x02:
+                if (rec[0] != 2) {
+                    LOG(ERROR, "%s:%d: malformed Intel HEX address record", path, lineno);
+                    return false;
+                }
+                base = (uint64_t)((rec[4] << 8) | rec[5]) << 4;
+                break;
+            case 0x04:
+                if (rec[0] != 2) {
+                    LOG(ERROR, "%s:%d: malformed Intel HEX address record", path, lineno);
+                    return false;
+                }
+                base = (uint64_t)((rec[4] << 8) | rec[5]) << 16;
+                break;
+            case 0x03:
+            case 0x05:
+                break;
+            default:
+                LOG(ERROR, "%s:%d: unknown Intel HEX record type 0x%02X", path, lineno, rec[3]);
+                return false;
+        }
+        return true;
+    });
+    if (ok && !eof)
+        LOG(WARN, "%s: no Intel HEX end-of-file record", path);
+    return ok;
+}
+
+// Motorola S-record: S1/S2/S3 data records with 16/24/32-bit addresses;
+// header, count and start address records are skipped.
+static bool parseSrec(const char *path, const uint8_t *data, size_t size, std::vector<LoadRecord> &records)
+{
+    std::vector<uint8_t> rec;
+
+    return forEachLine(data, size, [&](const uint8_t *p, size_t len, int lineno) {
+        if (len < 4 || p[0] != 'S' || p[1] < '0' || p[1] > '9' ||
+            !decodeHexLine(p + 2, len - 2, rec) || rec.size() < 2 || rec.size() != rec[0] + 1u) {
+            LOG(ERROR, "%s:%d: malformed S-record", path, lineno);
+            return false;
+        }
+        uint8_t sum = 0;
+        for (size_t i = 0; i + 1 < rec.size(); i++)
+            sum += rec[i];
+        if ((uint8_t)~sum != rec.back()) {
+            LOG(ERROR, "%s:%d: S-record checksum error", path, lineno);
+            return false;
+        }
+
+        int type = p[1] - '0';
+        if (type < 1 || type > 3)
+            return true;
+        size_t addr_len = type + 1;
+        if (rec.size() < addr_len + 2) {
+            LOG(ERROR, "%s:%d: malformed S-record", path, lineno);
+            return false;
+        }
+        uint64_t address = 0;
+        for (size_t i = 0; i < addr_len; i++)
+            address = (address << 8) | rec[1 + i];
+        records.push_back(LoadRecord{address, std::vector<uint8_t>(rec.begin() + 1 + addr_len, rec.end() - 1)});
+        return true;
+    });
+}
+
+// PT_LOAD segments of an ELF file of the given class, or its allocated
+// sections when it has no program headers (relocatable objects).
+template <typename Ehdr, typename Phdr, typename Shdr>
+static bool parseElfSegments(const char *path, const uint8_t *data, size_t size, std::vector<LoadRecord> &records)
+{
+    if (size < sizeof(Ehdr)) {
+        LOG(ERROR, "%s: truncated ELF header", path);
+        return false;
+    }
+    Ehdr eh;
+    memcpy(&eh, data, sizeof(eh));
+
+    if (eh.e_phnum > 0) {
+        if (eh.e_phentsize != sizeof(Phdr) || eh.e_phoff > size ||
+            (uint64_t)eh.e_phnum * sizeof(Phdr) > size - eh.e_phoff) {
+            LOG(ERROR, "%s: bad ELF program header table", path);
+            return false;
+        }
+        for (size_t i = 0; i < eh.e_phnum; i++) {
+            Phdr ph;
+            memcpy(&ph, data + eh.e_phoff + i * sizeof(Phdr), sizeof(ph));
+            if (ph.p_type != PT_LOAD || ph.p_filesz == 0)
+                continue;
+            if (ph.p_offset > size || ph.p_filesz > size - ph.p_offset) {
+                LOG(ERROR, "%s: ELF segment %zu lies outside the file", path, i);
+                return false;
+            }
+            // The load address (LMA): initialised data is copied to RAM from here.
+            const uint8_t *src = data + ph.p_offset;
+            records.push_back(LoadRecord{(uint64_t)ph.p_paddr, std::vector<uint8_t>(src, src + ph.p_filesz)});
+        }
+        return true;
+    }
+
+    if (eh.e_shnum == 0 || eh.e_shentsize != sizeof(Shdr) || eh.e_shoff > size ||
+        (uint64_t)eh.e_shnum * sizeof(Shdr) > size - eh.e_shoff) {
+        LOG(ERROR, "%s: ELF file has neither program nor section headers", path);
+        return false;
+    }
+    for (size_t i = 0; i < eh.e_shnum; i++) {
+        Shdr sh;
+        memcpy(&sh, data + eh.e_shoff + i * sizeof(Shdr), sizeof(sh));
+        if (!(sh.sh_flags & SHF_ALLOC) || sh.sh_type == SHT_NOBITS || sh.sh_size == 0)
+            continue;
+        if (sh.sh_offset > size || sh.sh_size > size - sh.sh_offset) {
+            LOG(ERROR, "%s: ELF section %zu lies outside the file", path, i);
+            return false;
+        }
+        const uint8_t *src = data + sh.sh_offset;
+        records.push_back(LoadRecord{(uint64_t)sh.sh_addr, std::vector<uint8_t>(src, src + sh.sh_size)});
+    }
+    return true;
+}
+
+// Loadable segments of a little-endian 32- or 64-bit ELF file.
+static bool parseElf(const char *path, const uint8_t *data, size_t size, std::vector<LoadRecord> &records)
+{
+    if (size < EI_NIDENT || data[EI_DATA] != ELFDATA2LSB) {
+        LOG(ERROR, "%s: only little-endian ELF files are supported", path);
+        return false;
+    }
+    if (data[EI_CLASS] == ELFCLASS32)
+        return parseElfSegments<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr>(path, data, size, records);
+    if (data[EI_CLASS] == ELFCLASS64)
+        return parseElfSegments<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr>(path, data, size, records);
+    LOG(ERROR, "%s: unknown ELF class %d", path, data[EI_CLASS]);
+    return false;
+}
+
+int FirmwareImage::open(const char *path)
+{
+    close();
+
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        LOG(ERROR, "open %s error: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        LOG(ERROR, "fstat %s error: %s", path, strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    m_size = st.st_size;
+    if (!S_ISREG(st.st_mode) || m_size == 0) {
+        // Pipes and devices have no size to map.
+        std::vector<uint8_t> buf;
+        if (!readToEnd(fd, buf)) {
+            LOG(ERROR, "read %s error: %s", path, strerror(errno));
+            ::close(fd);
+            return -1;
+        }
+        m_size = buf.size();
+        if (m_size > 0) {
+            m_data = new uint8_t[m_size];
+            memcpy(m_data, buf.data(), m_size);
+        }
+    } else {
+        void *map = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, m_size, MADV_SEQUENTIAL);
+            m_data = (uint8_t *)map;
+            m_mapped = true;
+        } else {
+            m_data = new uint8_t[m_size];
+            if (!readAll(fd, m_data, m_size)) {
+                LOG(ERROR, "read %s error: %s", path, strerror(errno));
+                ::close(fd);
+                close();
+                return -1;
+            }
+        }
+    }
+    ::close(fd);
+    if (m_size == 0)
+        return 0;
+
+    m_format = detectFormat(path, m_data, m_size);
+    if (m_format != IMAGE_BINARY)
+        return flatten(path);
+    m_segments.push_back(ImageSegment{0, m_size});
+    return 0;
+}
+
+const char *FirmwareImage::formatName() const
+{
+    switch (m_format) {
+        case IMAGE_IHEX: return "Intel HEX";
+        case IMAGE_SREC: return "S-record";
+        case IMAGE_ELF:  return "ELF";
+        default:         return "binary";
+    }
+}
+
+// Parses the records of a HEX, S-record or ELF file into one buffer that
+// starts at APP_START, 0xFF in between, and replaces the file contents.
+int FirmwareImage::flatten(const char *path)
+{
+    std::vector<LoadRecord> records;
+    bool ok;
+    if (m_format == IMAGE_IHEX)
+        ok = parseIhex(path, m_data, m_size, records);
+    else if (m_format == IMAGE_SREC)
+        ok = parseSrec(path, m_data, m_size, records);
+    else
+        ok = parseElf(path, m_data, m_size, records);
+    if (!ok) {
+        close();
+        return -1;
+    }
+
+    std::stable_sort(records.begin(), records.end(), [](const LoadRecord &a, const LoadRecord &b) {
+        return a.address < b.address;
+    });
+
+    std::vector<ImageSegment> segments;
+    for (const LoadRecord &r : records) {
+        if (r.bytes.empty())
+            continue;
+        if (r.address < APP_START || r.address + r.bytes.size() > APP_END) {
+            LOG(ERROR, "%s: data at 0x%08llX-0x%08llX is outside the application flash (0x%08X-0x%08X)",
+                path, (unsigned long long)r.address, (unsigned long long)(r.address + r.bytes.size() - 1),
+                APP_START, APP_END - 1);
+            close();
+            return -1;
+        }
+        size_t offset = r.address - APP_START;
+        if (!segments.empty() && offset <= segments.back().offset + segments.back().length) {
+            ImageSegment &last = segments.back();
+            last.length = std::max(last.length, offset + r.bytes.size() - last.offset);
+        } else {
+            segments.push_back(ImageSegment{offset, r.bytes.size()});
+        }
+    }
+    if (segments.empty()) {
+        LOG(ERROR, "%s: no data records", path);
+        close();
+        return -1;
+    }
+
+    size_t size = segments.back().offset + segments.back().length;
+    uint8_t *flat = new uint8_t[size];
+    memset(flat, 0xFF, size);
+    for (const LoadRecord &r : records)
+        memcpy(flat + (r.address - APP_START), r.bytes.data(), r.bytes.size());
+
+    ImageFormat format = m_format;
+    close();
+    m_data = flat;
+    m_size = size;
+    m_format = format;
+    m_segments.swap(segments);
+    return 0;
+}
+
+void FirmwareImage::close()
+{
+    if (m_data) {
+        if (m_mapped)
+            munmap(m_data, m_size);
+        else
+            delete[] m_data;
+    }
+    m_data = nullptr;
+    m_size = 0;
+    m_mapped = false;
+    m_format = IMAGE_BINARY;
+    m_segments.clear();
+}
@@ -0,0 +1,96 @@
+#include "Histogram.h"
+
+#define SUB_BITS    4
+#define SUB_COUNT   (1 << SUB_BITS)
+#define MAX_BITS    32
+#define BUCKETS     ((MAX_BITS - SUB_BITS + 1) * SUB_COUNT)
+
+Histogram::Histogram() :
+    m_buckets(BUCKETS, 0),
+    m_count(0),
+    m_sum(0),
+    m_min(0),
+    m_max(0)
+{
+
+}
+
+size_t Histogram::bucketOf(uint64_t value)
+{
+    if (value < SUB_COUNT)
+        return value;
+    if (value >= (1ULL << MAX_BITS))
+        return BUCKETS - 1;
+
+    int msb = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (msb - SUB_BITS)) & (SUB_COUNT - 1);
+    return (msb - SUB_BITS + 1) * SUB_COUNT + sub;
+}
+
+uint64_t Histogram::bucketLimit(size_t bucket)
+{
+    if (bucket < SUB_COUNT)
+        return bucket;
+
+    int msb = bucket / SUB_COUNT + SUB_BITS - 1;
+    uint64_t sub = bucket % SUB_COUNT;
+    uint64_t lower = (1ULL << msb) | (sub << (msb - SUB_BITS));
+    return lower + (1ULL << (msb - SUB_BITS)) - 1;
+}
+
+void Histogram::record(uint64_t value)
+{
+    m_buckets[bucketOf(value)]++;
+    if (m_count == 0 || value < m_min)
+        m_min = value;
+    if (value > m_max)
+        m_max = value;
+    m_count++;
+    m_sum += value;
+}
+
+void Histogram::merge(const Histogram &other)
+{
+    if (other.m_count == 0)
+        return;
+
+    for (size_t i = 0; i < BUCKETS; i++)
+        m_buckets[i] += other.m_buckets[i];
+    if (m_count == 0 || other.m_min < m_min)
+        m_min = other.m_min;
+    if (other.m_max > m_max)
+        m_max = other.m_max;
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+}
+
+void Histogram::reset()
+{
+    m_buckets.assign(BUCKETS, 0);
+    m_count = 0;
+    m_sum = 0;
+    m_min = 0;
+    m_max = 0;
+}
+
+uint64_t Histogram::percentile(double p) const
+{
+    if (m_count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(p / 100.0 * m_count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > m_count)
+        rank = m_count;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        seen += m_buckets[i];
+        if (seen >= rank && i < BUCKETS - 1) {
+            uint64_t limit = bucketLimit(i);
+            return limit < m_max ? limit : m_max;
+        }
+    }
+    return m_max;
+}
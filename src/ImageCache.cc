@@ -0,0 +1,389 @@
+#include "ImageCache.h"
+#include "BootloaderSession.h"
+#include "Crc32.h"
+#include "Lz4.h"
+#include "can.h"
+#include "log.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Frame file: header, then per frame its length and that many data bytes.
+#define FRAME_FILE_MAGIC    0x52464C42  // "BLFR"
+#define FRAME_FILE_VERSION  1
+
+struct FrameFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;
+    uint64_t size;
+    uint32_t count;
+    uint8_t cmd;
+    uint8_t chunk;
+    uint8_t fd;
+    uint8_t reserved;
+    uint32_t lz4_page;
+};
+
+// Files of the other derived items: header, then `length` raw bytes.
+#define BLOB_FILE_MAGIC     0x42434C42  // "BLCB"
+#define BLOB_FILE_VERSION   1
+
+struct BlobFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;
+    uint64_t size;
+    uint64_t length;
+};
+
+static std::mutex s_cacheMtx;
+static std::map<std::pair<uint64_t, size_t>, std::shared_ptr<const PreparedImage>> s_images;
+static std::string s_directory;
+
+PreparedImage::PreparedImage(const std::shared_ptr<const FirmwareImage> &image) :
+    m_image(image),
+    m_hash(ImageCache::hash(image->view())),
+    m_haveCrc(false),
+    m_crc(0)
+{
+
+}
+
+uint32_t PreparedImage::crc() const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_haveCrc)
+        return m_crc;
+
+    std::string path = cachePath("crc", 0);
+    std::vector<uint8_t> blob;
+    if (!path.empty() && loadBlob(path, blob) && blob.size() == sizeof(m_crc)) {
+        memcpy(&m_crc, blob.data(), sizeof(m_crc));
+    } else {
+        m_crc = Crc32::compute(m_image->data(), size());
+        if (!path.empty())
+            saveBlob(path, (const uint8_t *)&m_crc, sizeof(m_crc));
+    }
+    m_haveCrc = true;
+    return m_crc;
+}
+
+const std::vector<uint32_t> &PreparedImage::pageCrcs(size_t page) const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    std::unique_ptr<std::vector<uint32_t>> &crcs = m_pageCrcs[page];
+    if (crcs)
+        return *crcs;
+
+    crcs.reset(new std::vector<uint32_t>());
+    size_t count = (size() + page - 1) / page;
+    std::string path = cachePath("pages", page);
+    std::vector<uint8_t> blob;
+    if (!path.empty() && loadBlob(path, blob) && blob.size() == count * sizeof(uint32_t)) {
+        crcs->resize(count);
+        memcpy(crcs->data(), blob.data(), blob.size());
+        return *crcs;
+    }
+    BootloaderSession::localPageCrcs(view(), page, *crcs);
+    if (!path.empty())
+        saveBlob(path, (const uint8_t *)crcs->data(), crcs->size() * sizeof(uint32_t));
+    return *crcs;
+}
+
+const Lz4Stream &PreparedImage::lz4(size_t page) const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return lz4Stream(page);
+}
+
+// Stored as the number of page offsets, the offsets (64 bit each) and the
+// stream. Called with m_mtx held.
+const Lz4Stream &PreparedImage::lz4Stream(size_t page) const
+{
+    std::unique_ptr<Lz4Stream> &stream = m_lz4[page];
+    if (stream)
+        return *stream;
+
+    stream.reset(new Lz4Stream());
+    size_t pages = (size() + page - 1) / page;
+    std::string path = cachePath("lz4", page);
+    std::vector<uint8_t> blob;
+    if (!path.empty() && loadBlob(path, blob) && blob.size() >= sizeof(uint64_t)) {
+        uint64_t count;
+        memcpy(&count, blob.data(), sizeof(count));
+        size_t head = sizeof(count) + count * sizeof(uint64_t);
+        if (count == pages + 1 && blob.size() >= head) {
+            stream->offsets.resize(count);
+            for (size_t i = 0; i < count; i++) {
+                uint64_t offset;
+                memcpy(&offset, &blob[sizeof(count) + i * sizeof(offset)], sizeof(offset));
+                stream->offsets[i] = offset;
+            }
+            stream->data.assign(blob.begin() + head, blob.end());
+            if (stream->offsets.back() == stream->data.size())
+                return *stream;
+        }
+        LOG(WARN, "Ignoring damaged cache %s", path.c_str());
+        stream->offsets.clear();
+        stream->data.clear();
+    }
+
+    for (size_t offset = 0; offset < size(); offset += page) {
+        stream->offsets.push_back(stream->data.size());
+        size_t len = std::min(page, size() - offset);
+        Lz4::compressStream(m_image->data() + offset, len, page, stream->data);
+    }
+    stream->offsets.push_back(stream->data.size());
+
+    if (!path.empty()) {
+        blob.clear();
+        uint64_t count = stream->offsets.size();
+        blob.insert(blob.end(), (const uint8_t *)&count, (const uint8_t *)&count + sizeof(count));
+        for (size_t offset : stream->offsets) {
+            uint64_t value = offset;
+            blob.insert(blob.end(), (const uint8_t *)&value, (const uint8_t *)&value + sizeof(value));
+        }
+        blob.insert(blob.end(), stream->data.begin(), stream->data.end());
+        saveBlob(path, blob.data(), blob.size());
+    }
+    return *stream;
+}
+
+bool PreparedImage::encodeFrame(const ImageView &buf, size_t i, uint8_t cmd, size_t chunk, bool fd,
+                                struct canfd_frame &tx)
+{
+    size_t offset = i * chunk;
+    size_t len = chunk;
+    // Legacy-sized words are always padded to 4 bytes, full frames only
+    // carry what is left.
+    if (cmd == 0x08 && offset + len > buf.size())
+        len = buf.size() - offset;
+    if (2 + len > (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN)) {
+        LOG(ERROR, "Chunk of %zu bytes does not fit a CAN%s frame", len, fd ? " FD" : "");
+        return false;
+    }
+
+    memset(&tx, 0, sizeof(tx));
+    tx.can_id = cmd;
+    if (fd) {
+        tx.len = Can::fdLength(2 + len);
+        tx.flags = CANFD_BRS;
+    } else {
+        tx.len = 2 + len;
+    }
+    memset(tx.data, 0xFF, tx.len);
+    tx.data[0] = (i >> 8) & 0xFF;
+    tx.data[1] = i & 0xFF;
+    if (offset < buf.size())
+        memcpy(tx.data + 2, buf.data + offset, std::min(len, buf.size() - offset));
+    return true;
+}
+
+// The frame file is tried before anything is encoded, so a hit does not
+// compress the image either.
+const std::vector<struct canfd_frame> &PreparedImage::frames(uint8_t cmd, size_t chunk, bool fd, size_t lz4Page) const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    uint64_t key = cmd | ((uint64_t)chunk << 8) | ((uint64_t)fd << 16) | ((uint64_t)lz4Page << 24);
+    std::unique_ptr<std::vector<struct canfd_frame>> &frames = m_frames[key];
+    if (frames)
+        return *frames;
+
+    frames.reset(new std::vector<struct canfd_frame>());
+    std::string dir = ImageCache::directory();
+    char name[128];
+    snprintf(name, sizeof(name), "/%016llx-%zx.%02x.%zu.%s.%zu.frames", (unsigned long long)m_hash, size(),
+             cmd, chunk, fd ? "fd" : "cl", lz4Page);
+    std::string path = dir.empty() ? std::string() : dir + name;
+    if (!path.empty() && loadFrames(path, *frames, cmd, chunk, fd, lz4Page))
+        return *frames;
+
+    ImageView payload = view();
+    if (lz4Page) {
+        const Lz4Stream &stream = lz4Stream(lz4Page);
+        payload = ImageView(stream.data.data(), stream.data.size());
+    }
+    size_t count = (payload.size() + chunk - 1) / chunk;
+    frames->resize(count);
+    for (size_t i = 0; i < count; i++) {
+        if (!encodeFrame(payload, i, cmd, chunk, fd, (*frames)[i])) {
+            frames->clear();
+            return *frames;
+        }
+    }
+    if (!path.empty())
+        saveFrames(path, *frames, cmd, chunk, fd, lz4Page);
+    return *frames;
+}
+
+// "<dir>/<hash>-<size>.<kind>.<param>", or "" without a cache directory.
+std::string PreparedImage::cachePath(const char *kind, size_t param) const
+{
+    std::string dir = ImageCache::directory();
+    if (dir.empty())
+        return std::string();
+    char name[128];
+    snprintf(name, sizeof(name), "/%016llx-%zx.%s.%zu", (unsigned long long)m_hash, size(), kind, param);
+    return dir + name;
+}
+
+bool PreparedImage::loadBlob(const std::string &path, std::vector<uint8_t> &blob) const
+{
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in)
+        return false;
+
+    BlobFileHeader hdr;
+    bool ok = fread(&hdr, sizeof(hdr), 1, in) == 1 && hdr.magic == BLOB_FILE_MAGIC &&
+              hdr.version == BLOB_FILE_VERSION && hdr.hash == m_hash && hdr.size == size();
+    if (ok) {
+        blob.resize(hdr.length);
+        ok = fread(blob.data(), 1, blob.size(), in) == blob.size();
+    }
+    fclose(in);
+
+    if (!ok) {
+        LOG(WARN, "Ignoring damaged cache %s", path.c_str());
+        blob.clear();
+    }
+    return ok;
+}
+
+// Written like saveFrames().
+void PreparedImage::saveBlob(const std::string &path, const uint8_t *data, size_t len) const
+{
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    FILE *out = fopen(tmp.c_str(), "wb");
+    if (!out) {
+        LOG(WARN, "Cannot write cache %s: %s", tmp.c_str(), strerror(errno));
+        return;
+    }
+
+    BlobFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = BLOB_FILE_MAGIC;
+    hdr.version = BLOB_FILE_VERSION;
+    hdr.hash = m_hash;
+    hdr.size = size();
+    hdr.length = len;
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1 && fwrite(data, 1, len, out) == len;
+    ok = fclose(out) == 0 && ok;
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOG(WARN, "Cannot write cache %s: %s", path.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+    }
+}
+
+bool PreparedImage::loadFrames(const std::string &path, std::vector<struct canfd_frame> &frames, uint8_t cmd,
+                               size_t chunk, bool fd, size_t lz4Page) const
+{
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in)
+        return false;
+
+    FrameFileHeader hdr;
+    bool ok = fread(&hdr, sizeof(hdr), 1, in) == 1 && hdr.magic == FRAME_FILE_MAGIC &&
+              hdr.version == FRAME_FILE_VERSION && hdr.hash == m_hash && hdr.size == size() &&
+              hdr.cmd == cmd && hdr.chunk == chunk && hdr.fd == fd && hdr.lz4_page == lz4Page;
+    if (ok) {
+        frames.resize(hdr.count);
+        for (uint32_t i = 0; ok && i < hdr.count; i++) {
+            struct canfd_frame &tx = frames[i];
+            memset(&tx, 0, sizeof(tx));
+            ok = fread(&tx.len, 1, 1, in) == 1 && tx.len <= CANFD_MAX_DLEN && fread(tx.data, 1, tx.len, in) == tx.len;
+            tx.can_id = cmd;
+            tx.flags = fd ? CANFD_BRS : 0;
+        }
+    }
+    fclose(in);
+
+    if (!ok) {
+        LOG(WARN, "Ignoring damaged frame cache %s", path.c_str());
+        frames.clear();
+    }
+    return ok;
+}
+
+// Written to a temporary file and renamed, so concurrent uploaders never
+// read a partial file.
+void PreparedImage::saveFrames(const std::string &path, const std::vector<struct canfd_frame> &frames, uint8_t cmd,
+                               size_t chunk, bool fd, size_t lz4Page) const
+{
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    FILE *out = fopen(tmp.c_str(), "wb");
+    if (!out) {
+        LOG(WARN, "Cannot write frame cache %s: %s", tmp.c_str(), strerror(errno));
+        return;
+    }
+
+    FrameFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = FRAME_FILE_MAGIC;
+    hdr.version = FRAME_FILE_VERSION;
+    hdr.hash = m_hash;
+    hdr.size = size();
+    hdr.count = frames.size();
+    hdr.cmd = cmd;
+    hdr.chunk = chunk;
+    hdr.fd = fd;
+    hdr.lz4_page = lz4Page;
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+    for (size_t i = 0; ok && i < frames.size(); i++)
+        ok = fwrite(&frames[i].len, 1, 1, out) == 1 && fwrite(frames[i].data, 1, frames[i].len, out) == frames[i].len;
+    ok = fclose(out) == 0 && ok;
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOG(WARN, "Cannot write frame cache %s: %s", path.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+    }
+}
+
+uint64_t ImageCache::hash(const ImageView &image)
+{
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < image.size(); i++) {
+        h ^= image.data[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+// A later prepare() of the same contents gets the cached copy with
+// everything encoded so far; the bytes are compared in case of a hash
+// collision.
+std::shared_ptr<const PreparedImage> ImageCache::prepare(const std::shared_ptr<const FirmwareImage> &image)
+{
+    std::pair<uint64_t, size_t> key(hash(image->view()), image->size());
+
+    std::lock_guard<std::mutex> lock(s_cacheMtx);
+    std::shared_ptr<const PreparedImage> prepared = s_images[key];
+    if (prepared && memcmp(prepared->view().data, image->data(), image->size()) == 0)
+        return prepared;
+
+    prepared = std::make_shared<const PreparedImage>(image);
+    s_images[key] = prepared;
+    return prepared;
+}
+
+void ImageCache::setDirectory(const std::string &dir)
+{
+    std::lock_guard<std::mutex> lock(s_cacheMtx);
+    s_directory = dir;
+    while (s_directory.size() > 1 && s_directory.back() == '/')
+        s_directory.pop_back();
+}
+
+std::string ImageCache::directory()
+{
+    std::lock_guard<std::mutex> lock(s_cacheMtx);
+    return s_directory;
+}
+
+void ImageCache::clear()
+{
+    std::lock_guard<std::mutex> lock(s_cacheMtx);
+    s_images.clear();
+}
@@ -0,0 +1,176 @@
+#include "Lz4.h"
+#include <string.h>
+
+#define MIN_MATCH       4
+#define LAST_LITERALS   5   // the block always ends with this many literals
+#define MF_LIMIT        12  // no match may start closer to the end
+#define MAX_OFFSET      65535
+#define HASH_BITS       12
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Writes a length extension: 255 per byte until the rest is below 255.
+static bool putLength(uint8_t *dst, size_t cap, size_t &op, size_t len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op >= cap)
+            return false;
+        dst[op++] = 255;
+    }
+    if (op >= cap)
+        return false;
+    dst[op++] = len;
+    return true;
+}
+
+// One sequence: literals [anchor, anchor + lit), then a match of mlen bytes
+// at `offset` back, or none when mlen is 0 (the last sequence).
+static bool putSequence(uint8_t *dst, size_t cap, size_t &op, const uint8_t *lit, size_t lit_len,
+                        size_t offset, size_t mlen)
+{
+    if (op >= cap)
+        return false;
+    size_t token = op++;
+    dst[token] = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15 && !putLength(dst, cap, op, lit_len - 15))
+        return false;
+    if (lit_len > cap - op)
+        return false;
+    memcpy(dst + op, lit, lit_len);
+    op += lit_len;
+    if (mlen == 0)
+        return true;
+
+    if (cap - op < 2)
+        return false;
+    dst[op++] = offset & 0xFF;
+    dst[op++] = offset >> 8;
+    size_t m = mlen - MIN_MATCH;
+    dst[token] |= m >= 15 ? 15 : m;
+    if (m >= 15 && !putLength(dst, cap, op, m - 15))
+        return false;
+    return true;
+}
+
+size_t Lz4::compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    // Positions + 1, 0 = empty slot.
+    uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t op = 0;
+    size_t anchor = 0;
+    if (len > MF_LIMIT) {
+        const size_t limit = len - MF_LIMIT;
+        const size_t match_end = len - LAST_LITERALS;
+        size_t ip = 0;
+        while (ip < limit) {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash(seq);
+            size_t ref = table[h];
+            table[h] = ip + 1;
+            if (ref == 0 || ip - (ref - 1) > MAX_OFFSET || read32(src + ref - 1) != seq) {
+                ip++;
+                continue;
+            }
+            ref--;
+
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            size_t mlen = MIN_MATCH;
+            while (ip + mlen < match_end && src[ip + mlen] == src[ref + mlen])
+                mlen++;
+
+            if (!putSequence(dst, cap, op, src + anchor, ip - anchor, ip - ref, mlen))
+                return 0;
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+
+    if (!putSequence(dst, cap, op, src + anchor, len - anchor, 0, 0))
+        return 0;
+    return op;
+}
+
+long Lz4::decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len)
+                    return -1;
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > len - ip || lit > cap - op)
+            return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == len)
+            break;
+
+        if (len - ip < 2)
+            return -1;
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op)
+            return -1;
+
+        size_t mlen = token & 0x0F;
+        if (mlen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len)
+                    return -1;
+                b = src[ip++];
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += MIN_MATCH;
+        if (mlen > cap - op)
+            return -1;
+        // Byte by byte: the match may overlap the bytes it produces.
+        for (size_t i = 0; i < mlen; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
+
+void Lz4::compressStream(const uint8_t *src, size_t len, size_t block, std::vector<uint8_t> &out)
+{
+    if (block > LZ4_RECORD_MAX)
+        block = LZ4_RECORD_MAX;
+    std::vector<uint8_t> tmp(block);
+    for (size_t pos = 0; pos < len; pos += block) {
+        size_t n = len - pos < block ? len - pos : block;
+        size_t packed = compress(src + pos, n, tmp.data(), n - 1);
+        uint16_t header = packed ? packed : (n | LZ4_STORED);
+        out.push_back(header >> 8);
+        out.push_back(header & 0xFF);
+        if (packed)
+            out.insert(out.end(), tmp.begin(), tmp.begin() + packed);
+        else
+            out.insert(out.end(), src + pos, src + pos + n);
+    }
+}
@@ -1,8 +1,12 @@
 #include "MThread.h"
 #include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
 
 
-MThread::MThread() {}
+MThread::MThread() : stopState(false) {}
 
 MThread::~MThread()
 {
@@ -15,12 +19,78 @@ MThread::~MThread()
     }
 }
 
+void MThread::setAttributes(const ThreadAttributes &attr)
+{
+    this->threadAttr = attr;
+}
+
+const ThreadAttributes &MThread::attributes() const
+{
+    return this->threadAttr;
+}
+
 void MThread::start()
 {
-    std::thread thr(&MThread::run, this);
+    this->stopState = false;
+    std::thread thr(&MThread::entry, this);
     this->th = std::move(thr);
 }
 
+void MThread::entry()
+{
+    applyAttributes(this->threadAttr);
+    this->run();
+}
+
+bool MThread::applyAttributes(const ThreadAttributes &attr)
+{
+    bool ok = true;
+    pthread_t self = pthread_self();
+
+    if (!attr.name.empty()) {
+        // The kernel limit is 16 bytes including the terminator.
+        std::string name = attr.name.substr(0, 15);
+        int err = pthread_setname_np(self, name.c_str());
+        if (err) {
+            LOG(WARN, "Cannot name thread %s: %s", name.c_str(), strerror(err));
+            ok = false;
+        }
+    }
+
+    if (!attr.cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : attr.cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE)
+                CPU_SET(cpu, &set);
+        }
+        int err = pthread_setaffinity_np(self, sizeof(set), &set);
+        if (err) {
+            LOG(WARN, "Cannot set CPU affinity of thread %s: %s", attr.name.c_str(), strerror(err));
+            ok = false;
+        }
+    }
+
+    if (attr.policy != SCHED_OTHER) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = attr.priority;
+        int err = pthread_setschedparam(self, attr.policy, &param);
+        if (err) {
+            LOG(WARN, "Cannot set %s priority %d of thread %s: %s", attr.policy == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO",
+                attr.priority, attr.name.c_str(), strerror(err));
+            ok = false;
+        }
+    }
+
+    // Process wide; repeating it from every thread does no harm.
+    if (attr.lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        LOG(WARN, "Cannot lock memory: %s", strerror(errno));
+        ok = false;
+    }
+    return ok;
+}
+
 void MThread::stop()
 {
     this->stopState = true;
@@ -0,0 +1,398 @@
+#include "Metrics.h"
+#include "BootloaderBus.h"
+#include "BootloaderSession.h"
+#include "EventLoop.h"
+#include "can.h"
+#include "log.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <functional>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define METRICS_REQUEST_MAX 1024
+#define METRICS_CLIENT_TIMEOUT_MS 1000
+
+static const char *stateName(int state)
+{
+    switch (state) {
+        case SESSION_RUNNING: return "running";
+        case SESSION_DONE: return "done";
+        case SESSION_FAILED: return "failed";
+        default: return "idle";
+    }
+}
+
+static std::string escape(const std::string &str)
+{
+    std::string out;
+    for (char ch : str) {
+        if (ch == '"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if ((unsigned char)ch < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", ch);
+            out += esc;
+        } else {
+            out += ch;
+        }
+    }
+    return out;
+}
+
+static void append(std::string &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(std::string &out, const char *fmt, ...)
+{
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len > 0)
+        out.append(buf, (size_t)len < sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+// Sessions that never sent anything are left out of both exports.
+static bool isActive(BootloaderSession *session)
+{
+    return session->state() != SESSION_IDLE || session->stats().commands > 0 || session->stats().frames > 0;
+}
+
+static uint64_t busRetransmits(BootloaderBus *bus)
+{
+    uint64_t total = 0;
+    for (int node = 0; node < NODE_COUNT; node++)
+        total += bus->session(node)->stats().retransmits;
+    return total;
+}
+
+static uint64_t busTimeouts(BootloaderBus *bus)
+{
+    uint64_t total = 0;
+    for (int node = 0; node < NODE_COUNT; node++)
+        total += bus->session(node)->stats().timeouts;
+    return total;
+}
+
+Metrics::Metrics(uint32_t bitrate) :
+    m_bitrate(bitrate),
+    m_sampled(std::chrono::steady_clock::now())
+{
+
+}
+
+double Metrics::busBits(uint64_t frames, uint64_t bytes)
+{
+    return frames * (double)FRAME_OVERHEAD_BITS + bytes * 8.0;
+}
+
+void Metrics::addBus(BootloaderBus *bus)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    Entry entry;
+    entry.bus = bus;
+    entry.tx_frames = bus->stats().tx_frames;
+    entry.tx_bytes = bus->stats().tx_bytes;
+    entry.rx_frames = bus->stats().rx_frames;
+    entry.rx_bytes = bus->stats().rx_bytes;
+    for (int node = 0; node < NODE_COUNT; node++)
+        entry.node_done[node] = bus->session(node)->bytesDone();
+    m_buses.push_back(entry);
+}
+
+void Metrics::sample()
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - m_sampled).count();
+    if (elapsed <= 0)
+        return;
+    m_sampled = now;
+
+    for (Entry &e : m_buses) {
+        BusStats &st = e.bus->stats();
+        uint64_t tx_frames = st.tx_frames;
+        uint64_t tx_bytes = st.tx_bytes;
+        uint64_t rx_frames = st.rx_frames;
+        uint64_t rx_bytes = st.rx_bytes;
+
+        e.rates.tx_frames = (tx_frames - e.tx_frames) / elapsed;
+        e.rates.rx_frames = (rx_frames - e.rx_frames) / elapsed;
+        e.rates.tx_bytes = (tx_bytes - e.tx_bytes) / elapsed;
+        e.rates.rx_bytes = (rx_bytes - e.rx_bytes) / elapsed;
+        double bits = busBits(tx_frames - e.tx_frames + rx_frames - e.rx_frames,
+                              tx_bytes - e.tx_bytes + rx_bytes - e.rx_bytes);
+        e.rates.load = m_bitrate ? bits / (m_bitrate * elapsed) : 0;
+
+        e.tx_frames = tx_frames;
+        e.tx_bytes = tx_bytes;
+        e.rx_frames = rx_frames;
+        e.rx_bytes = rx_bytes;
+
+        // The progress restarts at 0 with every operation.
+        for (int node = 0; node < NODE_COUNT; node++) {
+            size_t done = e.bus->session(node)->bytesDone();
+            size_t delta = done >= e.node_done[node] ? done - e.node_done[node] : done;
+            e.rates.node_bytes[node] = delta / elapsed;
+            e.node_done[node] = done;
+        }
+    }
+}
+
+std::string Metrics::json()
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+
+    std::string out;
+    append(out, "{\"time\": %ld.%03ld, \"bitrate\": %u, \"interfaces\": [", (long)tv.tv_sec, (long)(tv.tv_usec / 1000),
+           m_bitrate);
+    for (size_t i = 0; i < m_buses.size(); i++) {
+        const Entry &e = m_buses[i];
+        BootloaderBus *bus = e.bus;
+        BusStats &st = bus->stats();
+        append(out, "%s\n  {\"name\": \"%s\", \"tx_frames\": %llu, \"tx_bytes\": %llu, \"tx_errors\": %llu, ",
+               i ? "," : "", escape(bus->name()).c_str(), (unsigned long long)st.tx_frames.load(),
+               (unsigned long long)st.tx_bytes.load(), (unsigned long long)st.tx_errors.load());
+        append(out, "\"rx_frames\": %llu, \"rx_bytes\": %llu, \"error_frames\": %llu, \"kernel_drops\": %llu, "
+               "\"rx_ring_drops\": %llu, \"retransmits\": %llu, \"timeouts\": %llu, ",
+               (unsigned long long)st.rx_frames.load(), (unsigned long long)st.rx_bytes.load(),
+               (unsigned long long)st.error_frames.load(), (unsigned long long)bus->can()->kernelDrops(),
+               (unsigned long long)bus->can()->rxRingOverflows(), (unsigned long long)busRetransmits(bus),
+               (unsigned long long)busTimeouts(bus));
+        const CanTxPressure &tp = bus->can()->txPressure();
+        append(out, "\"tx_full\": %llu, \"tx_nobufs\": %llu, \"tx_wait_us\": %llu, \"tx_stalls\": %llu, ",
+               (unsigned long long)tp.full.load(), (unsigned long long)tp.nobufs.load(),
+               (unsigned long long)tp.wait_us.load(), (unsigned long long)tp.stalls.load());
+        append(out, "\"tx_frames_per_second\": %.1f, \"rx_frames_per_second\": %.1f, \"tx_bytes_per_second\": %.1f, "
+               "\"rx_bytes_per_second\": %.1f, \"bus_load\": %.4f, \"sessions\": [",
+               e.rates.tx_frames, e.rates.rx_frames, e.rates.tx_bytes, e.rates.rx_bytes, e.rates.load);
+
+        bool first = true;
+        for (int node = 0; node < NODE_COUNT; node++) {
+            BootloaderSession *s = bus->session(node);
+            if (!isActive(s))
+                continue;
+            const SessionStats &ss = s->stats();
+            append(out, "%s\n    {\"node\": %d, \"state\": \"%s\", \"bytes_done\": %zu, \"bytes_total\": %zu, "
+                   "\"bytes_per_second\": %.1f, ",
+                   first ? "" : ",", node, stateName(s->state()), s->bytesDone(), s->bytesTotal(),
+                   e.rates.node_bytes[node]);
+            append(out, "\"commands\": %llu, \"frames\": %llu, \"retransmits\": %llu, \"timeouts\": %llu, ",
+                   (unsigned long long)ss.commands.load(), (unsigned long long)ss.frames.load(),
+                   (unsigned long long)ss.retransmits.load(), (unsigned long long)ss.timeouts.load());
+            out += "\"result\": \"" + escape(s->result()) + "\"}";
+            first = false;
+        }
+        out += first ? "]}" : "\n  ]}";
+    }
+    out += "\n]}\n";
+    return out;
+}
+
+std::string Metrics::prometheus()
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    std::string out;
+
+    // One block per metric, with a line per interface.
+    auto busMetric = [&](const char *name, const char *type, const char *help,
+                         std::function<double (const Entry &)> value) {
+        append(out, "# HELP bootloader_%s %s\n# TYPE bootloader_%s %s\n", name, help, name, type);
+        for (const Entry &e : m_buses)
+            append(out, "bootloader_%s{iface=\"%s\"} %.15g\n", name, escape(e.bus->name()).c_str(), value(e));
+    };
+    busMetric("tx_frames_total", "counter", "Frames sent.",
+              [](const Entry &e) { return (double)e.bus->stats().tx_frames; });
+    busMetric("tx_bytes_total", "counter", "Payload bytes sent.",
+              [](const Entry &e) { return (double)e.bus->stats().tx_bytes; });
+    busMetric("tx_errors_total", "counter", "Frames the socket did not take.",
+              [](const Entry &e) { return (double)e.bus->stats().tx_errors; });
+    busMetric("tx_full_total", "counter", "Sends that found the socket buffer full (EAGAIN).",
+              [](const Entry &e) { return (double)e.bus->can()->txPressure().full; });
+    busMetric("tx_nobufs_total", "counter", "Sends that found the interface queue full (ENOBUFS).",
+              [](const Entry &e) { return (double)e.bus->can()->txPressure().nobufs; });
+    busMetric("tx_wait_seconds_total", "counter", "Time senders waited for room in the TX queue.",
+              [](const Entry &e) { return e.bus->can()->txPressure().wait_us / 1e6; });
+    busMetric("tx_stalls_total", "counter", "Sends given up after the queue took nothing for a while.",
+              [](const Entry &e) { return (double)e.bus->can()->txPressure().stalls; });
+    busMetric("rx_frames_total", "counter", "Frames received.",
+              [](const Entry &e) { return (double)e.bus->stats().rx_frames; });
+    busMetric("rx_bytes_total", "counter", "Payload bytes received.",
+              [](const Entry &e) { return (double)e.bus->stats().rx_bytes; });
+    busMetric("error_frames_total", "counter", "CAN error frames received.",
+              [](const Entry &e) { return (double)e.bus->stats().error_frames; });
+    busMetric("kernel_drops_total", "counter", "Frames dropped by a full socket receive queue.",
+              [](const Entry &e) { return (double)e.bus->can()->kernelDrops(); });
+    busMetric("rx_ring_drops_total", "counter", "Frames dropped by a full RX ring.",
+              [](const Entry &e) { return (double)e.bus->can()->rxRingOverflows(); });
+    busMetric("retransmits_total", "counter", "Resent commands and data frames.",
+              [](const Entry &e) { return (double)busRetransmits(e.bus); });
+    busMetric("timeouts_total", "counter", "Answers that did not arrive in time.",
+              [](const Entry &e) { return (double)busTimeouts(e.bus); });
+    busMetric("tx_bytes_per_second", "gauge", "Payload bytes sent per second.",
+              [](const Entry &e) { return e.rates.tx_bytes; });
+    busMetric("rx_bytes_per_second", "gauge", "Payload bytes received per second.",
+              [](const Entry &e) { return e.rates.rx_bytes; });
+    busMetric("bus_load", "gauge", "Estimated bus utilization (0-1, without stuff bits).",
+              [](const Entry &e) { return e.rates.load; });
+
+    auto sessionMetric = [&](const char *name, const char *type, const char *help,
+                             std::function<double (const Entry &, int node)> value) {
+        append(out, "# HELP bootloader_session_%s %s\n# TYPE bootloader_session_%s %s\n", name, help, name, type);
+        for (const Entry &e : m_buses) {
+            for (int node = 0; node < NODE_COUNT; node++) {
+                if (isActive(e.bus->session(node))) {
+                    append(out, "bootloader_session_%s{iface=\"%s\",node=\"%d\"} %.15g\n", name,
+                           escape(e.bus->name()).c_str(), node, value(e, node));
+                }
+            }
+        }
+    };
+    sessionMetric("state", "gauge", "0 idle, 1 running, 2 done, 3 failed.",
+                  [](const Entry &e, int node) { return (double)e.bus->session(node)->state(); });
+    sessionMetric("bytes_done", "gauge", "Bytes written by the current operation.",
+                  [](const Entry &e, int node) { return (double)e.bus->session(node)->bytesDone(); });
+    sessionMetric("bytes_total", "gauge", "Bytes to write in the current operation.",
+                  [](const Entry &e, int node) { return (double)e.bus->session(node)->bytesTotal(); });
+    sessionMetric("bytes_per_second", "gauge", "Write progress in bytes per second.",
+                  [](const Entry &e, int node) { return e.rates.node_bytes[node]; });
+    sessionMetric("retransmits_total", "counter", "Resent commands and data frames.",
+                  [](const Entry &e, int node) { return (double)e.bus->session(node)->stats().retransmits; });
+    sessionMetric("timeouts_total", "counter", "Answers that did not arrive in time.",
+                  [](const Entry &e, int node) { return (double)e.bus->session(node)->stats().timeouts; });
+    return out;
+}
+
+MetricsServer::MetricsServer(Metrics *metrics) :
+    m_metrics(metrics),
+    m_loop(nullptr),
+    m_fd(-1)
+{
+
+}
+
+MetricsServer::~MetricsServer()
+{
+    while (!m_clients.empty()) {
+        m_loop->cancelTimer(m_clients.begin()->second);
+        drop(m_clients.begin()->first);
+    }
+    if (m_fd == -1)
+        return;
+    if (m_loop)
+        m_loop->removeFd(m_fd);
+    close(m_fd);
+}
+
+int MetricsServer::open(EventLoop *loop, int port)
+{
+    m_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_fd == -1) {
+        LOG(ERROR, "Metrics socket failed: %s", strerror(errno));
+        return -1;
+    }
+    int enable = 1;
+    setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(m_fd, 8) == -1) {
+        LOG(ERROR, "Cannot listen on metrics port %d: %s", port, strerror(errno));
+        close(m_fd);
+        m_fd = -1;
+        return -1;
+    }
+
+    m_loop = loop;
+    if (m_loop->addFd(m_fd, EPOLLIN, [this](uint32_t) { acceptClients(); })) {
+        close(m_fd);
+        m_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void MetricsServer::acceptClients()
+{
+    while (true) {
+        int fd = accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1)
+            return;
+        // Scrapers send the request right away; a client that does not is
+        // dropped after a second. The answer is sent blocking, for at most
+        // a second as well.
+        struct timeval timeout = { METRICS_CLIENT_TIMEOUT_MS / 1000, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (m_loop->addFd(fd, EPOLLIN, [this, fd](uint32_t) { serve(fd); })) {
+            close(fd);
+            continue;
+        }
+        m_clients[fd] = m_loop->addTimer(METRICS_CLIENT_TIMEOUT_MS, false, [this, fd] { drop(fd); });
+    }
+}
+
+// Closes a client that is still connected.
+void MetricsServer::drop(int fd)
+{
+    auto it = m_clients.find(fd);
+    if (it == m_clients.end())
+        return;
+    m_clients.erase(it);
+    m_loop->removeFd(fd);
+    close(fd);
+}
+
+void MetricsServer::serve(int fd)
+{
+    auto it = m_clients.find(fd);
+    if (it == m_clients.end())
+        return;
+    m_loop->cancelTimer(it->second);
+    m_clients.erase(it);
+    m_loop->removeFd(fd);
+
+    char request[METRICS_REQUEST_MAX];
+    ssize_t len = recv(fd, request, sizeof(request) - 1, 0);
+    request[len > 0 ? len : 0] = '\0';
+
+    char path[256] = "";
+    const char *status = "200 OK";
+    const char *type = "text/plain; version=0.0.4";
+    std::string body;
+    if (sscanf(request, "GET %255s", path) != 1) {
+        status = "400 Bad Request";
+        body = "Bad request\n";
+    } else if (strcmp(path, "/metrics") == 0) {
+        body = m_metrics->prometheus();
+    } else if (strcmp(path, "/stats") == 0) {
+        type = "application/json";
+        body = m_metrics->json();
+    } else {
+        status = "404 Not Found";
+        body = "Try /metrics or /stats\n";
+    }
+
+    std::string response;
+    append(response, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status,
+           type, body.size());
+    response += body;
+    for (size_t sent = 0; sent < response.size(); ) {
+        ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    close(fd);
+}
@@ -0,0 +1,49 @@
+#include "RtoEstimator.h"
+
+RtoEstimator::RtoEstimator() :
+    m_initial(1000000),
+    m_min(0),
+    m_max(UINT64_MAX)
+{
+    reset();
+}
+
+void RtoEstimator::configure(uint64_t initial, uint64_t min, uint64_t max)
+{
+    m_initial = initial;
+    m_min = min;
+    m_max = max;
+    reset();
+}
+
+void RtoEstimator::reset()
+{
+    m_srtt = 0;
+    m_rttvar = 0;
+    m_rto = m_initial;
+    m_samples = 0;
+}
+
+void RtoEstimator::sample(uint64_t rtt)
+{
+    if (m_samples == 0) {
+        m_srtt = rtt;
+        m_rttvar = rtt / 2;
+    } else {
+        uint64_t err = rtt > m_srtt ? rtt - m_srtt : m_srtt - rtt;
+        m_rttvar = (3 * m_rttvar + err) / 4;
+        m_srtt = (7 * m_srtt + rtt) / 8;
+    }
+    m_samples++;
+
+    m_rto = m_srtt + 4 * m_rttvar;
+    if (m_rto < m_min)
+        m_rto = m_min;
+    if (m_rto > m_max)
+        m_rto = m_max;
+}
+
+void RtoEstimator::backoff()
+{
+    m_rto = m_rto > m_max / 2 ? m_max : m_rto * 2;
+}
@@ -0,0 +1,174 @@
+#include "TxScheduler.h"
+#include "can.h"
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+TxScheduler::TxScheduler() :
+    m_can(nullptr),
+    m_stats(nullptr),
+    m_active(false),
+    m_queued(0),
+    m_cursor(0)
+{
+    for (int i = 0; i < NODE_COUNT; i++)
+        m_queues[i] = new RingBuffer<TxEntry>(QUEUE_SIZE);
+}
+
+TxScheduler::~TxScheduler()
+{
+    bool active;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        active = m_active;
+    }
+    if (active)
+        stopScheduling();
+    for (int i = 0; i < NODE_COUNT; i++)
+        delete m_queues[i];
+}
+
+void TxScheduler::attach(Can *can, BusStats *stats)
+{
+    m_can = can;
+    m_stats = stats;
+}
+
+bool TxScheduler::submit(uint8_t node, const struct canfd_frame &frame, bool fd)
+{
+    return submitBatch(node, &frame, 1, fd);
+}
+
+bool TxScheduler::submitBatch(uint8_t node, const struct canfd_frame *frames, size_t count, bool fd)
+{
+    // Without scheduling, and once it stops, frames go out directly.
+    std::unique_lock<std::mutex> lock(m_mtx);
+    RingBuffer<TxEntry> &queue = *m_queues[node & (NODE_COUNT - 1)];
+    size_t done = 0;
+    while (done < count) {
+        if (!m_active) {
+            lock.unlock();
+            return sendBatch(frames + done, count - done, fd) == count - done;
+        }
+        size_t room = queue.capacity() - queue.size();
+        if (room == 0) {
+            m_room.wait(lock);
+            continue;
+        }
+
+        size_t n = std::min(room, count - done);
+        for (size_t i = 0; i < n; i++) {
+            TxEntry entry;
+            entry.frame = frames[done + i];
+            entry.fd = fd;
+            queue.push(entry);
+        }
+        done += n;
+        m_queued += n;
+        m_cv.notify_one();
+    }
+    return true;
+}
+
+void TxScheduler::startScheduling()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_active = true;
+    }
+    this->start();
+}
+
+void TxScheduler::stopScheduling()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_active = false;
+    }
+    m_cv.notify_one();
+    m_room.notify_all();
+    this->stop();
+}
+
+void TxScheduler::run()
+{
+    std::vector<TxEntry> batch;
+    std::vector<struct canfd_frame> frames;
+    batch.reserve(Can::TX_BATCH);
+    frames.reserve(Can::TX_BATCH);
+
+    std::unique_lock<std::mutex> lock(m_mtx);
+    while (m_active || m_queued > 0) {
+        if (m_queued == 0) {
+            m_cv.wait(lock);
+            continue;
+        }
+
+        batch.clear();
+        while (m_queued > 0 && batch.size() < Can::TX_BATCH) {
+            while (m_queues[m_cursor]->size() == 0)
+                m_cursor = (m_cursor + 1) % NODE_COUNT;
+
+            TxEntry entry;
+            m_queues[m_cursor]->pop(entry);
+            batch.push_back(entry);
+            m_queued--;
+            m_cursor = (m_cursor + 1) % NODE_COUNT;
+        }
+
+        m_room.notify_all();
+
+        lock.unlock();
+        // One sendmmsg() per run of frames of the same type.
+        for (size_t i = 0; i < batch.size(); ) {
+            frames.clear();
+            bool fd = batch[i].fd;
+            while (i < batch.size() && batch[i].fd == fd)
+                frames.push_back(batch[i++].frame);
+            sendBatch(frames.data(), frames.size(), fd);
+        }
+        lock.lock();
+    }
+}
+
+// Only frames the socket rejects for another reason than a full queue, or
+// that found no room for Can::TX_STALL_MS, are dropped and counted as TX
+// errors.
+size_t TxScheduler::sendBatch(const struct canfd_frame *frames, size_t count, bool fd)
+{
+    size_t sent = 0;
+    unsigned backoff_us = 0;
+    uint64_t deadline = Can::txDeadline();
+    while (sent < count) {
+        int ret = transmitSome(frames + sent, count - sent, fd);
+        if (ret > 0) {
+            sent += ret;
+            backoff_us = 0;
+            deadline = Can::txDeadline();
+            continue;
+        }
+        if (!m_can->waitTxRoom(errno, backoff_us, deadline))
+            break;
+    }
+
+    for (size_t i = 0; i < sent; i++)
+        m_stats->tx_bytes += frames[i].len;
+    m_stats->tx_frames += sent;
+    m_stats->tx_errors += count - sent;
+    return sent;
+}
+
+// One sendmmsg(); classic frames are repacked on the stack, Can::TX_BATCH
+// at a time.
+int TxScheduler::transmitSome(const struct canfd_frame *frames, size_t count, bool fd)
+{
+    if (fd)
+        return m_can->transmitFdBatch(frames, count);
+
+    struct can_frame classic[Can::TX_BATCH];
+    size_t n = std::min(count, Can::TX_BATCH);
+    for (size_t i = 0; i < n; i++)
+        memcpy(&classic[i], &frames[i], CAN_MTU);
+    return m_can->transmitBatch(classic, n);
+}
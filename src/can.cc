@@ -1,5 +1,7 @@
 #include "can.h"
 #include "log.h"
+#include "EventLoop.h"
+#include "CanCapture.h"
 #include <linux/can.h>
 #include <linux/can/raw.h>
 #include <sys/types.h>
@@ -7,12 +9,28 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <linux/net_tstamp.h>
 #include <unistd.h>
 #include <vector>
+#include <algorithm>
 
 Can::Can(char *deviceName) :
 	m_sd(-1),
-	m_deviceName(deviceName)
+	m_deviceName(deviceName),
+	m_fdEnabled(false),
+	m_loop(nullptr),
+	m_rxRing(nullptr),
+	m_rxRingFd(-1),
+	m_timestamps(false),
+	m_dropCounter(false),
+	m_lastDrops(0),
+	m_kernelDrops(0),
+	m_capture(nullptr),
+	m_captureChannel(-1)
 {
 
 }
@@ -20,6 +38,9 @@ Can::Can(char *deviceName) :
 Can::~Can()
 {
 	destroy();
+	if (m_rxRingFd != -1)
+		close(m_rxRingFd);
+	delete m_rxRing;
 }
 
 int Can::init() 
@@ -47,12 +68,21 @@ int Can::init()
 		return -1;
 	}
 
+	/* Senders wait for room in waitTxRoom(), never inside the kernel. */
+	int flags = fcntl(m_sd, F_GETFL);
+	if (flags == -1 || fcntl(m_sd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		LOG(ERROR, "fcntl O_NONBLOCK error");
+		close(m_sd);
+		return -1;
+	}
+
 	LOG(INFO, "Successed:%s has interface index %d.", m_deviceName.c_str(), ifr.ifr_ifindex);
 	return 0;
 }
 
-void Can::startAutoRead()
+void Can::startAutoRead(const ThreadAttributes &attr)
 {
+	this->setAttributes(attr);
 	this->start();
 	this->detach();
 	isAutoRead = true;
@@ -72,8 +102,6 @@ void Can::run()
 	poll_set[0].revents = 0;
 	int timeout = 1000;
 
-	struct can_frame rx_frame;
-
 	while(!this->isStoped()) {
 		switch (poll(poll_set, 1, timeout)) {
 		case -1:
@@ -83,29 +111,466 @@ void Can::run()
 		case 0:
 			break;
 		default:
-			int len = read(m_sd, &rx_frame, CAN_MTU);
-			if (len > 0) 
-				onCanReceiveDataCallback(std::move(rx_frame));
+			readFrames();
+			break;
+		}
+	}
+}
+
+static uint64_t timespecToNs(const struct timespec &ts)
+{
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* drops is left alone when the message carries no SO_RXQ_OVFL count. */
+static void parseControl(struct msghdr *msg, struct CanRxTimestamp &ts, uint32_t &drops)
+{
+	ts.software = 0;
+	ts.hardware = 0;
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+
+		if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+		} else if (cmsg->cmsg_type == SO_TIMESTAMPING) {
+			struct timespec stamps[3];
+			memcpy(stamps, CMSG_DATA(cmsg), sizeof(stamps));
+			ts.software = timespecToNs(stamps[0]);
+			ts.hardware = timespecToNs(stamps[2]);
+		} else if (cmsg->cmsg_type == SO_TIMESTAMPNS) {
+			struct timespec stamp;
+			memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+			ts.software = timespecToNs(stamp);
+		}
+	}
+}
+
+void Can::readFrames()
+{
+	struct canfd_frame rx_frames[RX_BATCH];
+	struct CanRxTimestamp stamps[RX_BATCH];
+	struct iovec iovs[RX_BATCH];
+	struct mmsghdr msgs[RX_BATCH];
+	char control[RX_BATCH][CMSG_SPACE(3 * sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+
+	memset(msgs, 0, sizeof(msgs));
+	for (size_t i = 0; i < RX_BATCH; i++) {
+		iovs[i].iov_base = &rx_frames[i];
+		iovs[i].iov_len = CANFD_MTU;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		if (m_timestamps || m_dropCounter) {
+			msgs[i].msg_hdr.msg_control = control[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+		}
+	}
+
+	int n = recvmmsg(m_sd, msgs, RX_BATCH, MSG_DONTWAIT, nullptr);
+	if (n <= 0)
+		return;
+
+	/* Tag FD frames with CANFD_FDF, drop anything that is neither. The
+	 * kernel's drop count is cumulative and 32 bits wide, so only the
+	 * difference to the previous batch is added. */
+	size_t count = 0;
+	uint32_t drops = m_lastDrops;
+	for (int i = 0; i < n; i++) {
+		if (m_timestamps || m_dropCounter)
+			parseControl(&msgs[i].msg_hdr, stamps[count], drops);
+		else
+			stamps[count].software = stamps[count].hardware = 0;
+
+		if (msgs[i].msg_len == CAN_MTU)
+			rx_frames[i].flags = 0;
+		else if (msgs[i].msg_len == CANFD_MTU)
+			rx_frames[i].flags |= CANFD_FDF;
+		else
+			continue;
+		rx_frames[count++] = rx_frames[i];
+	}
+	if (drops != m_lastDrops) {
+		m_kernelDrops.fetch_add((uint32_t)(drops - m_lastDrops), std::memory_order_relaxed);
+		m_lastDrops = drops;
+	}
+	if (m_capture && count > 0)
+		m_capture->record(m_captureChannel, rx_frames, stamps, count);
+
+	if (m_rxRing || onCanReceiveFrameCallback) {
+		struct CanRxFrame frames[RX_BATCH];
+		for (size_t i = 0; i < count; i++) {
+			frames[i].frame = rx_frames[i];
+			frames[i].timestamp = stamps[i];
+		}
+
+		if (!m_rxRing) {
+			for (size_t i = 0; i < count; i++)
+				onCanReceiveFrameCallback(frames[i]);
+			return;
+		}
+
+		if (m_rxRing->push(frames, count) > 0) {
+			uint64_t one = 1;
+			if (write(m_rxRingFd, &one, sizeof(one)) != sizeof(one))
+				LOG(ERROR, "rx ring eventfd write failed");
+		}
+		return;
+	}
+
+	struct can_frame classic[RX_BATCH];
+	size_t nclassic = 0;
+	size_t nfd = 0;
+
+	/* Classic frames are copied out, FD frames compacted in place. */
+	for (size_t i = 0; i < count; i++) {
+		if (rx_frames[i].flags & CANFD_FDF)
+			rx_frames[nfd++] = rx_frames[i];
+		else
+			memcpy(&classic[nclassic++], &rx_frames[i], CAN_MTU);
+	}
+
+	if (nclassic > 0) {
+		if (onCanReceiveBatchCallback) {
+			onCanReceiveBatchCallback(classic, nclassic);
+		} else if (onCanReceiveDataCallback) {
+			for (size_t i = 0; i < nclassic; i++)
+				onCanReceiveDataCallback(std::move(classic[i]));
+		}
+	}
+
+	if (nfd > 0) {
+		if (onCanFdReceiveBatchCallback) {
+			onCanFdReceiveBatchCallback(rx_frames, nfd);
+		} else if (onCanFdReceiveDataCallback) {
+			for (size_t i = 0; i < nfd; i++)
+				onCanFdReceiveDataCallback(std::move(rx_frames[i]));
+		}
+	}
+}
+
+static int sendFrames(int sd, const void *frames, size_t count, size_t mtu, size_t batch)
+{
+	struct iovec iovs[Can::TX_BATCH];
+	struct mmsghdr msgs[Can::TX_BATCH];
+	const uint8_t *base = (const uint8_t *)frames;
+	size_t sent = 0;
+
+	while (sent < count) {
+		size_t n = std::min(count - sent, batch);
+		memset(msgs, 0, n * sizeof(msgs[0]));
+		for (size_t i = 0; i < n; i++) {
+			iovs[i].iov_base = (void *)(base + (sent + i) * mtu);
+			iovs[i].iov_len = mtu;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int ret = sendmmsg(sd, msgs, n, 0);
+		if (ret <= 0)
+			break;
+		sent += ret;
+		if ((size_t)ret < n)
 			break;
+	}
+
+	return sent > 0 ? (int)sent : -1;
+}
+
+int Can::setFilters(const std::vector<struct can_filter> &filters)
+{
+	if (setsockopt(m_sd, SOL_CAN_RAW, CAN_RAW_FILTER,
+		       filters.empty() ? nullptr : filters.data(),
+		       filters.size() * sizeof(struct can_filter)) == -1) {
+		LOG(ERROR, "setsockopt CAN_RAW_FILTER error");
+		return -1;
+	}
+	return 0;
+}
+
+int Can::clearFilters()
+{
+	struct can_filter all;
+	all.can_id = 0;
+	all.can_mask = 0;
+	return setFilters(std::vector<struct can_filter>(1, all));
+}
+
+int Can::setErrorFilter(can_err_mask_t mask)
+{
+	if (setsockopt(m_sd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &mask, sizeof(mask)) == -1) {
+		LOG(ERROR, "setsockopt CAN_RAW_ERR_FILTER error");
+		return -1;
+	}
+	return 0;
+}
+
+int Can::enableTimestamps()
+{
+	int flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+		    SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	if (setsockopt(m_sd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == -1) {
+		int enable = 1;
+		if (setsockopt(m_sd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) == -1) {
+			LOG(ERROR, "setsockopt SO_TIMESTAMPNS error");
+			return -1;
 		}
 	}
+
+	m_timestamps = true;
+	return 0;
+}
+
+void Can::setOnCanReceiveFrameCallback(std::function<void (const struct CanRxFrame &frame)> callback)
+{
+	onCanReceiveFrameCallback = std::move(callback);
+}
+
+int Can::enableDropCounter()
+{
+	int enable = 1;
+	if (setsockopt(m_sd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) == -1) {
+		LOG(ERROR, "setsockopt SO_RXQ_OVFL error");
+		return -1;
+	}
+
+	m_dropCounter = true;
+	return 0;
+}
+
+uint64_t Can::kernelDrops()
+{
+	return m_kernelDrops.load(std::memory_order_relaxed);
+}
+
+void Can::setCapture(CaptureWriter *writer, int channel)
+{
+	m_capture = writer;
+	m_captureChannel = channel;
+}
+
+int Can::enableRxRing(size_t capacity)
+{
+	if (m_rxRing)
+		return -1;
+
+	m_rxRingFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_rxRingFd == -1) {
+		LOG(ERROR, "create rx ring eventfd failed.");
+		return -1;
+	}
+
+	m_rxRing = new RingBuffer<struct CanRxFrame>(capacity);
+	return 0;
+}
+
+int Can::rxRingEventFd()
+{
+	return m_rxRingFd;
+}
+
+size_t Can::popRxFrames(struct CanRxFrame *frames, size_t max)
+{
+	if (!m_rxRing)
+		return 0;
+
+	/* Clear the wakeup before popping, so frames pushed after this point
+	 * signal the eventfd again. */
+	uint64_t count;
+	ssize_t ret = read(m_rxRingFd, &count, sizeof(count));
+	(void)ret;
+	return m_rxRing->pop(frames, max);
+}
+
+uint64_t Can::rxRingOverflows()
+{
+	return m_rxRing ? m_rxRing->overflows() : 0;
+}
+
+int Can::transmitBatch(const struct can_frame *frames, size_t count)
+{
+	return sendFrames(m_sd, frames, count, CAN_MTU, TX_BATCH);
+}
+
+int Can::transmitFdBatch(const struct canfd_frame *frames, size_t count)
+{
+	if (!m_fdEnabled) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return sendFrames(m_sd, frames, count, CANFD_MTU, TX_BATCH);
+}
+
+static uint64_t monotonicUs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t Can::txDeadline()
+{
+	return monotonicUs() + TX_STALL_MS * 1000ULL;
+}
+
+bool Can::waitTxRoom(int err, unsigned &backoff_us, uint64_t deadline_us)
+{
+	uint64_t now = monotonicUs();
+	if (now >= deadline_us) {
+		m_txPressure.stalls++;
+		return false;
+	}
+
+	if (err == EAGAIN || err == EWOULDBLOCK) {
+		m_txPressure.full++;
+		struct pollfd pfd;
+		pfd.fd = m_sd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		int timeout_ms = (deadline_us - now + 999) / 1000;
+		if (poll(&pfd, 1, timeout_ms) == -1 && errno != EINTR)
+			return false;
+	} else if (err == ENOBUFS) {
+		m_txPressure.nobufs++;
+		backoff_us = backoff_us ? backoff_us * 2 : TX_BACKOFF_MIN_US;
+		if (backoff_us > TX_BACKOFF_MAX_US)
+			backoff_us = TX_BACKOFF_MAX_US;
+		uint64_t sleep_us = std::min<uint64_t>(backoff_us, deadline_us - now);
+		struct timespec ts = { (time_t)(sleep_us / 1000000), (long)(sleep_us % 1000000) * 1000 };
+		nanosleep(&ts, nullptr);
+	} else if (err != EINTR) {
+		return false;
+	}
+
+	m_txPressure.wait_us += monotonicUs() - now;
+	return true;
+}
+
+int Can::setSendBuffer(int bytes)
+{
+	if (setsockopt(m_sd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes)) == -1) {
+		LOG(ERROR, "setsockopt SO_SNDBUF error");
+		return -1;
+	}
+	return 0;
+}
+
+int Can::attachLoop(EventLoop *loop)
+{
+	if (m_loop || isAutoRead)
+		return -1;
+
+	if (loop->addFd(m_sd, EPOLLIN, [this](uint32_t) { readFrames(); }) == -1)
+		return -1;
+	m_loop = loop;
+	return 0;
+}
+
+int Can::detachLoop(EventLoop *loop)
+{
+	if (m_loop != loop)
+		return -1;
+
+	m_loop = nullptr;
+	return loop->removeFd(m_sd);
 }
 
 int Can::destroy()
 {
 	if(isAutoRead) 
 		stopAutoRead();
+	if(m_loop)
+		detachLoop(m_loop);
 	return close(m_sd);
 }
 
 int Can::transmit(struct can_frame *frame)
 {
-	int ret = write(m_sd, frame, sizeof(*frame));
-	if (ret != sizeof (*frame))
+	unsigned backoff_us = 0;
+	uint64_t deadline = txDeadline();
+	while (true) {
+		int ret = write(m_sd, frame, sizeof(*frame));
+		if (ret == sizeof(*frame))
+			return 0;
+		if (ret != -1 || !waitTxRoom(errno, backoff_us, deadline))
+			return -1;
+	}
+}
+
+int Can::enableFdFrames()
+{
+	struct ifreq mtu_req;
+	strcpy(mtu_req.ifr_name, m_deviceName.c_str());
+	if (ioctl(m_sd, SIOCGIFMTU, &mtu_req) == -1) {
+		LOG(ERROR, "ioctl SIOCGIFMTU error %s", m_deviceName.c_str());
+		return -1;
+	}
+
+	if (mtu_req.ifr_mtu != CANFD_MTU) {
+		LOG(INFO, "%s is not CAN FD capable (MTU %d).", m_deviceName.c_str(), mtu_req.ifr_mtu);
 		return -1;
+	}
+
+	int enable = 1;
+	if (setsockopt(m_sd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable, sizeof(enable)) == -1) {
+		LOG(ERROR, "setsockopt CAN_RAW_FD_FRAMES error");
+		return -1;
+	}
+
+	m_fdEnabled = true;
+	LOG(INFO, "CAN FD frames enabled on %s.", m_deviceName.c_str());
 	return 0;
 }
 
+bool Can::isFdEnabled()
+{
+	return m_fdEnabled;
+}
+
+int Can::transmitFd(struct canfd_frame *frame)
+{
+	if (!m_fdEnabled)
+		return -1;
+
+	unsigned backoff_us = 0;
+	uint64_t deadline = txDeadline();
+	while (true) {
+		int ret = write(m_sd, frame, CANFD_MTU);
+		if (ret == CANFD_MTU)
+			return 0;
+		if (ret != -1 || !waitTxRoom(errno, backoff_us, deadline))
+			return -1;
+	}
+}
+
+uint8_t Can::fdLength(uint8_t len)
+{
+	static const uint8_t lengths[] = { 8, 12, 16, 20, 24, 32, 48, 64 };
+
+	if (len <= 8)
+		return len;
+	for (uint8_t l : lengths) {
+		if (len <= l)
+			return l;
+	}
+	return CANFD_MAX_DLEN;
+}
+
+void Can::setOnCanFdReceiveDataCallback(std::function<void (struct canfd_frame &&)> callback)
+{
+	onCanFdReceiveDataCallback = std::move(callback);
+}
+
+void Can::setOnCanReceiveBatchCallback(std::function<void (const struct can_frame *frames, size_t count)> callback)
+{
+	onCanReceiveBatchCallback = std::move(callback);
+}
+
+void Can::setOnCanFdReceiveBatchCallback(std::function<void (const struct canfd_frame *frames, size_t count)> callback)
+{
+	onCanFdReceiveBatchCallback = std::move(callback);
+}
+
 void Can::setOnCanReceiveDataCallback(std::function<void (struct can_frame &&)> callback)
 {
 	onCanReceiveDataCallback = std::move(callback);
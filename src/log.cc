@@ -3,15 +3,59 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
 
 int LogLevel;
 
+#define RECORD_TEXT         480
+#define WRITER_IDLE_MS      5
+
+struct LogRecord {
+    PriorityLevel level;
+    const char *file;
+    int line;
+    const char *fmt;    /* deferred record: text holds the encoded arguments */
+    char text[RECORD_TEXT];
+};
+
+/* Slot of the bounded MPSC queue (Vyukov): seq == pos when free for the
+ * producer at pos, pos + 1 once the record is published. */
+struct LogCell {
+    std::atomic<size_t> seq;
+    LogRecord rec;
+};
+
+static int s_sinks = LOG_SINK_STDOUT;
+static FILE *s_file = nullptr;
+static std::mutex s_emitMtx;
+
+static LogCell *s_cells = nullptr;
+static size_t s_mask = 0;
+static bool s_deferred = false;
+static std::atomic<bool> s_async(false);
+static std::atomic<bool> s_running(false);
+static std::atomic<size_t> s_enqueuePos(0);
+static size_t s_dequeuePos = 0;
+static std::atomic<unsigned long long> s_written(0);
+static std::atomic<unsigned long long> s_dropped(0);
+static std::thread s_writer;
+static std::mutex s_wakeMtx;
+static std::condition_variable s_wakeCv;
+static std::condition_variable s_flushCv;
+
 void initLogger(PriorityLevel level)
 {
     switch (level) {
 #define XX(name) \
 	case name: \
-		printf("Initialize LOG SUCCESS, LEVEL is %s\n" , #name); \
+		if (s_sinks & LOG_SINK_STDOUT) \
+			printf("Initialize LOG SUCCESS, LEVEL is %s\n" , #name); \
 		LogLevel = name; \
 		break;
 
@@ -25,38 +69,496 @@ void initLogger(PriorityLevel level)
     }
 }
 
-void log (PriorityLevel level, const char* file, const int line, const char *fmt, ...)
+void logSetSinks(int sinks)
 {
-    char str[1024];
-    int len;
-    va_list args;
-    va_start(args, fmt);
-    len = vsprintf(str, fmt, args);
-    va_end(args);
+    std::lock_guard<std::mutex> lock(s_emitMtx);
+    s_sinks = sinks;
+}
+
+int logOpenFile(const char *path)
+{
+    FILE *file = fopen(path, "a");
+    if (!file)
+        return -1;
 
+    std::lock_guard<std::mutex> lock(s_emitMtx);
+    if (s_file)
+        fclose(s_file);
+    s_file = file;
+    s_sinks |= LOG_SINK_FILE;
+    return 0;
+}
+
+static int syslogPriority(PriorityLevel level)
+{
     switch (level) {
+        case EMERG:     return LOG_EMERG;
+        case FATAL:
+        case ALERT:     return LOG_ALERT;
+        case CRIT:      return LOG_CRIT;
+        case ERROR:     return LOG_ERR;
+        case WARN:      return LOG_WARNING;
+        case NOTICE:    return LOG_NOTICE;
+        case INFO:      return LOG_INFO;
+        default:        return LOG_DEBUG;
+    }
+}
+
+static void emit(PriorityLevel level, const char* file, const int line, const char *str)
+{
+    std::lock_guard<std::mutex> lock(s_emitMtx);
+
+    if (s_sinks & LOG_SINK_STDOUT) {
+        switch (level) {
 #define XX(name, color) \
 	case name: \
-		if (LogLevel >= level) \
-			printf(color"[%6s]\033[0m %s\n", #name, str); \
+		printf(color"[%6s]\033[0m %s\n", #name, str); \
 		break;
 
-        XX(EMERG,       RED);
-        XX(FATAL,       WHITE);
-        XX(ALERT,       WHITE);
-        XX(CRIT,        WHITE);
-        XX(ERROR,       RED);
-        XX(WARN,        YELLOW);
-        XX(INFO,        GREEN);
-        XX(NOTICE,      CYAN);
-        XX(NOTSET,      WHITE);
-
-        case DEBUG:
-            if(LogLevel >= level)
+            XX(EMERG,       RED);
+            XX(FATAL,       WHITE);
+            XX(ALERT,       WHITE);
+            XX(CRIT,        WHITE);
+            XX(ERROR,       RED);
+            XX(WARN,        YELLOW);
+            XX(INFO,        GREEN);
+            XX(NOTICE,      CYAN);
+            XX(NOTSET,      WHITE);
+
+            case DEBUG:
                 printf(BLUE"[ DEBUG]\033[0m %s:%d \n\t%s\n", file, line, str);
-            break;
+                break;
 #undef XX
+            default:
+                break;
+        }
+    }
+
+    if ((s_sinks & LOG_SINK_FILE) && s_file) {
+        static const char *names[] = {
+            "EMERG", "FATAL", "ALERT", "CRIT", "ERROR", "WARN", "NOTICE", "INFO", "DEBUG", "NOTSET"
+        };
+        if (level == DEBUG)
+            fprintf(s_file, "[%6s] %s:%d %s\n", names[level], file, line, str);
+        else
+            fprintf(s_file, "[%6s] %s\n", names[level], str);
+        fflush(s_file);
+    }
+
+    if (s_sinks & LOG_SINK_SYSLOG)
+        syslog(syslogPriority(level), "%s", str);
+}
+
+/*
+ * Deferred formatting. The arguments of each conversion are appended to
+ * the record as they come off the va_list (integers widened to 64 bits,
+ * strings copied), and the writer formats them one conversion at a time.
+ */
+enum ArgKind { ARG_INT, ARG_UINT, ARG_DOUBLE, ARG_PTR, ARG_STR, ARG_NONE };
+
+struct Spec {
+    const char *start;
+    const char *end;
+    int stars;
+    char length[3];
+    char conv;
+};
+
+static bool parseSpec(const char *p, Spec &spec)
+{
+    spec.start = p++;
+    spec.stars = 0;
+    spec.length[0] = '\0';
+    while (*p && strchr("-+ #0", *p))
+        p++;
+    if (*p == '*') {
+        spec.stars++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec.stars++;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+    size_t n = 0;
+    while (*p && strchr("hlzjtL", *p) && n < 2)
+        spec.length[n++] = *p++;
+    spec.length[n] = '\0';
+    if (!*p)
+        return false;
+    spec.conv = *p;
+    spec.end = p + 1;
+    return true;
+}
+
+static ArgKind specKind(const Spec &spec)
+{
+    switch (spec.conv) {
+        case 'd': case 'i':
+            return ARG_INT;
+        case 'u': case 'o': case 'x': case 'X': case 'c':
+            return ARG_UINT;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            return ARG_DOUBLE;
+        case 'p': case 'n':
+            return ARG_PTR;
+        case 's':
+            return ARG_STR;
         default:
+            return ARG_NONE;
+    }
+}
+
+static bool put(char *buf, size_t &pos, const void *data, size_t len)
+{
+    if (pos + len > RECORD_TEXT)
+        return false;
+    memcpy(buf + pos, data, len);
+    pos += len;
+    return true;
+}
+
+static bool encodeArgs(char *buf, const char *fmt, va_list args)
+{
+    size_t pos = 0;
+    for (const char *p = fmt; *p; p++) {
+        if (*p != '%')
+            continue;
+        if (p[1] == '%') {
+            p++;
+            continue;
+        }
+
+        Spec spec;
+        if (!parseSpec(p, spec))
+            return false;
+        p = spec.end - 1;
+
+        for (int i = 0; i < spec.stars; i++) {
+            int star = va_arg(args, int);
+            if (!put(buf, pos, &star, sizeof(star)))
+                return false;
+        }
+
+        const char *l = spec.length;
+        switch (specKind(spec)) {
+            case ARG_INT: {
+                int64_t v;
+                if (!strcmp(l, "ll"))       v = va_arg(args, long long);
+                else if (!strcmp(l, "l"))   v = va_arg(args, long);
+                else if (!strcmp(l, "z"))   v = va_arg(args, ssize_t);
+                else if (!strcmp(l, "j"))   v = va_arg(args, intmax_t);
+                else if (!strcmp(l, "t"))   v = va_arg(args, ptrdiff_t);
+                else if (!strcmp(l, "hh"))  v = (signed char)va_arg(args, int);
+                else if (!strcmp(l, "h"))   v = (short)va_arg(args, int);
+                else                        v = va_arg(args, int);
+                if (!put(buf, pos, &v, sizeof(v)))
+                    return false;
+                break;
+            }
+            case ARG_UINT: {
+                uint64_t v;
+                if (!strcmp(l, "ll"))       v = va_arg(args, unsigned long long);
+                else if (!strcmp(l, "l"))   v = va_arg(args, unsigned long);
+                else if (!strcmp(l, "z"))   v = va_arg(args, size_t);
+                else if (!strcmp(l, "j"))   v = va_arg(args, uintmax_t);
+                else if (!strcmp(l, "t"))   v = va_arg(args, ptrdiff_t);
+                else if (!strcmp(l, "hh"))  v = (unsigned char)va_arg(args, unsigned int);
+                else if (!strcmp(l, "h"))   v = (unsigned short)va_arg(args, unsigned int);
+                else                        v = va_arg(args, unsigned int);
+                if (!put(buf, pos, &v, sizeof(v)))
+                    return false;
+                break;
+            }
+            case ARG_DOUBLE: {
+                double v = !strcmp(l, "L") ? (double)va_arg(args, long double) : va_arg(args, double);
+                if (!put(buf, pos, &v, sizeof(v)))
+                    return false;
+                break;
+            }
+            case ARG_PTR: {
+                void *v = va_arg(args, void *);
+                if (!put(buf, pos, &v, sizeof(v)))
+                    return false;
+                break;
+            }
+            case ARG_STR: {
+                const char *v = va_arg(args, const char *);
+                if (!v)
+                    v = "(null)";
+                if (!put(buf, pos, v, strlen(v) + 1))
+                    return false;
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+static void decodeArgs(const char *buf, const char *fmt, char *out, size_t size)
+{
+    size_t pos = 0;
+    size_t len = 0;
+
+    for (const char *p = fmt; *p && len + 1 < size; ) {
+        if (*p != '%' || p[1] == '%') {
+            out[len++] = *p;
+            p += *p == '%' ? 2 : 1;
+            continue;
+        }
+
+        Spec spec;
+        parseSpec(p, spec);
+        p = spec.end;
+
+        /* Rebuild the conversion with the stored star values inlined and
+         * a length modifier matching the stored type. */
+        char conv[64];
+        size_t c = 0;
+        size_t star = 0;
+        int stars[2] = { 0, 0 };
+        for (int i = 0; i < spec.stars; i++) {
+            memcpy(&stars[i], buf + pos, sizeof(int));
+            pos += sizeof(int);
+        }
+        for (const char *q = spec.start; q < spec.end - 1 - strlen(spec.length) && c < 40; q++) {
+            if (*q == '*')
+                c += snprintf(conv + c, sizeof(conv) - c, "%d", stars[star++]);
+            else
+                conv[c++] = *q;
+        }
+
+        size_t room = size - len;
+        int n = 0;
+        switch (specKind(spec)) {
+            case ARG_INT: {
+                int64_t v;
+                memcpy(&v, buf + pos, sizeof(v));
+                pos += sizeof(v);
+                snprintf(conv + c, sizeof(conv) - c, "ll%c", spec.conv);
+                n = snprintf(out + len, room, conv, (long long)v);
+                break;
+            }
+            case ARG_UINT: {
+                uint64_t v;
+                memcpy(&v, buf + pos, sizeof(v));
+                pos += sizeof(v);
+                if (spec.conv == 'c') {
+                    snprintf(conv + c, sizeof(conv) - c, "c");
+                    n = snprintf(out + len, room, conv, (int)v);
+                } else {
+                    snprintf(conv + c, sizeof(conv) - c, "ll%c", spec.conv);
+                    n = snprintf(out + len, room, conv, (unsigned long long)v);
+                }
+                break;
+            }
+            case ARG_DOUBLE: {
+                double v;
+                memcpy(&v, buf + pos, sizeof(v));
+                pos += sizeof(v);
+                snprintf(conv + c, sizeof(conv) - c, "%c", spec.conv);
+                n = snprintf(out + len, room, conv, v);
+                break;
+            }
+            case ARG_PTR: {
+                void *v;
+                memcpy(&v, buf + pos, sizeof(v));
+                pos += sizeof(v);
+                if (spec.conv == 'p') {
+                    snprintf(conv + c, sizeof(conv) - c, "p");
+                    n = snprintf(out + len, room, conv, v);
+                }
+                break;
+            }
+            case ARG_STR: {
+                const char *v = buf + pos;
+                pos += strlen(v) + 1;
+                snprintf(conv + c, sizeof(conv) - c, "s");
+                n = snprintf(out + len, room, conv, v);
+                break;
+            }
+            default:
+                break;
+        }
+        if (n > 0)
+            len += (size_t)n < room ? (size_t)n : room - 1;
+    }
+    out[len] = '\0';
+}
+
+static void writeRecord(const LogRecord &rec)
+{
+    if (rec.fmt) {
+        char str[1024];
+        decodeArgs(rec.text, rec.fmt, str, sizeof(str));
+        emit(rec.level, rec.file, rec.line, str);
+    } else {
+        emit(rec.level, rec.file, rec.line, rec.text);
+    }
+}
+
+static size_t drain()
+{
+    size_t n = 0;
+    while (true) {
+        LogCell *cell = &s_cells[s_dequeuePos & s_mask];
+        if (cell->seq.load(std::memory_order_acquire) != s_dequeuePos + 1)
             break;
+        writeRecord(cell->rec);
+        cell->seq.store(s_dequeuePos + s_mask + 1, std::memory_order_release);
+        s_dequeuePos++;
+        n++;
+    }
+    if (n > 0) {
+        fflush(stdout);
+        s_written += n;
+        s_flushCv.notify_all();
+    }
+    return n;
+}
+
+static void writerLoop()
+{
+    while (s_running) {
+        if (drain() > 0)
+            continue;
+        std::unique_lock<std::mutex> lock(s_wakeMtx);
+        s_wakeCv.wait_for(lock, std::chrono::milliseconds(WRITER_IDLE_MS));
     }
+    drain();
 }
+
+int logStartAsync(size_t capacity, bool deferred)
+{
+    if (s_async)
+        return 0;
+
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    s_cells = new LogCell[size];
+    for (size_t i = 0; i < size; i++)
+        s_cells[i].seq.store(i, std::memory_order_relaxed);
+    s_mask = size - 1;
+    s_deferred = deferred;
+    s_enqueuePos = 0;
+    s_dequeuePos = 0;
+    s_written = 0;
+
+    s_running = true;
+    s_writer = std::thread(writerLoop);
+    s_async.store(true, std::memory_order_release);
+
+    static bool registered = false;
+    if (!registered) {
+        atexit(logStopAsync);
+        registered = true;
+    }
+    return 0;
+}
+
+void logStopAsync()
+{
+    if (!s_async.exchange(false))
+        return;
+
+    s_running = false;
+    s_wakeCv.notify_one();
+    s_writer.join();
+
+    unsigned long long dropped = s_dropped.exchange(0);
+    if (dropped > 0)
+        printf(YELLOW"[%6s]\033[0m log: %llu messages dropped\n", "WARN", dropped);
+
+    delete[] s_cells;
+    s_cells = nullptr;
+}
+
+void logFlush()
+{
+    if (!s_async.load(std::memory_order_acquire))
+        return;
+
+    unsigned long long target = s_enqueuePos.load();
+    s_wakeCv.notify_one();
+    std::unique_lock<std::mutex> lock(s_wakeMtx);
+    s_flushCv.wait_for(lock, std::chrono::seconds(1), [target] {
+        return s_written.load() >= target;
+    });
+}
+
+unsigned long long logDropped()
+{
+    return s_dropped;
+}
+
+static LogRecord *claim(size_t &pos)
+{
+    pos = s_enqueuePos.load(std::memory_order_relaxed);
+    while (true) {
+        LogCell *cell = &s_cells[pos & s_mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (s_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                return &cell->rec;
+        } else if (dif < 0) {
+            return nullptr;
+        } else {
+            pos = s_enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void log (PriorityLevel level, const char* file, const int line, const char *fmt, ...)
+{
+    if (LogLevel < level)
+        return;
+
+    va_list args;
+    if (!s_async.load(std::memory_order_acquire)) {
+        char str[1024];
+        va_start(args, fmt);
+        vsnprintf(str, sizeof(str), fmt, args);
+        va_end(args);
+        emit(level, file, line, str);
+        return;
+    }
+
+    size_t pos;
+    LogRecord *rec = claim(pos);
+    if (!rec) {
+        s_dropped++;
+        return;
+    }
+
+    rec->level = level;
+    rec->file = file;
+    rec->line = line;
+    rec->fmt = nullptr;
+
+    bool encoded = false;
+    if (s_deferred) {
+        va_start(args, fmt);
+        encoded = encodeArgs(rec->text, fmt, args);
+        va_end(args);
+        if (encoded)
+            rec->fmt = fmt;
+    }
+    if (!encoded) {
+        va_start(args, fmt);
+        vsnprintf(rec->text, sizeof(rec->text), fmt, args);
+        va_end(args);
+    }
+
+    s_cells[pos & s_mask].seq.store(pos + 1, std::memory_order_release);
+}
\ No newline at end of file
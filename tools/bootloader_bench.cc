@@ -0,0 +1,243 @@
+#include "BootloaderBus.h"
+#include "BootloaderSession.h"
+#include "EventLoop.h"
+#include "Crc32.h"
+#include "Metrics.h"
+#include "log.h"
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <getopt.h>
+#include <new>
+#include <sys/resource.h>
+
+// Upload throughput benchmark, meant to run against bootloader_sim on a
+// vcan interface (or a real target). Flashes random images of several sizes
+// with the library's BootloaderSession and reports time, throughput, bus
+// load and the CPU time the uploader side used. The bench replaces the
+// global allocator to count the heap allocations made during each flash on
+// any thread, the flash thread and the RX, dispatch and TX threads alike;
+// that count must not grow with the image size.
+
+struct BenchConfig {
+    std::string iface = "vcan0";
+    int node = 1;
+    std::vector<size_t> sizes = { 4096, 65536, 262144 };
+    int window = 16;
+    int repeat = 3;
+    uint32_t bitrate = 500000;
+    unsigned seed = 1;
+    uint32_t busy_poll_us = 0;
+    bool scheduled = false;
+};
+
+static BenchConfig config;
+
+static std::atomic<uint64_t> allocation_count(0);
+
+// Kept out of line: once GCC inlines them it pairs free() with operator new
+// and warns (-Wmismatched-new-delete).
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    operator delete(p);
+}
+
+static double cpuSeconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static std::vector<uint8_t> randomImage(size_t size, std::mt19937 &rng)
+{
+    std::vector<uint8_t> image(size);
+    for(size_t i = 0; i < size; i++)
+        image[i] = rng();
+    // The simulator derives the image length from the last non-0xFF byte.
+    if(size && image[size - 1] == 0xFF)
+        image[size - 1] = 0x00;
+    return image;
+}
+
+static bool parseSizes(const char *arg)
+{
+    config.sizes.clear();
+    std::string list = arg;
+    size_t pos = 0;
+    while(pos <= list.size()) {
+        size_t comma = list.find(',', pos);
+        std::string item = list.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        char *end;
+        unsigned long size = strtoul(item.c_str(), &end, 0);
+        if(*end == 'k' || *end == 'K') {
+            size *= 1024;
+            end++;
+        }
+        if(item.empty() || *end || size == 0 || size % 4)
+            return false;
+        config.sizes.push_back(size);
+        if(comma == std::string::npos)
+            break;
+        pos = comma + 1;
+    }
+    return !config.sizes.empty();
+}
+
+static void printUsage(const char *prog)
+{
+    printf("Usage: %s [options]\n\n", prog);
+    printf("Upload throughput benchmark, e.g. against bootloader_sim on vcan0.\n\n");
+    printf("  -i, --iface NAME      interface (default %s)\n", config.iface.c_str());
+    printf("  -n, --node ID         target node (default %d)\n", config.node);
+    printf("  -s, --sizes LIST      image sizes, multiples of 4, e.g. 4k,64k (default 4k,64k,256k)\n");
+    printf("  -w, --window N        write window (default %d)\n", config.window);
+    printf("  -r, --repeat N        uploads per size (default %d)\n", config.repeat);
+    printf("  -b, --bitrate BPS     nominal bitrate for the bus load (default %u)\n", config.bitrate);
+    printf("  -p, --busy-poll US    spin up to US microseconds for each response\n");
+    printf("  -t, --scheduler       queue the frames through the TX scheduler\n");
+    printf("      --seed N          random seed for the images (default %u)\n", config.seed);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "iface",      required_argument,  nullptr, 'i' },
+        { "node",       required_argument,  nullptr, 'n' },
+        { "sizes",      required_argument,  nullptr, 's' },
+        { "window",     required_argument,  nullptr, 'w' },
+        { "repeat",     required_argument,  nullptr, 'r' },
+        { "bitrate",    required_argument,  nullptr, 'b' },
+        { "busy-poll",  required_argument,  nullptr, 'p' },
+        { "scheduler",  no_argument,        nullptr, 't' },
+        { "seed",       required_argument,  nullptr, 'S' },
+        { "help",       no_argument,        nullptr, 'h' },
+        { nullptr,      0,                  nullptr, 0 }
+    };
+
+    int c;
+    while((c = getopt_long(argc, argv, "i:n:s:w:r:b:p:th", options, nullptr)) != -1) {
+        switch(c) {
+            case 'i': config.iface = optarg; break;
+            case 'n': config.node = strtol(optarg, nullptr, 0); break;
+            case 's':
+                if(!parseSizes(optarg)) {
+                    fprintf(stderr, "Invalid size list: %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'w': config.window = atoi(optarg); break;
+            case 'r': config.repeat = atoi(optarg); break;
+            case 'b': config.bitrate = strtoul(optarg, nullptr, 0); break;
+            case 'p': config.busy_poll_us = strtoul(optarg, nullptr, 0); break;
+            case 't': config.scheduled = true; break;
+            case 'S': config.seed = strtoul(optarg, nullptr, 0); break;
+            case 'h':
+                printUsage(argv[0]);
+                return 0;
+            default:
+                printUsage(argv[0]);
+                return 2;
+        }
+    }
+    if(config.node < 0 || config.node >= NODE_COUNT || config.window < 1 || config.window > WINDOW_MAX || config.repeat < 1 || !config.bitrate) {
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    initLogger(NOTICE);
+
+    EventLoop rx_loop, dispatch_loop;
+    if(rx_loop.init() || dispatch_loop.init()) {
+        LOG(ERROR, "Failed to initialize event loop!");
+        return 3;
+    }
+    BootloaderBus *bus = new BootloaderBus(config.iface);
+    if(bus->open(&rx_loop, &dispatch_loop)) {
+        delete bus;
+        return 3;
+    }
+    bus->setSelectedNode(config.node);
+    dispatch_loop.start();
+    rx_loop.start();
+    if(config.scheduled)
+        bus->tx().startScheduling();
+
+    BootloaderSession *session = bus->session(config.node);
+    session->setBusyPoll(config.busy_poll_us);
+    FlashOptions opt;
+    opt.window = config.window;
+    opt.quiet = true;
+
+    std::mt19937 rng(config.seed);
+    int failures = 0;
+
+    printf("%10s %8s %10s %10s %10s %8s %8s %8s\n",
+           "size", "time s", "B/s", "tx fr/s", "rx fr/s", "bus %", "cpu s", "allocs");
+
+    for(size_t size : config.sizes) {
+        for(int run = 0; run < config.repeat; run++) {
+            std::vector<uint8_t> image = randomImage(size, rng);
+            ImageView view(image.data(), image.size());
+            uint32_t crc = Crc32::compute(image.data(), image.size());
+
+            BusStats &stats = bus->stats();
+            uint64_t tx_frames = stats.tx_frames, tx_bytes = stats.tx_bytes;
+            uint64_t rx_frames = stats.rx_frames, rx_bytes = stats.rx_bytes;
+            double cpu = cpuSeconds();
+            uint64_t allocations = allocation_count.load();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+            bool ok = session->flash(view, crc, opt);
+
+            allocations = allocation_count.load() - allocations;
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            cpu = cpuSeconds() - cpu;
+            tx_frames = stats.tx_frames - tx_frames;
+            tx_bytes = stats.tx_bytes - tx_bytes;
+            rx_frames = stats.rx_frames - rx_frames;
+            rx_bytes = stats.rx_bytes - rx_bytes;
+
+            if(!ok) {
+                failures++;
+                printf("%10zu failed: %s\n", size, session->result().c_str());
+                continue;
+            }
+
+            double bits = Metrics::busBits(tx_frames + rx_frames, tx_bytes + rx_bytes);
+            printf("%10zu %8.3f %10.0f %10.0f %10.0f %8.1f %8.3f %8llu\n",
+                   size, seconds, size / seconds, tx_frames / seconds, rx_frames / seconds,
+                   100.0 * bits / (config.bitrate * seconds), cpu, (unsigned long long)allocations);
+        }
+    }
+
+    if(config.scheduled)
+        bus->tx().stopScheduling();
+    rx_loop.quit();
+    dispatch_loop.quit();
+    delete bus;
+    return failures ? 1 : 0;
+}
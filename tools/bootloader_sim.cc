@@ -0,0 +1,548 @@
+#include "can.h"
+#include "log.h"
+#include "Crc32.h"
+#include "Lz4.h"
+#include "BootloaderProtocol.h"
+#include <vector>
+#include <mutex>
+#include <random>
+#include <string>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+// Simulated bootloader for benchmarks and tests without hardware: answers
+// the uploader's protocol for one or more node IDs on a (v)can interface.
+// Flash is a RAM array erased to 0xFF; erase and write times and the loss
+// of received frames can be configured.
+//
+// The device CRC (0x05) covers the flash from the application start up to
+// the last written byte that is not 0xFF, standing in for the image length
+// a real bootloader keeps; images must not end in 0xFF bytes.
+
+struct SimConfig {
+    std::string iface = "vcan0";
+    std::vector<int> nodes;
+    size_t flash_size = APP_END - APP_START;
+    size_t page_size = 2048;
+    uint8_t features = CAP_WINDOWED_WRITE | CAP_FULL_FRAME | CAP_CANFD | CAP_BLOCK_ACK | CAP_PAGE_CRC |
+                       CAP_ERASE_AHEAD | CAP_COMPRESSED;
+    uint8_t max_window = 32;
+    bool legacy = false;
+    int erase_ms = 200;
+    int page_erase_ms = 20;
+    int write_us = 0;
+    double loss = 0;
+    unsigned seed = 1;
+    bool verbose = false;
+};
+
+struct SimNode {
+    std::vector<uint8_t> flash;
+    size_t end = 0;
+
+    bool writing = false;
+    uint8_t mode = WRITE_MODE_LEGACY;
+    size_t chunk = 4;
+    size_t block_frames = 0;
+    size_t base = 0;        // byte offset of the running write
+    size_t ptr = 0;         // next 0x03 word
+    size_t next_offset = 0; // set by 0x0C, used by the next 0x02
+    int64_t next_idx = 0;   // one past the highest sequenced frame seen
+    std::vector<bool> received;
+    // WRITE_MODE_ERASE: time each page erase of the running write finishes,
+    // 0 while the page has not been erased yet.
+    std::vector<uint64_t> erased;
+
+    // WRITE_MODE_LZ4: the record stream as received, the frames that are in
+    // it, how far it has been decoded and where the next page goes.
+    std::vector<uint8_t> stream;
+    std::vector<bool> in_stream;
+    size_t contiguous = 0;
+    size_t decoded = 0;
+    size_t out = 0;
+    bool stream_error = false;
+};
+
+static SimConfig config;
+static SimNode nodes[NODE_COUNT];
+static Can *can = nullptr;
+static std::mt19937 rng;
+static std::mutex sim_mtx;
+static volatile sig_atomic_t quit = 0;
+
+static void onSignal(int)
+{
+    quit = 1;
+}
+
+static void reply(int node, uint8_t cmd, const uint8_t *data, size_t len)
+{
+    struct can_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = (node << 7) | cmd;
+    frame.can_dlc = len;
+    memcpy(frame.data, data, len);
+    if(can->transmit(&frame))
+        LOG(WARN, "node 0x%02X: transmit of 0x%02X failed", node, cmd);
+}
+
+// data[1] names the confirmed command, so the host can tell a late answer
+// from the one it waits for.
+static void confirm(int node, uint8_t cmd, bool ok)
+{
+    uint8_t data[3] = { (uint8_t)(ok ? 0xFF : 0x00), cmd, 0 };
+    reply(node, 0x11, data, sizeof(data));
+}
+
+static uint64_t nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Erase-ahead: the page is erased before its first byte is programmed, and
+// the erase of the following page starts in the background, so it only
+// costs time when the host outruns it.
+static void erasePageAhead(SimNode &n, size_t page)
+{
+    const uint64_t erase_us = config.page_erase_ms * 1000ULL;
+    uint64_t now = nowUs();
+
+    if(n.erased[page] == 0) {
+        usleep(erase_us);
+        memset(n.flash.data() + page * config.page_size, 0xFF, config.page_size);
+        now = nowUs();
+        n.erased[page] = now;
+    } else if(n.erased[page] > now) {
+        usleep(n.erased[page] - now);
+        now = n.erased[page];
+    }
+
+    if(page + 1 < n.erased.size() && n.erased[page + 1] == 0) {
+        memset(n.flash.data() + (page + 1) * config.page_size, 0xFF, config.page_size);
+        n.erased[page + 1] = std::max(now, n.erased[page]) + erase_us;
+    }
+}
+
+static void writeFlash(SimNode &n, size_t offset, const uint8_t *data, size_t len)
+{
+    if(offset >= n.flash.size())
+        return;
+    len = std::min(len, n.flash.size() - offset);
+    if(!n.erased.empty()) {
+        for(size_t page = offset / config.page_size; page <= (offset + len - 1) / config.page_size; page++)
+            erasePageAhead(n, page);
+    }
+    // Flash bits can only be cleared, as on the real part.
+    for(size_t i = 0; i < len; i++)
+        n.flash[offset + i] &= data[i];
+    n.end = std::max(n.end, offset + len);
+    if(config.write_us > 0)
+        usleep(config.write_us);
+}
+
+static uint32_t imageCrc(const SimNode &n)
+{
+    size_t len = n.end;
+    while(len > 0 && n.flash[len - 1] == 0xFF)
+        len--;
+    return Crc32::compute(n.flash.data(), len);
+}
+
+// Decodes every complete record at the head of the LZ4 stream into a page
+// buffer and programs it. Padding after the last record never completes.
+static void decodeStream(SimNode &n)
+{
+    while(n.contiguous < n.in_stream.size() && n.in_stream[n.contiguous])
+        n.contiguous++;
+    size_t avail = std::min(n.contiguous * n.chunk, n.stream.size());
+
+    std::vector<uint8_t> page(config.page_size);
+    while(!n.stream_error && avail - n.decoded >= 2) {
+        uint16_t header = (n.stream[n.decoded] << 8) | n.stream[n.decoded + 1];
+        size_t len = header & LZ4_RECORD_MAX;
+        if(avail - n.decoded - 2 < len)
+            break;
+        const uint8_t *src = n.stream.data() + n.decoded + 2;
+        long size;
+        if(header & LZ4_STORED) {
+            size = len <= page.size() ? (long)len : -1;
+            if(size > 0)
+                memcpy(page.data(), src, len);
+        } else {
+            size = Lz4::decompress(src, len, page.data(), page.size());
+        }
+        if(size < 0) {
+            LOG(WARN, "Malformed LZ4 record at stream offset %zu", n.decoded);
+            n.stream_error = true;
+            break;
+        }
+        writeFlash(n, n.base + n.out, page.data(), size);
+        n.out += size;
+        n.decoded += 2 + len;
+    }
+}
+
+static void receiveStream(SimNode &n, int64_t idx, const uint8_t *data, size_t len)
+{
+    size_t offset = idx * n.chunk;
+    if(n.stream.size() < offset + len)
+        n.stream.resize(offset + len);
+    memcpy(n.stream.data() + offset, data, len);
+    if((size_t)idx >= n.in_stream.size())
+        n.in_stream.resize(idx + 1, false);
+    n.in_stream[idx] = true;
+    decodeStream(n);
+}
+
+static void handleSequenced(int id, SimNode &n, uint8_t cmd, const uint8_t *data, size_t len)
+{
+    if(!n.writing || len < 2) {
+        confirm(id, cmd, false);
+        return;
+    }
+
+    uint16_t seq = (data[0] << 8) | data[1];
+    int64_t idx = n.next_idx + (int16_t)(seq - (uint16_t)n.next_idx);
+    if(idx < 0)
+        return;
+    n.next_idx = std::max(n.next_idx, idx + 1);
+
+    // 0x07 always carries a 4-byte word; FD payloads are padded with 0xFF,
+    // which leaves erased flash unchanged.
+    size_t payload = std::min(len - 2, n.chunk);
+    if(cmd == 0x07)
+        payload = std::min<size_t>(payload, 4);
+    if(n.mode & WRITE_MODE_LZ4)
+        receiveStream(n, idx, data + 2, payload);
+    else
+        writeFlash(n, n.base + idx * n.chunk, data + 2, payload);
+
+    if(n.mode & WRITE_MODE_BLOCK_ACK) {
+        if((size_t)idx >= n.received.size())
+            n.received.resize(idx + 1, false);
+        n.received[idx] = true;
+        return;
+    }
+
+    uint8_t ack[3] = { 0xFF, (uint8_t)(seq >> 8), (uint8_t)(seq & 0xFF) };
+    reply(id, 0x14, ack, sizeof(ack));
+}
+
+static void handleBlockQuery(int id, SimNode &n, const uint8_t *data, size_t len)
+{
+    if(len < 4 || !n.block_frames)
+        return;
+    uint16_t block = (data[0] << 8) | data[1];
+    size_t count = (data[2] << 8) | data[3];
+    size_t first = block * n.block_frames;
+
+    std::vector<uint32_t> parts((count + 31) / 32, 0);
+    bool complete = true;
+    for(size_t i = 0; i < count; i++) {
+        size_t idx = first + i;
+        if(idx >= n.received.size() || !n.received[idx]) {
+            parts[i / 32] |= 1u << (i % 32);
+            complete = false;
+        }
+    }
+
+    if(complete) {
+        uint8_t status[4] = { BLOCK_COMPLETE, (uint8_t)(block >> 8), (uint8_t)(block & 0xFF), 0 };
+        reply(id, 0x15, status, sizeof(status));
+        return;
+    }
+
+    size_t last = 0;
+    for(size_t p = 0; p < parts.size(); p++) {
+        if(parts[p])
+            last = p;
+    }
+    for(size_t p = 0; p <= last; p++) {
+        if(!parts[p])
+            continue;
+        uint8_t status[8] = {
+            (uint8_t)(p == last ? BLOCK_HOLES_LAST : BLOCK_HOLES_MORE),
+            (uint8_t)(block >> 8), (uint8_t)(block & 0xFF), (uint8_t)p,
+            (uint8_t)(parts[p] >> 24), (uint8_t)(parts[p] >> 16), (uint8_t)(parts[p] >> 8), (uint8_t)parts[p]
+        };
+        reply(id, 0x15, status, sizeof(status));
+    }
+}
+
+static void handleCommand(int id, uint8_t cmd, const uint8_t *data, size_t len)
+{
+    SimNode &n = nodes[id];
+
+    switch(cmd) {
+        case 0x01:
+            usleep(config.erase_ms * 1000);
+            memset(n.flash.data(), 0xFF, n.flash.size());
+            n.end = 0;
+            confirm(id, cmd, true);
+            break;
+
+        case 0x02:
+            n.writing = true;
+            n.mode = len >= 1 ? data[0] : WRITE_MODE_LEGACY;
+            n.chunk = len >= 3 && data[2] ? data[2] : 4;
+            n.block_frames = len >= 5 ? ((data[3] << 8) | data[4]) : 0;
+            n.base = n.next_offset;
+            n.ptr = n.base;
+            n.next_offset = 0;
+            n.next_idx = 0;
+            n.received.clear();
+            n.erased.clear();
+            n.stream.clear();
+            n.in_stream.clear();
+            n.contiguous = n.decoded = n.out = 0;
+            n.stream_error = false;
+            if(n.mode & WRITE_MODE_ERASE)
+                n.erased.assign(n.flash.size() / config.page_size, 0);
+            if(n.mode == WRITE_MODE_LEGACY)
+                n.end = std::max(n.end, n.base);
+            confirm(id, cmd, true);
+            break;
+
+        case 0x03:
+            if(!n.writing || len < 4) {
+                confirm(id, cmd, false);
+                break;
+            }
+            writeFlash(n, n.ptr, data, 4);
+            n.ptr += 4;
+            confirm(id, cmd, true);
+            break;
+
+        case 0x04:
+            confirm(id, cmd, n.writing && !n.stream_error);
+            n.writing = false;
+            n.erased.clear();
+            break;
+
+        case 0x05: {
+            uint32_t crc = imageCrc(n);
+            uint8_t out[4] = { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc };
+            reply(id, 0x12, out, sizeof(out));
+            break;
+        }
+
+        case 0x06: {
+            if(config.legacy)
+                break;
+            uint8_t caps[7] = {
+                1, config.features, config.max_window,
+                (uint8_t)(config.page_size >> 8), (uint8_t)(config.page_size & 0xFF),
+                (uint8_t)(config.page_erase_ms >> 8), (uint8_t)(config.page_erase_ms & 0xFF)
+            };
+            reply(id, 0x13, caps, sizeof(caps));
+            break;
+        }
+
+        case 0x07:
+        case 0x08:
+            handleSequenced(id, n, cmd, data, len);
+            break;
+
+        case 0x09:
+            handleBlockQuery(id, n, data, len);
+            break;
+
+        case 0x0A: {
+            if(len < 4)
+                break;
+            size_t first = (data[0] << 8) | data[1];
+            size_t count = (data[2] << 8) | data[3];
+            for(size_t page = first; page < first + count; page++) {
+                size_t offset = page * config.page_size;
+                if(offset + config.page_size > n.flash.size())
+                    break;
+                uint32_t crc = Crc32::compute(n.flash.data() + offset, config.page_size);
+                uint8_t out[6] = {
+                    (uint8_t)(page >> 8), (uint8_t)(page & 0xFF),
+                    (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc
+                };
+                reply(id, 0x16, out, sizeof(out));
+            }
+            break;
+        }
+
+        case 0x0B: {
+            if(len < 4) {
+                confirm(id, cmd, false);
+                break;
+            }
+            size_t first = (data[0] << 8) | data[1];
+            size_t count = (data[2] << 8) | data[3];
+            size_t offset = first * config.page_size;
+            size_t bytes = count * config.page_size;
+            if(offset + bytes > n.flash.size()) {
+                confirm(id, cmd, false);
+                break;
+            }
+            usleep(config.page_erase_ms * 1000 * count);
+            memset(n.flash.data() + offset, 0xFF, bytes);
+            confirm(id, cmd, true);
+            break;
+        }
+
+        case 0x0C:
+            if(len < 4) {
+                confirm(id, cmd, false);
+                break;
+            }
+            n.next_offset = ((size_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+            confirm(id, cmd, n.next_offset < n.flash.size());
+            break;
+
+        default:
+            if(config.verbose)
+                LOG(NOTICE, "node 0x%02X: unknown command 0x%02X", id, cmd);
+            break;
+    }
+}
+
+static void onFrame(const CanRxFrame &rx)
+{
+    const struct canfd_frame &frame = rx.frame;
+    if(frame.can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG | CAN_EFF_FLAG))
+        return;
+
+    int id = (frame.can_id >> 7) & (NODE_COUNT - 1);
+    uint8_t cmd = frame.can_id & 0x7F;
+    if(cmd >= 0x10 || nodes[id].flash.empty())
+        return;
+
+    std::lock_guard<std::mutex> lock(sim_mtx);
+    if(config.loss > 0 && std::uniform_real_distribution<double>(0, 100)(rng) < config.loss) {
+        if(config.verbose)
+            LOG(NOTICE, "node 0x%02X: dropped 0x%02X", id, cmd);
+        return;
+    }
+    if(config.verbose)
+        LOG(INFO, "node 0x%02X: cmd 0x%02X, len %d", id, cmd, frame.len);
+    handleCommand(id, cmd, frame.data, frame.len);
+}
+
+static bool parseNodes(const std::string &str)
+{
+    size_t dash = str.find('-');
+    unsigned long first, last;
+    try {
+        first = std::stoul(str.substr(0, dash), nullptr, 0);
+        last = dash == std::string::npos ? first : std::stoul(str.substr(dash + 1), nullptr, 0);
+    } catch (const std::exception &e) {
+        return false;
+    }
+    if(first > last || last >= NODE_COUNT)
+        return false;
+    for(unsigned long id = first; id <= last; id++)
+        config.nodes.push_back(id);
+    return true;
+}
+
+static void printUsage(const char *prog)
+{
+    printf("Usage: %s [options]\n\n", prog);
+    printf("Simulated bootloader on a (v)can interface.\n\n");
+    printf("  -i, --iface NAME          interface (default %s)\n", config.iface.c_str());
+    printf("  -n, --node ID[-ID]        node IDs to answer for, may be repeated (default 1)\n");
+    printf("  -f, --features MASK       capability bits reported in 0x13 (default 0x%02X)\n", config.features);
+    printf("  -l, --legacy              do not answer 0x06, stop-and-wait only\n");
+    printf("  -w, --max-window N        maximum write window (default %d)\n", config.max_window);
+    printf("  -p, --page BYTES          page size (default %zu)\n", config.page_size);
+    printf("  -E, --erase-ms MS         full erase time (default %d)\n", config.erase_ms);
+    printf("  -P, --page-erase-ms MS    erase time per page (default %d)\n", config.page_erase_ms);
+    printf("  -W, --write-us US         flash write time per data frame (default %d)\n", config.write_us);
+    printf("  -L, --loss PERCENT        drop this share of received frames (default 0)\n");
+    printf("  -s, --seed N              random seed for frame loss (default %u)\n", config.seed);
+    printf("  -v, --verbose             log every frame\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "iface",          required_argument,  nullptr, 'i' },
+        { "node",           required_argument,  nullptr, 'n' },
+        { "features",       required_argument,  nullptr, 'f' },
+        { "legacy",         no_argument,        nullptr, 'l' },
+        { "max-window",     required_argument,  nullptr, 'w' },
+        { "page",           required_argument,  nullptr, 'p' },
+        { "erase-ms",       required_argument,  nullptr, 'E' },
+        { "page-erase-ms",  required_argument,  nullptr, 'P' },
+        { "write-us",       required_argument,  nullptr, 'W' },
+        { "loss",           required_argument,  nullptr, 'L' },
+        { "seed",           required_argument,  nullptr, 's' },
+        { "verbose",        no_argument,        nullptr, 'v' },
+        { "help",           no_argument,        nullptr, 'h' },
+        { nullptr,          0,                  nullptr, 0 }
+    };
+
+    int c;
+    while((c = getopt_long(argc, argv, "i:n:f:lw:p:E:P:W:L:s:vh", options, nullptr)) != -1) {
+        switch(c) {
+            case 'i': config.iface = optarg; break;
+            case 'n':
+                if(!parseNodes(optarg)) {
+                    fprintf(stderr, "Invalid node ID: %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'f': config.features = strtoul(optarg, nullptr, 0); break;
+            case 'l': config.legacy = true; break;
+            case 'w': config.max_window = atoi(optarg); break;
+            case 'p': config.page_size = strtoul(optarg, nullptr, 0); break;
+            case 'E': config.erase_ms = atoi(optarg); break;
+            case 'P': config.page_erase_ms = atoi(optarg); break;
+            case 'W': config.write_us = atoi(optarg); break;
+            case 'L': config.loss = atof(optarg); break;
+            case 's': config.seed = strtoul(optarg, nullptr, 0); break;
+            case 'v': config.verbose = true; break;
+            case 'h':
+                printUsage(argv[0]);
+                return 0;
+            default:
+                printUsage(argv[0]);
+                return 2;
+        }
+    }
+    if(config.page_size == 0 || config.page_size > 0xFFFF || config.flash_size % config.page_size) {
+        fprintf(stderr, "Page size must divide the flash size (%zu bytes)\n", config.flash_size);
+        return 2;
+    }
+    if(config.nodes.empty())
+        config.nodes.push_back(1);
+
+    initLogger(config.verbose ? INFO : NOTICE);
+    rng.seed(config.seed);
+    for(int id : config.nodes)
+        nodes[id].flash.assign(config.flash_size, 0xFF);
+
+    can = new Can((char*)config.iface.c_str());
+    if(can->init()) {
+        LOG(ERROR, "Failed to initialize CAN interface %s!", config.iface.c_str());
+        return 3;
+    }
+    can->enableFdFrames();
+    can->setOnCanReceiveFrameCallback(onFrame);
+    can->startAutoRead();
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    LOG(NOTICE, "Simulating %zu node%s on %s (%s, page %zu, erase %d ms, write %d us, loss %.1f%%)",
+        config.nodes.size(), config.nodes.size() == 1 ? "" : "s", config.iface.c_str(),
+        config.legacy ? "legacy" : "negotiated", config.page_size, config.erase_ms, config.write_us, config.loss);
+
+    while(!quit)
+        pause();
+
+    can->stopAutoRead();
+    delete can;
+    LOG(NOTICE, "Simulator stopped");
+    return 0;
+}
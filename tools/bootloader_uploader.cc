@@ -1,29 +1,49 @@
 #include "can.h"
 #include "log.h"
+#include "EventLoop.h"
+#include "Histogram.h"
+#include "Crc32.h"
+#include "FirmwareImage.h"
+#include "BootloaderBus.h"
+#include "BootloaderSession.h"
+#include "Metrics.h"
+#include "CanCapture.h"
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <thread>
 #include <chrono>
-#include <mutex>
-#include <condition_variable>
+#include <algorithm>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
-Can *can0;
-std::mutex mtx;
-std::condition_variable cv;
-bool confirm_received = false;
-bool confirm_success = false;
-uint32_t received_crc = 0;
-bool crc_received = false;
-bool verbose_logging = true;
+// Progress lines are only drawn on a terminal.
+bool show_progress = true;
 
-uint8_t node_id = 0x01;
+int write_window = 16;
+// Also compare every page CRC after a full write (targets with page CRCs).
+bool verify_pages = false;
+EraseMode erase_mode = ERASE_OVERLAPPED;
+bool compress_writes = true;
+// Scheduling of the RX, dispatch and TX threads; each gets its own name.
+ThreadAttributes io_thread_attr;
+// Spin time per response before a waiting session sleeps.
+uint32_t busy_poll_us = 0;
+// Live metrics: the bus load is computed against bus_bitrate, stats_path
+// is rewritten every second and metrics_port serves them over HTTP.
+uint32_t bus_bitrate = 500000;
+std::string stats_path;
+int metrics_port = 0;
+// SO_SNDBUF of every interface, 0 = kernel default.
+int send_buffer = 0;
+Metrics *metrics = nullptr;
+// Received frames of all interfaces are written to capture_path.
+std::string capture_path;
+CaptureWriter capture;
 
-void setVerboseLogging(bool enabled) {
-    verbose_logging = enabled;
-}
+uint8_t node_id = 0x01;
 
 void setNodeId(uint8_t id) {
     node_id = id;
@@ -34,190 +54,83 @@ uint8_t getNodeId() {
     return node_id;
 }
 
-void rx_callback(struct can_frame rx_frame)
-{
-    std::lock_guard<std::mutex> lock(mtx);
-
-    uint8_t nodeId = rx_frame.can_id >> 7;
-    uint8_t cmd    = rx_frame.can_id & 0x7F;
+std::vector<BootloaderBus *> buses;
+BootloaderBus *current_bus = nullptr;
 
-    if (verbose_logging) {
-        LOG(INFO, "Node: %d, Cmd: 0x%02X, DLC: %d", nodeId, cmd, rx_frame.can_dlc);
-    }
+// All interfaces are read from rx_loop, which only drains the sockets into
+// each interface's RX ring; protocol handling (locks, logging) runs on
+// dispatch_loop, so a slow console cannot stall socket draining. The
+// metrics endpoint and the stats file have a loop of their own, at normal
+// priority, so scrapers and file writes never delay a response.
+#define LOG_QUEUE_SIZE  4096
 
-    if(cmd == 0x12 && rx_frame.can_dlc >= 4) {
-        received_crc = (rx_frame.data[0] << 24) | (rx_frame.data[1] << 16) | 
-                      (rx_frame.data[2] << 8) | rx_frame.data[3];
-        crc_received = true;
-        if (verbose_logging) {
-            LOG(NOTICE, "CRC received: 0x%08X", received_crc);
-        }
-        cv.notify_one();
-        return;
-    }
+EventLoop rx_loop;
+EventLoop dispatch_loop;
+EventLoop metrics_loop;
 
-    if(cmd == 0x11 && rx_frame.can_dlc >= 3) {
-        uint8_t status = rx_frame.data[0];
-        confirm_received = true;
-        confirm_success = (status == 0xFF);
-        
-        if (verbose_logging) {
-            if(confirm_success) {
-                LOG(NOTICE, "Operation confirmed");
-            } else {
-                LOG(ERROR, "Operation failed, status: 0x%02X", status);
-            }
-        }
-        cv.notify_one();
-        return;
-    }
-
-    if (verbose_logging) {
-        LOG(NOTICE, "Response from node 0x%X, cmd=0x%X, DLC=%d", nodeId, cmd, rx_frame.can_dlc);
-    }
-}
-
-bool waitConfirm(int timeout_ms = 10000)
-{
-    std::unique_lock<std::mutex> lock(mtx);
-    if(cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), []{ return confirm_received; }))
-    {
-        confirm_received = false;
-        bool success = confirm_success;
-        confirm_success = false;
-        return success;
-    }
-    LOG(ERROR, "Timeout waiting for confirmation!");
-    return false;
+BootloaderSession &currentSession() {
+    return *current_bus->session(node_id);
 }
 
-bool waitCRC(int timeout_ms = 1000)
+// The selected node of the current interface keeps receiving responses
+// while idle; the sessions add themselves while they run.
+void updateRxFilters()
 {
-    std::unique_lock<std::mutex> lock(mtx);
-    if(cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), []{ return crc_received; }))
-    {
-        crc_received = false;
-        return true;
-    }
-    LOG(ERROR, "Timeout waiting for CRC!");
-    return false;
-}
-
-uint32_t calculateFileCRC(const std::string& filename) {
-    std::ifstream file(filename, std::ios::binary);
-    if(!file.is_open()) {
-        LOG(ERROR, "Cannot open file for CRC calculation: %s", filename.c_str());
-        return 0;
-    }
-    
-    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-    file.close();
-    
-    uint32_t crc = 0xFFFFFFFF;
-    for(uint8_t byte : data) {
-        crc ^= byte;
-        for(int i = 0; i < 8; i++) {
-            if (crc & 1) {
-                crc = (crc >> 1) ^ 0xEDB88320;
-            } else {
-                crc >>= 1;
-            }
-        }
-    }
-    return ~crc;
-}
-
-// 获取命令描述
-std::string getCommandDescription(uint8_t cmd) {
-    switch(cmd) {
-        case 0x01: return "Erase flash";
-        case 0x02: return "Start write";
-        case 0x03: return "Write data";
-        case 0x04: return "End write";
-        case 0x05: return "Request CRC";
-        default: return "Unknown command";
-    }
-}
-
-bool sendCommand(uint8_t cmd, const std::vector<uint8_t> &data, bool verbose = true)
-{
-    if(cmd > 0x7F) {
-        LOG(ERROR, "Command > 0x7F not allowed for 11-bit CAN ID");
-        return false;
-    }
-
-    struct can_frame tx;
-    tx.can_id = (node_id << 7) | cmd;
-    tx.can_dlc = data.size();
-    for(size_t i = 0; i < data.size(); i++)
-        tx.data[i] = data[i];
-
-    can0->transmit(&tx);
-    
-    if(verbose && verbose_logging) {
-        std::string cmd_desc = getCommandDescription(cmd);
-        if(data.empty()) {
-            LOG(NOTICE, "Sent: %s to node 0x%02X", cmd_desc.c_str(), node_id);
-        } else {
-            if (cmd == 0x03) {
-                LOG(NOTICE, "Sent: %s to node 0x%02X", cmd_desc.c_str(), node_id);
-            } else {
-                LOG(NOTICE, "Sent: %s to node 0x%02X, Data length: %zu", cmd_desc.c_str(), node_id, data.size());
-            }
-        }
-    }
-
-    if(cmd == 0x05)
-        return waitCRC();
-
-    return waitConfirm();
+    for(BootloaderBus *bus : buses)
+        bus->setSelectedNode(bus == current_bus ? node_id : -1);
 }
 
 void printWelcome() {
     LOG(NOTICE, "==========================================");
     LOG(NOTICE, "         BootLoader Uploader v1.0");
     LOG(NOTICE, "==========================================");
+    LOG(NOTICE, "Current Interface: %s", current_bus->name().c_str());
     LOG(NOTICE, "Current Node ID: 0x%02X", node_id);
     LOG(NOTICE, "Available commands:");
+    LOG(NOTICE, "  iface   - Select CAN interface");
     LOG(NOTICE, "  setid   - Set CAN node ID");
     LOG(NOTICE, "  erase   - Erase application flash");
-    LOG(NOTICE, "  write   - Upload firmware file");
+    LOG(NOTICE, "  write   - Upload firmware file (--delta: only rewrite changed pages)");
+    LOG(NOTICE, "  pwrite  - Upload firmware file to several nodes in parallel");
+    LOG(NOTICE, "  window  - Set pipelined write window (1 = stop-and-wait)");
     LOG(NOTICE, "  crc     - Check application CRC");
     LOG(NOTICE, "  info    - Show device information");
+    LOG(NOTICE, "  scan    - Find the nodes in bootloader mode on all interfaces");
+    LOG(NOTICE, "  stats   - Print live interface and node metrics as JSON");
     LOG(NOTICE, "  exit    - Quit application");
     LOG(NOTICE, "==========================================");
 }
 
 char** commandCompletion(const char* text, int start, int end) {
     rl_attempted_completion_over = 1;
-    
+
     static std::vector<std::string> commands = {
-        "setid", "erase", "write", "crc", "info", "exit", "help"
+        "iface", "setid", "erase", "write", "pwrite", "window", "crc", "info", "scan", "stats", "exit", "help"
     };
-    
+
     if (start != 0) {
         return nullptr;
     }
-    
+
     std::vector<const char*> matches;
     for (const auto& cmd : commands) {
         if (cmd.find(text) == 0) {
             matches.push_back(strdup(cmd.c_str()));
         }
     }
-    
+
     if (matches.empty()) {
         return nullptr;
     }
-    
+
     matches.push_back(nullptr);
-    
+
     char** result = (char**)malloc(matches.size() * sizeof(char*));
     for (size_t i = 0; i < matches.size() - 1; i++) {
         result[i] = (char*)matches[i];
     }
     result[matches.size() - 1] = nullptr;
-    
+
     return result;
 }
 
@@ -228,17 +141,21 @@ void initializeReadline() {
 }
 
 void showDeviceInfo() {
+    BootloaderSession &s = currentSession();
+
     LOG(NOTICE, "Device Information:");
+    LOG(NOTICE, "  - Interface: %s", current_bus->name().c_str());
     LOG(NOTICE, "  - Current Node ID: 0x%02X", node_id);
-    LOG(NOTICE, "  - Application Start: 0x%08X", 0x08008000);
-    LOG(NOTICE, "  - Application End: 0x%08X", 0x080C0000);
+    LOG(NOTICE, "  - Application Start: 0x%08X", APP_START);
+    LOG(NOTICE, "  - Application End: 0x%08X", APP_END);
     LOG(NOTICE, "  - Flash Size: 1MB");
     LOG(NOTICE, "  - RAM Size: 256KB");
-    
+
     LOG(NOTICE, "Querying device status...");
-    if(sendCommand(0x05, {})) {
-        LOG(NOTICE, "  - Application CRC: 0x%08X", received_crc);
-        if(received_crc != 0xFFFFFFFF) {
+    uint32_t crc;
+    if(s.readCrc(crc)) {
+        LOG(NOTICE, "  - Application CRC: 0x%08X", crc);
+        if(crc != 0xFFFFFFFF) {
             LOG(NOTICE, "  - Application: VALID");
         } else {
             LOG(NOTICE, "  - Application: INVALID or not programmed");
@@ -246,144 +163,395 @@ void showDeviceInfo() {
     }
 }
 
-bool writeBinFile(const std::string &filename)
+// Progress of an interactive single-node upload. In parallel mode the
+// engine prints one combined progress line instead.
+void consoleProgress(size_t done, size_t total, bool finished)
 {
-    std::ifstream fin(filename, std::ios::binary);
-    if(!fin.is_open()) {
+    if(!show_progress)
+        return;
+
+    // Log records still queued for the writer thread go out first, so they
+    // do not end up in the middle of the progress line.
+    logFlush();
+    if(finished) {
+        printf("\n");
+        return;
+    }
+    int percent = (done * 100) / total;
+    printf("\r[PROGRESS] %zu/%zu bytes (%d%%)", done, total, percent);
+    fflush(stdout);
+}
+
+FlashOptions flashOptions(bool delta, bool parallel, const std::shared_ptr<const PreparedImage> &prepared)
+{
+    FlashOptions opt;
+    opt.prepared = prepared;
+    opt.window = write_window;
+    opt.delta = delta;
+    opt.verifyPages = verify_pages;
+    opt.erase = erase_mode;
+    opt.compress = compress_writes;
+    opt.quiet = parallel;
+    if(!parallel)
+        opt.progress = consoleProgress;
+    return opt;
+}
+
+bool loadFirmware(const std::string &filename, FirmwareImage &image)
+{
+    if(image.open(filename.c_str())) {
         LOG(ERROR, "File not found: %s", filename.c_str());
         return false;
     }
 
-    fin.seekg(0, std::ios::end);
-    size_t file_size = fin.tellg();
-    fin.seekg(0, std::ios::beg);
-    
-    if(file_size == 0) {
+    if(image.size() == 0) {
         LOG(ERROR, "File is empty: %s", filename.c_str());
         return false;
     }
 
     LOG(NOTICE, "Firmware file: %s", filename.c_str());
-    LOG(NOTICE, "File size: %zu bytes (%.2f KB)", file_size, file_size / 1024.0);
-
-    char* confirm = readline("Proceed with firmware upload? (y/n): ");
-    std::string confirm_str = confirm ? confirm : "";
-    free(confirm);
-    
-    size_t cstart = confirm_str.find_first_not_of(" \t\n\r");
-    size_t cend = confirm_str.find_last_not_of(" \t\n\r");
-    if (cstart != std::string::npos && cend != std::string::npos) {
-        confirm_str = confirm_str.substr(cstart, cend - cstart + 1);
-    } else {
-        confirm_str = "";
-    }
-    
+    if(image.format() == IMAGE_BINARY) {
+        LOG(NOTICE, "File size: %zu bytes (%.2f KB)", image.size(), image.size() / 1024.0);
+        return true;
+    }
+
+    size_t populated = 0;
+    for(const ImageSegment &seg : image.segments())
+        populated += seg.length;
+    LOG(NOTICE, "%s image: %zu segment%s, %zu bytes of data in 0x%08zX-0x%08zX", image.formatName(),
+        image.segments().size(), image.segments().size() == 1 ? "" : "s", populated,
+        (size_t)APP_START + image.segments().front().offset, (size_t)APP_START + image.size() - 1);
+    return true;
+}
+
+// readline() with pending log output written before the prompt.
+char *promptLine(const char *prompt)
+{
+    logFlush();
+    return readline(prompt);
+}
+
+std::string readTrimmedLine(const char *prompt)
+{
+    char* input = promptLine(prompt);
+    std::string str = input ? input : "";
+    free(input);
+
+    size_t start = str.find_first_not_of(" \t\n\r");
+    size_t end = str.find_last_not_of(" \t\n\r");
+    if (start != std::string::npos && end != std::string::npos) {
+        return str.substr(start, end - start + 1);
+    }
+    return "";
+}
+
+bool confirmUpload()
+{
+    std::string confirm_str = readTrimmedLine("Proceed with firmware upload? (y/n): ");
     if(confirm_str != "y" && confirm_str != "Y") {
         LOG(NOTICE, "Upload cancelled");
         return false;
     }
+    return true;
+}
 
-    std::vector<uint8_t> buf((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
-    fin.close();
+void printLatency(const char *title, const Histogram *latency)
+{
+    LOG(NOTICE, "%s", title);
+    for(int kind = 0; kind < LAT_COUNT; kind++) {
+        const Histogram &h = latency[kind];
+        if(h.count() == 0)
+            continue;
+        LOG(NOTICE, "  - %-12s n=%-7llu p50 %6llu us, p99 %6llu us, max %6llu us",
+            latencyName(kind), (unsigned long long)h.count(),
+            (unsigned long long)h.percentile(50), (unsigned long long)h.percentile(99),
+            (unsigned long long)h.max());
+    }
+}
 
-    uint32_t local_crc = calculateFileCRC(filename);
-    LOG(NOTICE, "Local file CRC: 0x%08X", local_crc);
+bool writeBinFile(const std::string &filename, bool delta = false)
+{
+    std::shared_ptr<FirmwareImage> image = std::make_shared<FirmwareImage>();
+    if(!loadFirmware(filename, *image))
+        return false;
 
-    LOG(NOTICE, "Sending erase command...");
-    if(!sendCommand(0x01, {})) {
-        LOG(ERROR, "Erase failed!");
+    if(!confirmUpload())
         return false;
+
+    std::shared_ptr<const PreparedImage> prepared = ImageCache::prepare(image);
+    LOG(NOTICE, "Local file CRC: 0x%08X", prepared->crc());
+
+    BootloaderSession &s = currentSession();
+    bool ok = s.flash(prepared->view(), prepared->crc(), flashOptions(delta, false, prepared));
+
+    Histogram latency[LAT_COUNT];
+    s.latency(latency);
+    printLatency("Command latency:", latency);
+    return ok;
+}
+
+BootloaderBus *findBus(const std::string &name)
+{
+    for(BootloaderBus *bus : buses) {
+        if(bus->name() == name)
+            return bus;
     }
+    return nullptr;
+}
 
-    LOG(NOTICE, "Sending start write command...");
-    if(!sendCommand(0x02, {})) {
-        LOG(ERROR, "Begin write failed!");
-        return false;
+// Scans all interfaces at once and lists what was found. Returns the
+// number of nodes.
+int scanBuses()
+{
+    LOG(NOTICE, "Scanning %zu interface%s...", buses.size(), buses.size() == 1 ? "" : "s");
+    std::vector<int> counts(buses.size());
+    std::vector<std::thread> scans;
+    for(size_t i = 0; i < buses.size(); i++)
+        scans.push_back(std::thread([&counts, i] { counts[i] = buses[i]->scan(); }));
+    for(std::thread &t : scans)
+        t.join();
+
+    int total = 0;
+    for(size_t i = 0; i < buses.size(); i++) {
+        total += counts[i];
+        for(const NodeInfo &info : buses[i]->inventory()) {
+            char caps[64] = "";
+            if(info.caps)
+                snprintf(caps, sizeof(caps), ", features 0x%02X, page %u", info.features, info.pageSize);
+            LOG(NOTICE, "  - %s node 0x%02X: CRC 0x%08X, %s%s", buses[i]->name().c_str(), info.node, info.crc,
+                info.valid ? "application valid" : "no application", caps);
+        }
     }
+    LOG(NOTICE, "Found %d node%s", total, total == 1 ? "" : "s");
+    return total;
+}
 
-    LOG(NOTICE, "Writing data...");
-    size_t idx = 0;
-    size_t success_count = 0;
-    size_t fail_count = 0;
-    
-    bool old_verbose = verbose_logging;
-    setVerboseLogging(false);
-    
-    while(idx < buf.size())
-    {
-        std::vector<uint8_t> word(4, 0xFF);
-        for(int i=0; i<4 && idx<buf.size(); i++)
-            word[i] = buf[idx++];
-
-        if(sendCommand(0x03, word, false)) {
-            success_count++;
-        } else {
-            fail_count++;
-            setVerboseLogging(old_verbose);
-            LOG(ERROR, "Write word failed at idx=%zu", idx-4);
-            LOG(NOTICE, "Successful writes: %zu, Failed writes: %zu", success_count, fail_count);
+// Parses "0x01,0x02,5", ranges like "1-15" and interface-qualified items
+// like "can1:1-4" into a list of sessions. Unqualified items refer to the
+// current interface. "found" stands for the nodes of the last scan, and
+// scans the interface first if it has no inventory yet.
+bool parseTargets(const std::string &str, std::vector<BootloaderSession *> &targets)
+{
+    targets.clear();
+    size_t pos = 0;
+    while(pos < str.size()) {
+        size_t comma = str.find(',', pos);
+        std::string item = str.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        pos = comma == std::string::npos ? str.size() : comma + 1;
+
+        item.erase(0, item.find_first_not_of(" \t"));
+        item.erase(item.find_last_not_of(" \t") + 1);
+        if(item.empty())
+            continue;
+
+        BootloaderBus *bus = current_bus;
+        size_t colon = item.find(':');
+        if(colon != std::string::npos) {
+            bus = findBus(item.substr(0, colon));
+            if(!bus) {
+                LOG(ERROR, "Unknown interface: %s", item.substr(0, colon).c_str());
+                return false;
+            }
+            item = item.substr(colon + 1);
+        }
+
+        if(item == "found") {
+            std::vector<NodeInfo> nodes = bus->inventory();
+            if(nodes.empty()) {
+                bus->scan();
+                nodes = bus->inventory();
+            }
+            for(const NodeInfo &info : nodes) {
+                BootloaderSession *s = bus->session(info.node);
+                if(std::find(targets.begin(), targets.end(), s) == targets.end())
+                    targets.push_back(s);
+            }
+            continue;
+        }
+
+        unsigned long first, last;
+        try {
+            size_t dash = item.find('-');
+            first = std::stoul(item.substr(0, dash), nullptr, 0);
+            last = dash == std::string::npos ? first : std::stoul(item.substr(dash + 1), nullptr, 0);
+        } catch (const std::exception& e) {
+            LOG(ERROR, "Invalid node ID: %s", item.c_str());
             return false;
         }
 
-        if(idx % 1024 == 0 || idx == buf.size()) {
-            int percent = (idx * 100) / buf.size();
-            printf("\r[PROGRESS] %zu/%zu bytes (%d%%)", idx, buf.size(), percent);
+        if(first > last || last >= NODE_COUNT) {
+            LOG(ERROR, "Node ID must be between 0 and 0x%02X: %s", NODE_COUNT - 1, item.c_str());
+            return false;
+        }
+        for(unsigned long id = first; id <= last; id++) {
+            BootloaderSession *s = bus->session(id);
+            if(std::find(targets.begin(), targets.end(), s) == targets.end())
+                targets.push_back(s);
+        }
+    }
+    return !targets.empty();
+}
+
+void printBusStats(const char *title, const std::vector<uint64_t> &baseline, double elapsed)
+{
+    LOG(NOTICE, "%s", title);
+    for(size_t i = 0; i < buses.size(); i++) {
+        BusStats &st = buses[i]->stats();
+        const CanTxPressure &tp = buses[i]->can()->txPressure();
+        uint64_t tx_frames = st.tx_frames - (baseline.empty() ? 0 : baseline[i * 2]);
+        uint64_t tx_bytes = st.tx_bytes - (baseline.empty() ? 0 : baseline[i * 2 + 1]);
+        LOG(NOTICE, "  - %s: TX %llu frames / %llu bytes (%.1f frames/s, %.1f B/s), RX %llu frames, TX errors %llu, TX waits %llu (%.1f ms), kernel drops %llu, RX ring drops %llu, error frames %llu",
+            buses[i]->name().c_str(),
+            (unsigned long long)tx_frames, (unsigned long long)tx_bytes,
+            elapsed > 0 ? tx_frames / elapsed : 0.0, elapsed > 0 ? tx_bytes / elapsed : 0.0,
+            (unsigned long long)st.rx_frames.load(), (unsigned long long)st.tx_errors.load(),
+            (unsigned long long)(tp.full + tp.nobufs), tp.wait_us / 1000.0,
+            (unsigned long long)buses[i]->can()->kernelDrops(), (unsigned long long)buses[i]->can()->rxRingOverflows(), (unsigned long long)st.error_frames.load());
+    }
+}
+
+// Written next to the target and renamed, so readers never see half a file.
+void writeStats()
+{
+    if(stats_path.empty())
+        return;
+    std::string tmp = stats_path + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "w");
+    if(!out) {
+        LOG(WARN, "Cannot write %s: %s", tmp.c_str(), strerror(errno));
+        return;
+    }
+    std::string json = metrics->json();
+    bool ok = fwrite(json.data(), 1, json.size(), out) == json.size();
+    ok = fclose(out) == 0 && ok;
+    if(!ok || rename(tmp.c_str(), stats_path.c_str()) != 0) {
+        LOG(WARN, "Cannot write %s: %s", stats_path.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+    }
+}
+
+// One node and the image that goes to it.
+struct FlashJob {
+    BootloaderSession *session;
+    std::shared_ptr<const PreparedImage> image;
+    bool delta;
+    std::string path;
+};
+
+// Flashes several nodes at once, on one or more interfaces. Each node's
+// session runs on its own thread; responses are demultiplexed by interface
+// and node ID and each interface's TX scheduler interleaves its sessions'
+// frames, so the total time approaches the bus bandwidth limit instead of N
+// uploads back to back.
+bool flashJobsParallel(const std::vector<FlashJob> &jobs)
+{
+    typedef std::chrono::steady_clock clock;
+
+    std::vector<uint64_t> baseline;
+    for(BootloaderBus *bus : buses) {
+        baseline.push_back(bus->stats().tx_frames);
+        baseline.push_back(bus->stats().tx_bytes);
+        bus->setVerbose(false);
+        bus->tx().startScheduling();
+    }
+
+    clock::time_point started = clock::now();
+    for(const FlashJob &job : jobs)
+        job.session->start(job.image->view(), job.image->crc(), flashOptions(job.delta, true, job.image));
+
+    while(true) {
+        size_t running = 0, failed = 0, done = 0;
+        size_t total = 0;
+        for(const FlashJob &job : jobs) {
+            BootloaderSession *target = job.session;
+            int state = target->state();
+            if(state == SESSION_RUNNING)
+                running++;
+            else if(state == SESSION_FAILED)
+                failed++;
+            done += target->bytesDone();
+            total += target->bytesTotal();
+        }
+
+        if(show_progress) {
+            logFlush();
+            printf("\r[PROGRESS] %zu/%zu nodes running, %zu failed, %zu/%zu bytes (%d%%)",
+                   running, jobs.size(), failed, done, total, (int)(done * 100 / total));
             fflush(stdout);
         }
+
+        if(running == 0)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
     }
-    
-    setVerboseLogging(old_verbose);
-    printf("\n");
+    if(show_progress)
+        printf("\n");
 
-    LOG(NOTICE, "Download completed! Successful writes: %zu", success_count);
+    for(const FlashJob &job : jobs)
+        job.session->wait();
 
-    LOG(NOTICE, "Sending end write command...");
-    if(!sendCommand(0x04, {})) {
-        LOG(ERROR, "End write failed!");
-        return false;
+    for(BootloaderBus *bus : buses) {
+        bus->tx().stopScheduling();
+        bus->setVerbose(true);
     }
 
-    LOG(NOTICE, "Write completed, verifying CRC...");
-    
-    if(sendCommand(0x05, {})) {
-        LOG(NOTICE, "Device CRC: 0x%08X", received_crc);
-        LOG(NOTICE, "Local CRC:  0x%08X", local_crc);
-        
-        if(received_crc == local_crc) {
-            LOG(NOTICE, "CRC verification passed!");
-            return true;
-        } else {
-            LOG(ERROR, "CRC verification failed!");
-            return false;
+    double elapsed = std::chrono::duration<double>(clock::now() - started).count();
+    size_t ok_count = 0;
+    size_t ok_bytes = 0;
+    LOG(NOTICE, "Parallel upload report:");
+    for(const FlashJob &job : jobs) {
+        BootloaderSession &s = *job.session;
+        double secs = s.seconds();
+        bool ok = s.state() == SESSION_DONE;
+        if(ok) {
+            ok_count++;
+            ok_bytes += job.image->size();
         }
-    } else {
-        LOG(ERROR, "Failed to get device CRC");
-        return false;
+        LOG(ok ? NOTICE : ERROR, "  - %s node 0x%02X: %-16s %6.2f s, %8.1f B/s",
+            s.bus()->name().c_str(), s.nodeId(), s.result().c_str(), secs, secs > 0 ? s.bytesDone() / secs : 0.0);
     }
+    LOG(NOTICE, "%zu/%zu nodes flashed in %.2f s, %.1f B/s aggregate",
+        ok_count, jobs.size(), elapsed, elapsed > 0 ? ok_bytes / elapsed : 0.0);
+    printBusStats("Interface throughput:", baseline, elapsed);
+
+    Histogram latency[LAT_COUNT];
+    Histogram node[LAT_COUNT];
+    for(const FlashJob &job : jobs) {
+        job.session->latency(node);
+        for(int kind = 0; kind < LAT_COUNT; kind++)
+            latency[kind].merge(node[kind]);
+    }
+    printLatency("Command latency (all nodes):", latency);
+
+    return ok_count == jobs.size();
 }
 
-int main()
+bool flashNodesParallel(const std::vector<BootloaderSession *> &targets,
+                        const std::shared_ptr<const PreparedImage> &image)
+{
+    std::vector<FlashJob> jobs;
+    for(BootloaderSession *target : targets) {
+        FlashJob job;
+        job.session = target;
+        job.image = image;
+        job.delta = false;
+        jobs.push_back(job);
+    }
+    return flashJobsParallel(jobs);
+}
+
+// Runs the interactive console until exit/quit or EOF.
+void runInteractive()
 {
-    initLogger(INFO);
     printWelcome();
     initializeReadline();
 
-    LOG(NOTICE, "Initializing CAN interface...");
-    
-    can0 = new Can((char*)"can0");
-    if (can0->init()) {
-        LOG(ERROR, "Failed to initialize CAN interface!");
-        return -1;
-    }
-    can0->setOnCanReceiveDataCallback(rx_callback);
-    can0->startAutoRead();
-    
-    LOG(NOTICE, "CAN interface ready");
+    LOG(NOTICE, "CAN interface ready (%zu interface%s)", buses.size(), buses.size() > 1 ? "s" : "");
 
     char* input;
-    while((input = readline("bootloader> ")) != nullptr) {
+    while((input = promptLine("bootloader> ")) != nullptr) {
         std::string cmd = input;
-        
+
         size_t start = cmd.find_first_not_of(" \t\n\r");
         size_t end = cmd.find_last_not_of(" \t\n\r");
         if (start != std::string::npos && end != std::string::npos) {
@@ -391,38 +559,40 @@ int main()
         } else {
             cmd = "";
         }
-        
+
         if (!cmd.empty()) {
             add_history(input);
         }
         free(input);
 
-        if(cmd == "setid") {
-            char* id_input = readline("Enter node ID (hex, e.g., 0x01): ");
-            std::string id_str = id_input ? id_input : "";
-            free(id_input);
-            
-            size_t istart = id_str.find_first_not_of(" \t\n\r");
-            size_t iend = id_str.find_last_not_of(" \t\n\r");
-            if (istart != std::string::npos && iend != std::string::npos) {
-                id_str = id_str.substr(istart, iend - istart + 1);
+        if(cmd == "iface") {
+            std::string name = readTrimmedLine("Enter interface name (e.g., can0): ");
+            BootloaderBus *bus = findBus(name);
+            if (bus) {
+                current_bus = bus;
+                updateRxFilters();
+                LOG(NOTICE, "Interface set to: %s", current_bus->name().c_str());
             } else {
-                id_str = "";
+                LOG(ERROR, "Unknown interface: %s", name.c_str());
             }
-            
+        }
+        else if(cmd == "setid") {
+            std::string id_str = readTrimmedLine("Enter node ID (hex, e.g., 0x01): ");
+
             if (!id_str.empty()) {
                 try {
-                    uint8_t new_id;
+                    unsigned long new_id;
                     if (id_str.find("0x") == 0 || id_str.find("0X") == 0) {
                         new_id = std::stoul(id_str, nullptr, 16);
                     } else {
                         new_id = std::stoul(id_str, nullptr, 10);
                     }
-                    
-                    if (new_id <= 0x1F) {
+
+                    if (new_id < NODE_COUNT) {
                         setNodeId(new_id);
+                        updateRxFilters();
                     } else {
-                        LOG(ERROR, "Node ID must be between 0 and 0x1F");
+                        LOG(ERROR, "Node ID must be between 0 and 0x%02X", NODE_COUNT - 1);
                     }
                 } catch (const std::exception& e) {
                     LOG(ERROR, "Invalid node ID format: %s", id_str.c_str());
@@ -431,35 +601,67 @@ int main()
         }
         else if(cmd == "erase") {
             LOG(NOTICE, "Erasing application flash...");
-            if(sendCommand(0x01, {})) {
+            if(currentSession().erase()) {
                 LOG(NOTICE, "Erase completed successfully!");
             } else {
                 LOG(ERROR, "Erase failed!");
             }
         }
-        else if(cmd == "write") {
-            char* filename_input = readline("Enter firmware file path: ");
-            std::string filename = filename_input ? filename_input : "";
-            free(filename_input);
-            
-            size_t fstart = filename.find_first_not_of(" \t\n\r");
-            size_t fend = filename.find_last_not_of(" \t\n\r");
-            if (fstart != std::string::npos && fend != std::string::npos) {
-                filename = filename.substr(fstart, fend - fstart + 1);
-            } else {
-                filename = "";
-            }
-            
-            if(writeBinFile(filename)) {
+        else if(cmd == "write" || cmd == "write --delta") {
+            std::string filename = readTrimmedLine("Enter firmware file path: ");
+
+            if(writeBinFile(filename, cmd != "write")) {
                 LOG(NOTICE, "Firmware upload completed successfully!");
             } else {
                 LOG(ERROR, "Firmware upload failed!");
             }
         }
+        else if(cmd == "pwrite") {
+            std::string node_str = readTrimmedLine("Enter node IDs (e.g., 0x01,0x02, 1-15, can1:1-4 or found): ");
+            std::vector<BootloaderSession *> targets;
+            if(!parseTargets(node_str, targets)) {
+                LOG(ERROR, "No valid node IDs given");
+                continue;
+            }
+
+            std::string filename = readTrimmedLine("Enter firmware file path: ");
+            std::shared_ptr<FirmwareImage> image = std::make_shared<FirmwareImage>();
+            if(!loadFirmware(filename, *image))
+                continue;
+
+            LOG(NOTICE, "Target nodes: %zu", targets.size());
+            if(!confirmUpload())
+                continue;
+
+            std::shared_ptr<const PreparedImage> prepared = ImageCache::prepare(image);
+            LOG(NOTICE, "Local file CRC: 0x%08X", prepared->crc());
+
+            if(flashNodesParallel(targets, prepared)) {
+                LOG(NOTICE, "Firmware upload completed successfully on all nodes!");
+            } else {
+                LOG(ERROR, "Firmware upload failed on some nodes!");
+            }
+        }
+        else if(cmd == "window") {
+            std::string win_str = readTrimmedLine("Enter write window (1-255): ");
+
+            try {
+                int new_window = std::stoi(win_str);
+                if (new_window >= 1 && new_window <= 255) {
+                    write_window = new_window;
+                    LOG(NOTICE, "Write window set to: %d", write_window);
+                } else {
+                    LOG(ERROR, "Write window must be between 1 and 255");
+                }
+            } catch (const std::exception& e) {
+                LOG(ERROR, "Invalid write window: %s", win_str.c_str());
+            }
+        }
         else if(cmd == "crc") {
+            uint32_t crc;
             LOG(NOTICE, "Requesting application CRC...");
-            if(sendCommand(0x05, {})) {
-                LOG(NOTICE, "Application CRC: 0x%08X", received_crc);
+            if(currentSession().readCrc(crc)) {
+                LOG(NOTICE, "Application CRC: 0x%08X", crc);
             } else {
                 LOG(ERROR, "Failed to get CRC!");
             }
@@ -467,6 +669,12 @@ int main()
         else if(cmd == "info") {
             showDeviceInfo();
         }
+        else if(cmd == "scan") {
+            scanBuses();
+        }
+        else if(cmd == "stats") {
+            printf("%s", metrics->json().c_str());
+        }
         else if(cmd == "exit" || cmd == "quit") {
             break;
         }
@@ -480,8 +688,626 @@ int main()
     }
 
     write_history(".bootloader_history");
-    
-    delete can0;
+}
+
+// Exit codes of batch mode.
+#define EXIT_OK             0
+#define EXIT_FLASH_FAILED   1
+#define EXIT_USAGE          2
+#define EXIT_INIT_FAILED    3
+#define EXIT_IMAGE_FAILED   4
+
+enum BatchAction {
+    ACTION_NONE = 0,
+    ACTION_WRITE,
+    ACTION_ERASE,
+    ACTION_CRC,
+    ACTION_SCAN
+};
+
+struct BatchOptions {
+    std::vector<std::string> ifaces;
+    std::string nodes;
+    std::string image;
+    std::string manifest;
+    std::string json;
+    BatchAction action = ACTION_NONE;
+    bool delta = false;
+    bool yes = false;
+};
+
+// Outcome of one node, for the JSON report.
+struct BatchResult {
+    BootloaderSession *session;
+    std::string action;
+    std::string image;
+    bool ok;
+    std::string result;
+    uint32_t crc = 0;       // crc and scan only
+    double seconds;
+};
+
+void printUsage(const char *prog)
+{
+    printf("Usage: %s [iface...]\n", prog);
+    printf("       %s [options]\n\n", prog);
+    printf("Without an action the interactive console is started on the given\n");
+    printf("interfaces (default can0).\n\n");
+    printf("Options:\n");
+    printf("  -i, --iface NAME      CAN interface, may be repeated (default can0)\n");
+    printf("  -n, --node LIST       target nodes, e.g. 3, 1-4 or can1:0x05,can0:1-2; 'found'\n");
+    printf("                        for the nodes that answer a scan\n");
+    printf("  -w, --write FILE      flash FILE to the target nodes\n");
+    printf("  -d, --delta           only rewrite pages that differ (with --write)\n");
+    printf("  -v, --verify          also compare every page CRC after a full write\n");
+    printf("  -e, --erase           erase the application of the target nodes\n");
+    printf("  -c, --crc             read the application CRC of the target nodes\n");
+    printf("  -s, --scan            list the nodes in bootloader mode on all interfaces\n");
+    printf("  -m, --manifest FILE   flash the node/image pairs listed in FILE\n");
+    printf("  -W, --window N        pipelined write window (default %d)\n", write_window);
+    printf("  -E, --erase-mode MODE full, range or overlap (default overlap)\n");
+    printf("  -Z, --no-compress     never send LZ4 compressed pages\n");
+    printf("  -C, --cache-dir DIR   keep encoded frames of each image in DIR\n");
+    printf("  -P, --rt-prio N       run the CAN I/O threads SCHED_FIFO at priority N\n");
+    printf("  -R, --rt-rr           use SCHED_RR instead of SCHED_FIFO (with --rt-prio)\n");
+    printf("  -A, --cpus LIST       pin the CAN I/O threads to CPUs, e.g. 3 or 2-3\n");
+    printf("  -L, --mlock           lock all memory to avoid page faults\n");
+    printf("  -b, --busy-poll US    spin up to US microseconds for each response\n");
+    printf("  -Q, --sndbuf BYTES    socket send buffer; below the interface queue, a full\n");
+    printf("                        queue is waited for with poll() instead of retries\n");
+    printf("  -B, --bitrate BPS     nominal bitrate for the bus load (default %u)\n", bus_bitrate);
+    printf("  -S, --stats FILE      rewrite FILE with JSON metrics every second\n");
+    printf("  -M, --metrics-port N  serve /metrics (Prometheus) and /stats (JSON) on TCP port N\n");
+    printf("  -K, --capture FILE    record all received frames to FILE (see can_replay)\n");
+    printf("  -j, --json FILE       write a JSON result to FILE ('-' for stdout)\n");
+    printf("  -y, --yes             do not ask for confirmation\n");
+    printf("  -h, --help            show this help\n\n");
+    printf("Manifest lines are '<nodes> <image> [delta]'; '#' starts a comment.\n\n");
+    printf("Exit codes: %d ok, %d flashing failed, %d usage error, %d interface error,\n",
+           EXIT_OK, EXIT_FLASH_FAILED, EXIT_USAGE, EXIT_INIT_FAILED);
+    printf("            %d image error\n", EXIT_IMAGE_FAILED);
+}
+
+// "2", "0,2" or "2-3"; CPUs are numbered from 0.
+bool parseCpuList(const char *list, std::vector<int> &cpus)
+{
+    cpus.clear();
+    std::string str(list);
+    size_t pos = 0;
+    while(pos <= str.size()) {
+        size_t end = str.find(',', pos);
+        if(end == std::string::npos)
+            end = str.size();
+        std::string item = str.substr(pos, end - pos);
+        char *rest;
+        long first = strtol(item.c_str(), &rest, 10);
+        long last = first;
+        if(*rest == '-')
+            last = strtol(rest + 1, &rest, 10);
+        if(item.empty() || *rest || first < 0 || last < first || last >= CPU_SETSIZE)
+            return false;
+        for(long cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+        pos = end + 1;
+    }
+    return !cpus.empty();
+}
+
+ThreadAttributes ioThread(const std::string &name)
+{
+    ThreadAttributes attr = io_thread_attr;
+    attr.name = name;
+    return attr;
+}
+
+// Returns -1 to go on, or the exit code to leave with.
+int parseOptions(int argc, char **argv, BatchOptions &opt)
+{
+    static const struct option options[] = {
+        { "iface",      required_argument,  nullptr, 'i' },
+        { "node",       required_argument,  nullptr, 'n' },
+        { "write",      required_argument,  nullptr, 'w' },
+        { "delta",      no_argument,        nullptr, 'd' },
+        { "verify",     no_argument,        nullptr, 'v' },
+        { "erase",      no_argument,        nullptr, 'e' },
+        { "crc",        no_argument,        nullptr, 'c' },
+        { "scan",       no_argument,        nullptr, 's' },
+        { "manifest",   required_argument,  nullptr, 'm' },
+        { "window",     required_argument,  nullptr, 'W' },
+        { "erase-mode", required_argument,  nullptr, 'E' },
+        { "no-compress", no_argument,       nullptr, 'Z' },
+        { "cache-dir",  required_argument,  nullptr, 'C' },
+        { "rt-prio",    required_argument,  nullptr, 'P' },
+        { "rt-rr",      no_argument,        nullptr, 'R' },
+        { "cpus",       required_argument,  nullptr, 'A' },
+        { "mlock",      no_argument,        nullptr, 'L' },
+        { "busy-poll",  required_argument,  nullptr, 'b' },
+        { "sndbuf",     required_argument,  nullptr, 'Q' },
+        { "bitrate",    required_argument,  nullptr, 'B' },
+        { "stats",      required_argument,  nullptr, 'S' },
+        { "metrics-port", required_argument, nullptr, 'M' },
+        { "capture",    required_argument,  nullptr, 'K' },
+        { "json",       required_argument,  nullptr, 'j' },
+        { "yes",        no_argument,        nullptr, 'y' },
+        { "help",       no_argument,        nullptr, 'h' },
+        { nullptr,      0,                  nullptr, 0 }
+    };
+
+    int c;
+    int actions = 0;
+    bool round_robin = false;
+    while((c = getopt_long(argc, argv, "i:n:w:dvecsm:W:E:ZC:P:RA:Lb:Q:B:S:M:K:j:yh", options, nullptr)) != -1) {
+        switch(c) {
+            case 'i': opt.ifaces.push_back(optarg); break;
+            case 'n': opt.nodes = optarg; break;
+            case 'w': opt.image = optarg; opt.action = ACTION_WRITE; actions++; break;
+            case 'd': opt.delta = true; break;
+            case 'v': verify_pages = true; break;
+            case 'e': opt.action = ACTION_ERASE; actions++; break;
+            case 'c': opt.action = ACTION_CRC; actions++; break;
+            case 's': opt.action = ACTION_SCAN; actions++; break;
+            case 'm': opt.manifest = optarg; opt.action = ACTION_WRITE; actions++; break;
+            case 'j': opt.json = optarg; break;
+            case 'y': opt.yes = true; break;
+            case 'Z': compress_writes = false; break;
+            case 'C': ImageCache::setDirectory(optarg); break;
+            case 'R': round_robin = true; break;
+            case 'L': io_thread_attr.lockMemory = true; break;
+            case 'b': busy_poll_us = strtoul(optarg, nullptr, 0); break;
+            case 'S': stats_path = optarg; break;
+            case 'K': capture_path = optarg; break;
+            case 'Q': send_buffer = atoi(optarg); break;
+            case 'B':
+                bus_bitrate = strtoul(optarg, nullptr, 0);
+                if(bus_bitrate == 0) {
+                    fprintf(stderr, "Bitrate must be positive\n");
+                    return EXIT_USAGE;
+                }
+                break;
+            case 'M':
+                metrics_port = atoi(optarg);
+                if(metrics_port < 1 || metrics_port > 65535) {
+                    fprintf(stderr, "Metrics port must be between 1 and 65535\n");
+                    return EXIT_USAGE;
+                }
+                break;
+            case 'P': {
+                int prio = atoi(optarg);
+                if(prio < sched_get_priority_min(SCHED_FIFO) || prio > sched_get_priority_max(SCHED_FIFO)) {
+                    fprintf(stderr, "Real-time priority must be between %d and %d\n",
+                            sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+                    return EXIT_USAGE;
+                }
+                io_thread_attr.policy = SCHED_FIFO;
+                io_thread_attr.priority = prio;
+                break;
+            }
+            case 'A':
+                if(!parseCpuList(optarg, io_thread_attr.cpus)) {
+                    fprintf(stderr, "Invalid CPU list '%s'\n", optarg);
+                    return EXIT_USAGE;
+                }
+                break;
+            case 'E':
+                if(strcmp(optarg, "full") == 0)
+                    erase_mode = ERASE_FULL;
+                else if(strcmp(optarg, "range") == 0)
+                    erase_mode = ERASE_RANGE;
+                else if(strcmp(optarg, "overlap") == 0)
+                    erase_mode = ERASE_OVERLAPPED;
+                else {
+                    fprintf(stderr, "Erase mode must be full, range or overlap\n");
+                    return EXIT_USAGE;
+                }
+                break;
+            case 'W': {
+                int window = atoi(optarg);
+                if(window < 1 || window > 255) {
+                    fprintf(stderr, "Write window must be between 1 and 255\n");
+                    return EXIT_USAGE;
+                }
+                write_window = window;
+                break;
+            }
+            case 'h':
+                printUsage(argv[0]);
+                return EXIT_OK;
+            default:
+                printUsage(argv[0]);
+                return EXIT_USAGE;
+        }
+    }
+    for(int i = optind; i < argc; i++)
+        opt.ifaces.push_back(argv[i]);
+
+    if(round_robin && io_thread_attr.policy == SCHED_OTHER) {
+        fprintf(stderr, "--rt-rr needs --rt-prio\n");
+        return EXIT_USAGE;
+    }
+    if(round_robin)
+        io_thread_attr.policy = SCHED_RR;
+
+    if(actions > 1) {
+        fprintf(stderr, "Only one of --write, --manifest, --erase, --crc and --scan may be given\n");
+        return EXIT_USAGE;
+    }
+    if(opt.action != ACTION_NONE && opt.action != ACTION_SCAN && opt.manifest.empty() && opt.nodes.empty()) {
+        fprintf(stderr, "--node is required\n");
+        return EXIT_USAGE;
+    }
+    return -1;
+}
+
+std::string jsonEscape(const std::string &str)
+{
+    std::string out;
+    for(char ch : str) {
+        if(ch == '"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if((unsigned char)ch < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", ch);
+            out += esc;
+        } else {
+            out += ch;
+        }
+    }
+    return out;
+}
+
+bool writeJson(const std::string &path, const std::vector<BatchResult> &results, int code, double elapsed)
+{
+    FILE *out = path == "-" ? stdout : fopen(path.c_str(), "w");
+    if(!out) {
+        LOG(ERROR, "Cannot write JSON result: %s", path.c_str());
+        return false;
+    }
+
+    logFlush();
+    fprintf(out, "{\n  \"ok\": %s,\n  \"exit_code\": %d,\n  \"elapsed_s\": %.3f,\n  \"nodes\": [",
+            code == EXIT_OK ? "true" : "false", code, elapsed);
+    for(size_t i = 0; i < results.size(); i++) {
+        const BatchResult &r = results[i];
+        BootloaderSession &s = *r.session;
+        fprintf(out, "%s\n    { \"iface\": \"%s\", \"node\": %d, \"action\": \"%s\", \"image\": \"%s\", "
+                "\"ok\": %s, \"result\": \"%s\", \"bytes\": %zu, \"seconds\": %.3f",
+                i ? "," : "", jsonEscape(s.bus()->name()).c_str(), s.nodeId(), r.action.c_str(),
+                jsonEscape(r.image).c_str(), r.ok ? "true" : "false", jsonEscape(r.result).c_str(),
+                s.bytesDone(), r.seconds);
+        if((r.action == "crc" || r.action == "scan") && r.ok)
+            fprintf(out, ", \"crc\": \"0x%08X\"", r.crc);
+        fprintf(out, " }");
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if(out != stdout)
+        fclose(out);
+    else
+        fflush(out);
+    return true;
+}
+
+// Reads '<nodes> <image> [delta]' lines. Images are loaded once each.
+bool loadManifest(const std::string &path, std::vector<FlashJob> &jobs)
+{
+    FILE *in = fopen(path.c_str(), "r");
+    if(!in) {
+        LOG(ERROR, "Cannot open manifest: %s", path.c_str());
+        return false;
+    }
+
+    char line[1024];
+    int lineno = 0;
+    bool ok = true;
+    std::vector<std::string> paths;
+    std::vector<std::shared_ptr<const PreparedImage>> prepared;
+    while(ok && fgets(line, sizeof(line), in)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if(hash)
+            *hash = '\0';
+
+        char nodes[256], image[768], flag[32];
+        int n = sscanf(line, "%255s %767s %31s", nodes, image, flag);
+        if(n <= 0)
+            continue;
+        if(n < 2 || (n == 3 && strcmp(flag, "delta"))) {
+            LOG(ERROR, "%s:%d: expected '<nodes> <image> [delta]'", path.c_str(), lineno);
+            ok = false;
+            break;
+        }
+
+        std::vector<BootloaderSession *> targets;
+        if(!parseTargets(nodes, targets)) {
+            LOG(ERROR, "%s:%d: invalid node list", path.c_str(), lineno);
+            ok = false;
+            break;
+        }
+
+        size_t idx = std::find(paths.begin(), paths.end(), image) - paths.begin();
+        if(idx == paths.size()) {
+            std::shared_ptr<FirmwareImage> fw = std::make_shared<FirmwareImage>();
+            paths.push_back(image);
+            if(!loadFirmware(image, *fw)) {
+                ok = false;
+                break;
+            }
+            prepared.push_back(ImageCache::prepare(fw));
+        }
+
+        for(BootloaderSession *target : targets) {
+            for(const FlashJob &job : jobs) {
+                if(job.session == target) {
+                    LOG(ERROR, "%s:%d: %s node 0x%02X listed twice", path.c_str(), lineno,
+                        target->bus()->name().c_str(), target->nodeId());
+                    ok = false;
+                }
+            }
+            FlashJob job;
+            job.session = target;
+            job.image = prepared[idx];
+            job.delta = n == 3;
+            job.path = image;
+            jobs.push_back(job);
+        }
+    }
+    fclose(in);
+
+    if(ok && jobs.empty()) {
+        LOG(ERROR, "Manifest lists no nodes: %s", path.c_str());
+        ok = false;
+    }
+    return ok;
+}
+
+// Asks on a terminal unless --yes was given; refuses without one.
+bool confirmBatch(const BatchOptions &opt)
+{
+    if(opt.yes)
+        return true;
+    if(!isatty(STDIN_FILENO)) {
+        LOG(ERROR, "Refusing to modify flash without --yes when not on a terminal");
+        return false;
+    }
+    std::string confirm_str = readTrimmedLine("Proceed? (y/n): ");
+    return confirm_str == "y" || confirm_str == "Y";
+}
+
+// The station still gets a JSON result when the interfaces cannot be set up.
+int initFailed(const BatchOptions &opt)
+{
+    if(opt.action != ACTION_NONE && !opt.json.empty())
+        writeJson(opt.json, std::vector<BatchResult>(), EXIT_INIT_FAILED, 0);
+    return EXIT_INIT_FAILED;
+}
+
+int runBatch(const BatchOptions &opt)
+{
+    typedef std::chrono::steady_clock clock;
+
+    clock::time_point started = clock::now();
+    std::vector<BatchResult> results;
+    std::vector<FlashJob> jobs;
+    int code = EXIT_OK;
+
+    std::vector<BootloaderSession *> targets;
+    if(!opt.nodes.empty() && !parseTargets(opt.nodes, targets))
+        code = EXIT_USAGE;
+
+    if(code == EXIT_OK && opt.action == ACTION_WRITE) {
+        if(!opt.manifest.empty()) {
+            if(!loadManifest(opt.manifest, jobs))
+                code = EXIT_IMAGE_FAILED;
+        } else {
+            std::shared_ptr<FirmwareImage> fw = std::make_shared<FirmwareImage>();
+            if(!loadFirmware(opt.image, *fw)) {
+                code = EXIT_IMAGE_FAILED;
+            } else {
+                std::shared_ptr<const PreparedImage> prepared = ImageCache::prepare(fw);
+                LOG(NOTICE, "Local file CRC: 0x%08X", prepared->crc());
+                for(BootloaderSession *target : targets) {
+                    FlashJob job;
+                    job.session = target;
+                    job.image = prepared;
+                    job.delta = opt.delta;
+                    job.path = opt.image;
+                    jobs.push_back(job);
+                }
+            }
+        }
+    }
+
+    if(code == EXIT_OK && opt.action != ACTION_CRC && opt.action != ACTION_SCAN && !confirmBatch(opt))
+        code = EXIT_USAGE;
+
+    if(code == EXIT_OK && opt.action == ACTION_WRITE) {
+        bool ok;
+        if(jobs.size() == 1) {
+            BootloaderSession &s = *jobs[0].session;
+            current_bus = s.bus();
+            node_id = s.nodeId();
+            updateRxFilters();
+            ok = s.flash(jobs[0].image->view(), jobs[0].image->crc(), flashOptions(jobs[0].delta, false, jobs[0].image));
+
+            Histogram latency[LAT_COUNT];
+            s.latency(latency);
+            printLatency("Command latency:", latency);
+        } else {
+            ok = flashJobsParallel(jobs);
+        }
+        if(!ok)
+            code = EXIT_FLASH_FAILED;
+
+        for(const FlashJob &job : jobs) {
+            BatchResult r;
+            r.session = job.session;
+            r.action = job.delta ? "delta" : "write";
+            r.image = job.path;
+            r.ok = job.session->state() == SESSION_DONE;
+            r.result = job.session->result();
+            r.seconds = job.session->seconds();
+            results.push_back(r);
+        }
+    }
+
+    if(code == EXIT_OK && (opt.action == ACTION_ERASE || opt.action == ACTION_CRC)) {
+        for(BootloaderSession *target : targets) {
+            BootloaderSession &s = *target;
+            current_bus = s.bus();
+            node_id = s.nodeId();
+            updateRxFilters();
+
+            clock::time_point t0 = clock::now();
+            BatchResult r;
+            r.session = &s;
+            r.action = opt.action == ACTION_ERASE ? "erase" : "crc";
+            uint32_t crc = 0;
+            r.ok = opt.action == ACTION_ERASE ? s.erase() : s.readCrc(crc);
+            r.result = s.result();
+            r.crc = crc;
+            r.seconds = std::chrono::duration<double>(clock::now() - t0).count();
+            if(r.ok && opt.action == ACTION_CRC)
+                LOG(NOTICE, "%s node 0x%02X: Application CRC 0x%08X", s.bus()->name().c_str(), s.nodeId(), crc);
+            else if(!r.ok)
+                LOG(ERROR, "%s node 0x%02X: %s", s.bus()->name().c_str(), s.nodeId(), s.result().c_str());
+            if(!r.ok)
+                code = EXIT_FLASH_FAILED;
+            results.push_back(r);
+        }
+    }
+
+    if(code == EXIT_OK && opt.action == ACTION_SCAN) {
+        clock::time_point t0 = clock::now();
+        scanBuses();
+        double seconds = std::chrono::duration<double>(clock::now() - t0).count();
+        for(BootloaderBus *bus : buses) {
+            for(const NodeInfo &info : bus->inventory()) {
+                BatchResult r;
+                r.session = bus->session(info.node);
+                r.action = "scan";
+                r.ok = true;
+                r.result = "OK";
+                r.crc = info.crc;
+                r.seconds = seconds;
+                results.push_back(r);
+            }
+        }
+    }
+
+    double elapsed = std::chrono::duration<double>(clock::now() - started).count();
+    if(!opt.json.empty())
+        writeJson(opt.json, results, code, elapsed);
+
+    return code;
+}
+
+// Usage: bootloader_uploader [iface...]   (defaults to can0)
+//        bootloader_uploader --iface can0 --node 3 --write fw.bin --yes
+// See printUsage() for the batch options.
+int main(int argc, char **argv)
+{
+    BatchOptions opt;
+    int code = parseOptions(argc, argv, opt);
+    if (code >= 0)
+        return code;
+    bool batch = opt.action != ACTION_NONE;
+    show_progress = isatty(STDOUT_FILENO) && !(batch && opt.json == "-");
+
+    // With the JSON result on stdout, log output goes to stderr.
+    if (batch && opt.json == "-") {
+        logSetSinks(0);
+        logOpenFile("/dev/stderr");
+    }
+    initLogger(INFO);
+    // Logging runs on its own thread so console output never blocks the
+    // RX dispatch or the writers.
+    logStartAsync(LOG_QUEUE_SIZE, false);
+    std::chrono::steady_clock::time_point program_start = std::chrono::steady_clock::now();
+
+    std::vector<std::string> ifaces = opt.ifaces;
+    if (ifaces.empty())
+        ifaces.push_back("can0");
+
+    LOG(NOTICE, "Initializing CAN interface...");
+
+    if (rx_loop.init() || dispatch_loop.init() || metrics_loop.init()) {
+        LOG(ERROR, "Failed to initialize event loop!");
+        return initFailed(opt);
+    }
+
+    for (const std::string &name : ifaces) {
+        BootloaderBus *bus = new BootloaderBus(name);
+        buses.push_back(bus);
+        if (bus->open(&rx_loop, &dispatch_loop))
+            return initFailed(opt);
+        bus->tx().setAttributes(ioThread("tx-" + name));
+        if (send_buffer > 0)
+            bus->can()->setSendBuffer(send_buffer);
+        for (int node = 0; node < NODE_COUNT; node++)
+            bus->session(node)->setBusyPoll(busy_poll_us);
+    }
+    current_bus = buses[0];
+    updateRxFilters();
+
+    if (!capture_path.empty()) {
+        if (capture.open(capture_path))
+            return initFailed(opt);
+        for (BootloaderBus *bus : buses) {
+            int channel = capture.addChannel(bus->name());
+            if (channel < 0)
+                return initFailed(opt);
+            bus->can()->setCapture(&capture, channel);
+        }
+        ThreadAttributes attr;
+        attr.name = "can-capture";
+        capture.setAttributes(attr);
+        capture.start();
+    }
+
+    metrics = new Metrics(bus_bitrate);
+    for (BootloaderBus *bus : buses)
+        metrics->addBus(bus);
+    MetricsServer metrics_server(metrics);
+    if (metrics_port && metrics_server.open(&metrics_loop, metrics_port))
+        return initFailed(opt);
+    metrics_loop.addTimer(1000, true, [] {
+        metrics->sample();
+        writeStats();
+    });
+
+    dispatch_loop.setAttributes(ioThread("can-dispatch"));
+    rx_loop.setAttributes(ioThread("can-rx"));
+    ThreadAttributes metrics_attr;
+    metrics_attr.name = "metrics";
+    metrics_loop.setAttributes(metrics_attr);
+    dispatch_loop.start();
+    rx_loop.start();
+    metrics_loop.start();
+
+    code = EXIT_OK;
+    if (batch)
+        code = runBatch(opt);
+    else
+        runInteractive();
+
+    printBusStats("Interface statistics:", std::vector<uint64_t>(),
+                  std::chrono::duration<double>(std::chrono::steady_clock::now() - program_start).count());
+
+    metrics_loop.quit();
+    rx_loop.quit();
+    dispatch_loop.quit();
+    if (!capture_path.empty()) {
+        capture.close();
+        LOG(NOTICE, "Captured %llu frames to %s (%llu dropped)", (unsigned long long)capture.frames(),
+            capture_path.c_str(), (unsigned long long)capture.drops());
+    }
+    metrics->sample();
+    writeStats();
+    delete metrics;
+    for (BootloaderBus *bus : buses)
+        delete bus;
     LOG(NOTICE, "Goodbye!");
-    return 0;
+    logStopAsync();
+    return code;
 }
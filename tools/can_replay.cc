@@ -0,0 +1,269 @@
+#include "can.h"
+#include "log.h"
+#include "CanCapture.h"
+#include "Metrics.h"
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+// Plays a capture written by CaptureWriter (bootloader_uploader --capture)
+// back onto a (v)can interface, with the recorded gaps between frames
+// (scaled by --speed) or back to back, so RX handling can be benchmarked
+// and regression tested with real traffic. Error frames cannot be sent and
+// are skipped. --candump prints the capture as a candump log instead.
+
+struct ReplayConfig {
+    std::string iface = "vcan0";
+    std::string channel;    // empty = all channels
+    double speed = 1.0;
+    bool max_speed = false;
+    int loops = 1;          // 0 = until interrupted
+    bool candump = false;
+};
+
+struct ReplayStats {
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t skipped = 0;
+    uint64_t failed = 0;
+    uint64_t max_lag_us = 0;
+};
+
+static ReplayConfig config;
+static ReplayStats stats;
+static Can *can = nullptr;
+static volatile sig_atomic_t quit = 0;
+
+static std::vector<struct canfd_frame> pending;
+static bool pending_fd = false;
+
+static void onSignal(int)
+{
+    quit = 1;
+}
+
+// Sends the pending frames, waiting for socket room like TxScheduler.
+static void flushPending()
+{
+    size_t sent = 0;
+    unsigned backoff_us = 0;
+    uint64_t deadline = Can::txDeadline();
+    while(sent < pending.size() && !quit) {
+        int ret;
+        if(pending_fd) {
+            ret = can->transmitFdBatch(pending.data() + sent, pending.size() - sent);
+        } else {
+            struct can_frame classic[Can::TX_BATCH];
+            size_t n = pending.size() - sent < Can::TX_BATCH ? pending.size() - sent : Can::TX_BATCH;
+            for(size_t i = 0; i < n; i++)
+                memcpy(&classic[i], &pending[sent + i], CAN_MTU);
+            ret = can->transmitBatch(classic, n);
+        }
+        if(ret > 0) {
+            for(int i = 0; i < ret; i++)
+                stats.bytes += pending[sent + i].len;
+            sent += ret;
+            backoff_us = 0;
+            deadline = Can::txDeadline();
+            continue;
+        }
+        if(!can->waitTxRoom(errno, backoff_us, deadline))
+            break;
+    }
+    stats.frames += sent;
+    stats.failed += pending.size() - sent;
+    pending.clear();
+}
+
+static void queueFrame(const struct canfd_frame &frame, bool fd)
+{
+    if(!pending.empty() && (fd != pending_fd || pending.size() == Can::TX_BATCH))
+        flushPending();
+    pending_fd = fd;
+    pending.push_back(frame);
+}
+
+// One line of `candump -L`: "(sec.usec) iface ID#DATA", "ID##FDATA" for
+// FD frames with F the BRS/ESI flags, "ID#R" for remote frames.
+static void printCandump(const CaptureFrame &f, const std::string &iface)
+{
+    const struct canfd_frame &frame = f.frame;
+    char id[16];
+    if(frame.can_id & CAN_ERR_FLAG)
+        snprintf(id, sizeof(id), "%08X", frame.can_id & (CAN_ERR_MASK | CAN_ERR_FLAG));
+    else if(frame.can_id & CAN_EFF_FLAG)
+        snprintf(id, sizeof(id), "%08X", frame.can_id & CAN_EFF_MASK);
+    else
+        snprintf(id, sizeof(id), "%03X", frame.can_id & CAN_SFF_MASK);
+
+    printf("(%llu.%06llu) %s %s", (unsigned long long)(f.ts_ns / 1000000000ULL),
+           (unsigned long long)(f.ts_ns % 1000000000ULL / 1000), iface.c_str(), id);
+    if(frame.flags & CANFD_FDF)
+        printf("##%X", frame.flags & (CANFD_BRS | CANFD_ESI));
+    else if(frame.can_id & CAN_RTR_FLAG)
+        printf("#R");
+    else
+        printf("#");
+    if(!(frame.can_id & CAN_RTR_FLAG) || (frame.flags & CANFD_FDF)) {
+        for(int i = 0; i < frame.len; i++)
+            printf("%02X", frame.data[i]);
+    }
+    printf("\n");
+}
+
+static int exportCandump(CaptureReader &reader, int channel)
+{
+    CaptureFrame f;
+    while(!quit && reader.next(f)) {
+        if(channel >= 0 && f.channel != channel)
+            continue;
+        std::string name = reader.channelName(f.channel);
+        if(name.empty())
+            name = "can" + std::to_string(f.channel);
+        printCandump(f, name);
+    }
+    return 0;
+}
+
+static void replayOnce(CaptureReader &reader, int channel)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start;
+    uint64_t first_ns = 0;
+    bool first = true;
+
+    reader.rewind();
+    CaptureFrame f;
+    while(!quit && reader.next(f)) {
+        if(channel >= 0 && f.channel != channel)
+            continue;
+        bool fd = f.frame.flags & CANFD_FDF;
+        if((f.frame.can_id & CAN_ERR_FLAG) || (fd && !can->isFdEnabled())) {
+            stats.skipped++;
+            continue;
+        }
+
+        if(!config.max_speed) {
+            Clock::time_point now = Clock::now();
+            if(first) {
+                start = now;
+                first_ns = f.ts_ns;
+                first = false;
+            }
+            // Channels are interleaved, so time may step back a little.
+            uint64_t offset_ns = f.ts_ns > first_ns ? (f.ts_ns - first_ns) / config.speed : 0;
+            Clock::time_point due = start + std::chrono::nanoseconds(offset_ns);
+            if(due > now) {
+                flushPending();
+                std::this_thread::sleep_until(due);
+            } else {
+                uint64_t lag_us = std::chrono::duration_cast<std::chrono::microseconds>(now - due).count();
+                if(lag_us > stats.max_lag_us)
+                    stats.max_lag_us = lag_us;
+            }
+        }
+        queueFrame(f.frame, fd);
+    }
+    flushPending();
+}
+
+static void printUsage(const char *prog)
+{
+    printf("Usage: %s [options] FILE\n\n", prog);
+    printf("Replays a capture (bootloader_uploader --capture) onto a (v)can interface.\n\n");
+    printf("  -i, --iface NAME      interface to send on (default %s)\n", config.iface.c_str());
+    printf("  -c, --channel NAME    only frames captured on NAME (default all)\n");
+    printf("  -s, --speed X         time scale, 2 = twice as fast (default 1)\n");
+    printf("  -x, --max             send back to back, as fast as the socket takes them\n");
+    printf("  -l, --loop N          replay N times, 0 = until interrupted (default 1)\n");
+    printf("  -D, --candump         print the capture as a candump log instead of sending\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "iface",      required_argument,  nullptr, 'i' },
+        { "channel",    required_argument,  nullptr, 'c' },
+        { "speed",      required_argument,  nullptr, 's' },
+        { "max",        no_argument,        nullptr, 'x' },
+        { "loop",       required_argument,  nullptr, 'l' },
+        { "candump",    no_argument,        nullptr, 'D' },
+        { "help",       no_argument,        nullptr, 'h' },
+        { nullptr,      0,                  nullptr, 0 }
+    };
+
+    int c;
+    while((c = getopt_long(argc, argv, "i:c:s:xl:Dh", options, nullptr)) != -1) {
+        switch(c) {
+            case 'i': config.iface = optarg; break;
+            case 'c': config.channel = optarg; break;
+            case 's':
+                config.speed = atof(optarg);
+                if(config.speed <= 0) {
+                    fprintf(stderr, "Speed must be positive\n");
+                    return 2;
+                }
+                break;
+            case 'x': config.max_speed = true; break;
+            case 'l': config.loops = atoi(optarg); break;
+            case 'D': config.candump = true; break;
+            case 'h':
+                printUsage(argv[0]);
+                return 0;
+            default:
+                printUsage(argv[0]);
+                return 2;
+        }
+    }
+    if(optind != argc - 1) {
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    initLogger(NOTICE);
+    CaptureReader reader;
+    if(reader.open(argv[optind]))
+        return 3;
+    int channel = -1;
+    if(!config.channel.empty()) {
+        channel = reader.findChannel(config.channel);
+        if(channel < 0) {
+            LOG(ERROR, "No channel %s in %s", config.channel.c_str(), argv[optind]);
+            return 3;
+        }
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    if(config.candump)
+        return exportCandump(reader, channel);
+
+    can = new Can((char*)config.iface.c_str());
+    if(can->init()) {
+        LOG(ERROR, "Failed to initialize CAN interface %s!", config.iface.c_str());
+        return 3;
+    }
+    can->enableFdFrames();
+    pending.reserve(Can::TX_BATCH);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(int pass = 0; !quit && (config.loops == 0 || pass < config.loops); pass++)
+        replayOnce(reader, channel);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const CanTxPressure &tx = can->txPressure();
+    LOG(NOTICE, "Sent %llu frames in %.3f s (%.0f frames/s, %.0f bit/s without stuff bits)",
+        (unsigned long long)stats.frames, secs, secs > 0 ? stats.frames / secs : 0.0,
+        secs > 0 ? Metrics::busBits(stats.frames, stats.bytes) / secs : 0.0);
+    LOG(NOTICE, "Skipped %llu, failed %llu, TX waits %llu (%.1f ms), max lag %.3f ms",
+        (unsigned long long)stats.skipped, (unsigned long long)stats.failed,
+        (unsigned long long)(tx.full + tx.nobufs), tx.wait_us / 1000.0, stats.max_lag_us / 1000.0);
+    delete can;
+    return stats.failed ? 1 : 0;
+}